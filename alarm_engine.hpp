@@ -0,0 +1,326 @@
+/*
+* \brief Evaluation of many alarms on analog values, reporting only their changes
+*
+* An AlarmEngine holds alarms comparing channels of an array of values in the input with limits. An alarm is raised when
+* its value stays beyond the limit for its delay and cleared when the value returns past the limit by its hysteresis.
+* Raised alarms must be acknowledged, which can happen while they're raised or after they're cleared.
+*
+* The definitions and states of the alarms are stored in separate arrays and every tick evaluates all of them in a loop
+* without branches, the alarms whose state changed are then found by a scan that compares their old and new states. Only
+* the changes are reported as AlarmEvent, through an EventRing that another thread reads without ever blocking the
+* execution. Acknowledgements come from that thread through another EventRing.
+*/
+
+#ifndef STATE_MACHINE_ALARM_ENGINE_H
+#define STATE_MACHINE_ALARM_ENGINE_H
+
+#include "timed_object.hpp"
+#include <atomic>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+
+/*!
+* \brief A bounded queue with one producer thread and one consumer thread, neither ever waits
+*/
+template<typename T>
+class EventRing {
+	std::vector<T> slots_;
+	std::size_t mask_;
+	std::atomic<std::size_t> head_; // Written only by the producer
+	char padding_[64]; // Keeps the indexes of the two threads in different cache lines
+	std::atomic<std::size_t> tail_; // Written only by the consumer
+
+public:
+	/*!
+	* \brief The constructor
+	*
+	* \param The capacity, rounded up to a power of two
+	*/
+	EventRing(std::size_t capacity) :
+		head_(0),
+		tail_(0)
+	{
+		std::size_t size = 1;
+		while(size < capacity)
+			size *= 2;
+		slots_.resize(size);
+		mask_ = size - 1;
+	}
+
+	/*!
+	* \brief Appends an element, called only by the producer
+	*
+	* \param The element
+	*
+	* \return False if the ring was full and the element was not added
+	*/
+	bool push(const T &element)
+	{
+		std::size_t head = head_.load(std::memory_order_relaxed);
+		if(head - tail_.load(std::memory_order_acquire) == slots_.size())
+			return false;
+		slots_[head & mask_] = element;
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	/*!
+	* \brief Removes the oldest element, called only by the consumer
+	*
+	* \param Where to write the element
+	*
+	* \return False if the ring was empty
+	*/
+	bool pop(T &element)
+	{
+		std::size_t tail = tail_.load(std::memory_order_relaxed);
+		if(tail == head_.load(std::memory_order_acquire))
+			return false;
+		element = slots_[tail & mask_];
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+struct AlarmEvent {
+	enum Kind {
+		RAISED,
+		CLEARED,
+		ACKNOWLEDGED
+	};
+	std::uint32_t alarm; // Index of the alarm
+	Kind kind;
+	float value; // The value of the alarm's channel
+	long long time; // The frame time of the tick, in milliseconds, 0 if the engine was updated directly
+};
+
+template<typename Input, typename Output>
+class AlarmEngine : public TimedObject<Input, Output> {
+	std::function<const float *(const Input &)> source_;
+	// Definitions
+	std::vector<std::uint32_t> channels_;
+	std::vector<float> signs_; // 1 for high alarms, -1 for low alarms, so that both compare the same way
+	std::vector<float> limits_; // Multiplied by the signs
+	std::vector<float> hystereses_;
+	std::vector<float> delays_;
+	// States
+	std::vector<float> values_; // Multiplied by the signs
+	std::vector<float> times_; // Since the update that saw the value beyond the limit
+	std::vector<std::uint8_t> beyond_; // In the previous update
+	std::vector<std::uint8_t> active_;
+	std::vector<std::uint8_t> wasActive_;
+	std::vector<std::uint8_t> acknowledged_;
+	EventRing<AlarmEvent> events_;
+	EventRing<std::uint32_t> acknowledgements_;
+	std::atomic<unsigned long long> lost_;
+	long long time_ = 0;
+	bool started_ = false;
+
+	void report(std::uint32_t alarm, AlarmEvent::Kind kind)
+	{
+		if(!events_.push(AlarmEvent{ alarm, kind, values_[alarm] * signs_[alarm], time_ }))
+			lost_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+public:
+	// Handle of an alarm, it's only an index
+	struct Alarm {
+		std::uint32_t index;
+	};
+
+	/*!
+	* \brief The constructor
+	*
+	* \param A function returning the array of values in the input that the alarms watch
+	* \param The capacity of the rings of events and acknowledgements
+	*/
+	AlarmEngine(std::function<const float *(const Input &)> source, std::size_t capacity = 4096) :
+		source_(source),
+		events_(capacity),
+		acknowledgements_(capacity),
+		lost_(0)
+	{
+	}
+
+	/*!
+	* \brief Adds an alarm
+	*
+	* \param The index of the watched value in the array
+	* \param The limit
+	* \param True if the alarm is raised above the limit, false if below
+	* \param How far the value has to return past the limit to clear the alarm
+	* \param How long the value has to be beyond the limit to raise the alarm, in milliseconds
+	*
+	* \return The handle of the alarm
+	*
+	* \note The execution must be paused to add alarms to an engine that is in a manager
+	*/
+	Alarm addAlarm(std::uint32_t channel, float limit, bool high, float hysteresis = 0, float delay = 0)
+	{
+		if(hysteresis < 0 || delay < 0)
+			throw std::invalid_argument("Hysteresis and delay can't be negative");
+		const float sign = high ? 1.0f : -1.0f;
+		channels_.push_back(channel);
+		signs_.push_back(sign);
+		limits_.push_back(limit * sign);
+		hystereses_.push_back(hysteresis);
+		delays_.push_back(delay);
+		values_.push_back(0);
+		times_.push_back(0);
+		beyond_.push_back(0);
+		active_.push_back(0);
+		wasActive_.push_back(0);
+		acknowledged_.push_back(1);
+		return Alarm{ std::uint32_t(channels_.size() - 1) };
+	}
+
+	/*!
+	* \brief Acknowledges an alarm, takes effect in the next tick, called only by the thread reading the events
+	*
+	* \param The alarm
+	*
+	* \return False if the ring of acknowledgements was full
+	*/
+	bool acknowledge(Alarm alarm)
+	{
+		return acknowledgements_.push(alarm.index);
+	}
+
+	/*!
+	* \brief Takes the oldest unread change of an alarm, called only by the thread reading the events
+	*
+	* \param Where to write the event
+	*
+	* \return False if there was none
+	*/
+	bool nextEvent(AlarmEvent &event)
+	{
+		return events_.pop(event);
+	}
+
+	/*!
+	* \brief Returns the number of events that were dropped because the ring was full
+	*
+	* \return The number, it can be read from any thread
+	*/
+	unsigned long long lostEvents() const
+	{
+		return lost_.load(std::memory_order_relaxed);
+	}
+
+	/*!
+	* \brief Checks if an alarm is raised, meant for objects run after the engine
+	*
+	* \param The alarm
+	*
+	* \return If it is
+	*/
+	bool active(Alarm alarm) const
+	{
+		return active_[alarm.index];
+	}
+
+	/*!
+	* \brief Checks if an alarm was acknowledged since it was last raised, meant for objects run after the engine
+	*
+	* \param The alarm
+	*
+	* \return If it was
+	*/
+	bool acknowledged(Alarm alarm) const
+	{
+		return acknowledged_[alarm.index];
+	}
+
+	/*!
+	* \brief Evaluates all alarms
+	*
+	* \param The array of watched values
+	* \param The time since the last evaluation in milliseconds
+	*/
+	void update(const float *source, float step)
+	{
+		std::uint32_t acknowledged;
+		while(acknowledgements_.pop(acknowledged))
+			if(acknowledged < acknowledged_.size() && !acknowledged_[acknowledged]) {
+				acknowledged_[acknowledged] = 1;
+				report(acknowledged, AlarmEvent::ACKNOWLEDGED);
+			}
+		const std::size_t count = channels_.size();
+		{
+			const std::uint32_t *channels = channels_.data();
+			const float *signs = signs_.data();
+			float *values = values_.data();
+			for(std::size_t i = 0; i < count; i++)
+				values[i] = source[channels[i]] * signs[i];
+		}
+		{
+			const float *values = values_.data();
+			const float *limits = limits_.data();
+			const float *hystereses = hystereses_.data();
+			const float *delays = delays_.data();
+			float *times = times_.data();
+			std::uint8_t *wasBeyond = beyond_.data();
+			std::uint8_t *active = active_.data();
+			std::uint8_t *wasActive = wasActive_.data();
+			for(std::size_t i = 0; i < count; i++) {
+				// A raised alarm uses a limit shifted by the hysteresis
+				std::uint8_t beyond = values[i] > limits[i] - (active[i] ? hystereses[i] : 0.0f);
+				// Times from 0 in the update that saw it beyond, the time before that isn't known to be beyond
+				times[i] = (beyond & wasBeyond[i]) ? times[i] + step : 0.0f;
+				wasBeyond[i] = beyond;
+				wasActive[i] = active[i];
+				active[i] = beyond & (active[i] | (times[i] >= delays[i]));
+			}
+		}
+		// Compare eight alarms at once, changes are rare
+		std::size_t i = 0;
+		for(; i + 8 <= count; i += 8) {
+			std::uint64_t now, before;
+			std::memcpy(&now, &active_[i], 8);
+			std::memcpy(&before, &wasActive_[i], 8);
+			if(now == before)
+				continue;
+			for(std::size_t j = i; j < i + 8; j++)
+				if(active_[j] != wasActive_[j])
+					raiseOrClear(j);
+		}
+		for(; i < count; i++)
+			if(active_[i] != wasActive_[i])
+				raiseOrClear(i);
+	}
+
+	/*!
+	* \brief Evaluates all alarms with the values in the input and the time since the engine's previous tick
+	*/
+	virtual void tick(const Input &in, Output &)
+	{
+		time_ = this->frameTime();
+		update(source_(in), started_ ? float(this->lastPeriod()) : 0.0f);
+		started_ = true;
+	}
+
+	/*!
+	* \brief Returns the number of alarms
+	*
+	* \return The number
+	*/
+	std::size_t size() const
+	{
+		return channels_.size();
+	}
+
+private:
+	void raiseOrClear(std::size_t alarm)
+	{
+		if(active_[alarm]) {
+			acknowledged_[alarm] = 0;
+			report(std::uint32_t(alarm), AlarmEvent::RAISED);
+		} else
+			report(std::uint32_t(alarm), AlarmEvent::CLEARED);
+	}
+};
+
+#endif // STATE_MACHINE_ALARM_ENGINE_H
@@ -0,0 +1,221 @@
+/*
+* \brief Conditioning of analog input channels once per tick, as an input stage of the manager
+*
+* An AnalogConditioning converts an array of raw values (counts of a converter) in the input into an array of values in
+* engineering units in the same input, so that every object doesn't have to convert and filter them on its own. Each
+* channel goes through these steps:
+* - scaling by a gain and an offset
+* - an optional calibration table, with points evenly spaced over a range and linear interpolation between them
+* - a biquad filter (IIR), by default passing the value unchanged
+* - a deadband, the value changes only if it differs from the previous one more than the deadband
+*
+* The parameters and states of the channels are kept in separate arrays and all steps except the calibration tables are
+* done by loops over all channels that the compiler vectorises. The stage is created by conditionAnalog().
+*/
+
+#ifndef STATE_MACHINE_ANALOG_CONDITIONING_H
+#define STATE_MACHINE_ANALOG_CONDITIONING_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+
+template<std::size_t Channels>
+class AnalogConditioning {
+	struct Table {
+		std::size_t channel;
+		float from;
+		float scale; // Points per unit
+		std::vector<float> points;
+	};
+
+	alignas(64) float gain_[Channels];
+	alignas(64) float offset_[Channels];
+	alignas(64) float b0_[Channels];
+	alignas(64) float b1_[Channels];
+	alignas(64) float b2_[Channels];
+	alignas(64) float a1_[Channels];
+	alignas(64) float a2_[Channels];
+	alignas(64) float z1_[Channels];
+	alignas(64) float z2_[Channels];
+	alignas(64) float deadband_[Channels];
+	alignas(64) float last_[Channels];
+	alignas(64) float scaled_[Channels];
+	std::vector<Table> tables_;
+	bool started_ = false;
+
+	void check(std::size_t channel) const
+	{
+		if(channel >= Channels)
+			throw std::out_of_range("No such analog channel");
+	}
+
+public:
+	/*!
+	* \brief The constructor, all channels pass the raw values unchanged
+	*/
+	AnalogConditioning()
+	{
+		for(std::size_t i = 0; i < Channels; i++) {
+			gain_[i] = 1;
+			offset_[i] = 0;
+			b0_[i] = 1;
+			b1_[i] = b2_[i] = a1_[i] = a2_[i] = 0;
+			z1_[i] = z2_[i] = 0;
+			deadband_[i] = 0;
+			last_[i] = 0;
+		}
+	}
+
+	/*!
+	* \brief Sets the conversion of a channel's raw value, value = raw * gain + offset
+	*
+	* \param The channel's index
+	* \param The gain
+	* \param The offset
+	*/
+	void setScaling(std::size_t channel, float gain, float offset)
+	{
+		check(channel);
+		gain_[channel] = gain;
+		offset_[channel] = offset;
+	}
+
+	/*!
+	* \brief Sets a calibration table of a channel, applied to the scaled value, values outside the range get the first or
+	* last point
+	*
+	* \param The channel's index
+	* \param The scaled value of the first point
+	* \param The scaled value of the last point
+	* \param The calibrated values at evenly spaced points between them, at least two
+	*/
+	void setCalibration(std::size_t channel, float from, float to, const std::vector<float> &points)
+	{
+		check(channel);
+		if(points.size() < 2 || !(to > from))
+			throw std::invalid_argument("A calibration table needs at least two points over a nonempty range");
+		for(auto it = tables_.begin(); it != tables_.end(); ++it)
+			if(it->channel == channel) {
+				tables_.erase(it);
+				break;
+			}
+		tables_.push_back(Table{ channel, from, float(points.size() - 1) / (to - from), points });
+	}
+
+	/*!
+	* \brief Sets the coefficients of a channel's biquad filter, normalised so that a0 is 1
+	*
+	* \param The channel's index
+	* \param Coefficients b0, b1, b2 (numerator), a1, a2 (denominator)
+	*/
+	void setFilter(std::size_t channel, float b0, float b1, float b2, float a1, float a2)
+	{
+		check(channel);
+		b0_[channel] = b0;
+		b1_[channel] = b1;
+		b2_[channel] = b2;
+		a1_[channel] = a1;
+		a2_[channel] = a2;
+	}
+
+	/*!
+	* \brief Sets a channel's filter to a second order low-pass filter (Butterworth)
+	*
+	* \param The channel's index
+	* \param The cutoff frequency in Hz
+	* \param The period of the ticks in milliseconds
+	*/
+	void setLowPass(std::size_t channel, float cutoff, int period)
+	{
+		const double omega = 2 * 3.14159265358979323846 * cutoff * period / 1000;
+		const double cosine = std::cos(omega);
+		const double alpha = std::sin(omega) / std::sqrt(2.0);
+		const double a0 = 1 + alpha;
+		setFilter(channel, float((1 - cosine) / 2 / a0), float((1 - cosine) / a0), float((1 - cosine) / 2 / a0),
+				float(-2 * cosine / a0), float((1 - alpha) / a0));
+	}
+
+	/*!
+	* \brief Sets a channel's deadband
+	*
+	* \param The channel's index
+	* \param The smallest change of the filtered value that changes the channel's value, in engineering units
+	*/
+	void setDeadband(std::size_t channel, float deadband)
+	{
+		check(channel);
+		deadband_[channel] = deadband;
+	}
+
+	/*!
+	* \brief Conditions all channels, the filters start settled at the first values
+	*
+	* \param The raw values
+	* \param The array to write the conditioned values to
+	*/
+	template<typename Raw>
+	void process(const Raw *raw, float *values)
+	{
+		float *scaled = scaled_;
+		for(std::size_t i = 0; i < Channels; i++)
+			scaled[i] = float(raw[i]) * gain_[i] + offset_[i];
+		for(const Table &table : tables_) {
+			float &value = scaled[table.channel];
+			float position = (value - table.from) * table.scale;
+			const std::size_t last = table.points.size() - 1;
+			if(!(position > 0))
+				value = table.points.front();
+			else if(position >= last)
+				value = table.points.back();
+			else {
+				std::size_t index = std::size_t(position);
+				float fraction = position - index;
+				value = table.points[index] + (table.points[index + 1] - table.points[index]) * fraction;
+			}
+		}
+		if(!started_) {
+			// The state of a filter that has been getting the first value forever
+			for(std::size_t i = 0; i < Channels; i++) {
+				float denominator = 1 + a1_[i] + a2_[i];
+				float gain = (denominator != 0) ? (b0_[i] + b1_[i] + b2_[i]) / denominator : 1;
+				z2_[i] = scaled[i] * (b2_[i] - a2_[i] * gain);
+				z1_[i] = scaled[i] * (b1_[i] - a1_[i] * gain) + z2_[i];
+				last_[i] = scaled[i] * gain;
+			}
+			started_ = true;
+		}
+		// Transposed direct form II
+		for(std::size_t i = 0; i < Channels; i++) {
+			float filtered = b0_[i] * scaled[i] + z1_[i];
+			z1_[i] = b1_[i] * scaled[i] - a1_[i] * filtered + z2_[i];
+			z2_[i] = b2_[i] * scaled[i] - a2_[i] * filtered;
+			last_[i] = (std::fabs(filtered - last_[i]) > deadband_[i]) ? filtered : last_[i];
+		}
+		std::memcpy(values, last_, sizeof(last_));
+	}
+};
+
+/*!
+* \brief Creates an input stage conditioning analog channels
+*
+* \param The conditioning, it must not be changed or used elsewhere while the execution is running
+* \param Pointer to the member of the input structure with the raw values
+* \param Pointer to the member of the input structure where the conditioned values are written
+*
+* \return The stage, to be added to the manager by addInputStage()
+*/
+template<typename Input, typename Raw, std::size_t Channels>
+std::function<void(Input &)> conditionAnalog(std::shared_ptr<AnalogConditioning<Channels>> conditioning,
+		Raw (Input::*raw)[Channels], float (Input::*values)[Channels])
+{
+	return [conditioning, raw, values](Input &input) {
+		conditioning->process(input.*raw, input.*values);
+	};
+}
+
+#endif // STATE_MACHINE_ANALOG_CONDITIONING_H
@@ -0,0 +1,1223 @@
+#include <iostream>
+#include "fieldbus_emulator.hpp"
+#include "bytecode_object.hpp"
+#include "replication.hpp"
+#include "timer_bank.hpp"
+#include "digital_image.hpp"
+#include "analog_conditioning.hpp"
+#include "output_limiting.hpp"
+#include "profile_engine.hpp"
+#include "alarm_engine.hpp"
+#include "derived_values.hpp"
+#include <random>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Counts data TLB misses of the calling thread and threads it creates afterwards, if the system allows it
+class TlbMissCounter {
+	int descriptor_;
+public:
+	TlbMissCounter()
+	{
+		perf_event_attr attributes = {};
+		attributes.type = PERF_TYPE_HW_CACHE;
+		attributes.size = sizeof(attributes);
+		attributes.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attributes.inherit = 1;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		descriptor_ = int(syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0));
+	}
+	~TlbMissCounter()
+	{
+		if (descriptor_ >= 0)
+			close(descriptor_);
+	}
+	// Returns -1 if not available
+	long long misses() const
+	{
+		long long value = 0;
+		if (descriptor_ < 0 || read(descriptor_, &value, sizeof(value)) != sizeof(value))
+			return -1;
+		return value;
+	}
+};
+
+class Stopwatch {
+	std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+public:
+	double microseconds() const
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_).count();
+	}
+};
+
+// Objects of many classes with different code, for measuring the effect of the execution order
+template<typename Input, typename Output, int Kind>
+class MixedObject : public StateMachine<Input, Output, int> {
+	float state_[4] = {};
+	int index_;
+public:
+	MixedObject(int index) : index_(index)
+	{
+		this->state(0);
+	}
+	virtual void tick(const Input &in, Output &out)
+	{
+		float value = in.values[(index_ + Kind) % 64];
+		for (int i = 0; i < 4; i++) {
+			switch ((i * Kind + this->state()) % 4) {
+				case 0:
+					state_[i] = state_[i] * (0.5f + Kind * 0.01f) + value;
+					break;
+				case 1:
+					state_[i] = value > state_[i] ? value - Kind : state_[i] + Kind;
+					break;
+				case 2:
+					state_[i] -= state_[(i + Kind) % 4] * 0.25f;
+					break;
+				default:
+					state_[i] = std::max(state_[i], value * Kind);
+			}
+		}
+		if (state_[Kind % 4] > 1000 * Kind)
+			this->state((this->state() + Kind) % 7);
+		out.values[index_ % 64] = state_[0] + state_[3];
+	}
+};
+
+template<typename Input, typename Output, int Kind>
+void addMixedObjects(StateMachineManager<Input, Output> &manager, int index)
+{
+	manager.addTimedObject(10, std::make_shared<MixedObject<Input, Output, Kind>>(index));
+}
+
+template<typename Input, typename Output, int Kind>
+std::shared_ptr<TimedObject<Input, Output>> makeMixedObject(int index)
+{
+	return std::make_shared<MixedObject<Input, Output, Kind>>(index);
+}
+
+int main()
+{
+
+	std::cout << "Fieldbus pipeline benchmark" << std::endl;
+	{
+#define FIELDBUS_POINTS 4000
+#define FIELDBUS_OBJECTS 40
+		struct Input {
+			std::int32_t points[FIELDBUS_POINTS];
+		};
+		struct Output {
+			std::int32_t points[FIELDBUS_POINTS];
+		};
+
+		FieldbusEmulator::Configuration configuration;
+		configuration.inputPoints = FIELDBUS_POINTS;
+		configuration.outputPoints = FIELDBUS_POINTS;
+		configuration.latency = std::chrono::microseconds(50);
+		configuration.jitter = std::chrono::microseconds(20);
+		configuration.loopback = true;
+		FieldbusEmulator emulator(configuration);
+
+		IoMapping<Input, Output> mapping;
+		mapping.mapInput(emulator.inputs(), 0, &Input::points);
+		mapping.mapOutput(emulator.outputs(), 0, &Output::points);
+
+		StateMachineManager<Input, Output> manager(Input{}, Output{}, 2);
+
+		class Incrementer : public TimedObject<Input, Output> {
+			int first_;
+			int count_;
+		public:
+			Incrementer(int first, int count) : first_(first), count_(count)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				for (int i = first_; i < first_ + count_; i++)
+					out.points[i] = in.points[i] + 1;
+			}
+		};
+		for (int i = 0; i < FIELDBUS_OBJECTS; i++)
+			manager.addTimedObject(2, std::make_shared<Incrementer>(i * (FIELDBUS_POINTS / FIELDBUS_OBJECTS), FIELDBUS_POINTS / FIELDBUS_OBJECTS));
+
+		Stopwatch cycle;
+		double total = 0;
+		double longest = 0;
+		int cycles = 0;
+		manager.setInputTrigger([&](Input &in) {
+			cycle = Stopwatch();
+			emulator.read();
+			mapping.scatter(in);
+		});
+		manager.setOutputTrigger([&](const Output &out) {
+			mapping.gather(out);
+			emulator.write();
+			double duration = cycle.microseconds();
+			total += duration;
+			longest = std::max(longest, duration);
+			cycles++;
+		});
+
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::seconds(2));
+		manager.pause();
+
+		auto out = manager.output();
+		std::cout << "Points " << FIELDBUS_POINTS << ", cycles " << cycles << ", mean cycle " << total / cycles << " us, longest " << longest
+				<< " us, transactions " << emulator.transactions() << ", loopback value " << out->points[0] << std::endl;
+	}
+	
+	std::cout << "Bytecode interpreter benchmark" << std::endl;
+	{
+#define BYTECODE_RUNGS 2000
+		struct Input {
+			float values[BYTECODE_RUNGS];
+			float limits[BYTECODE_RUNGS];
+			bool enabled[BYTECODE_RUNGS];
+		};
+		struct Output {
+			bool coils[BYTECODE_RUNGS];
+		};
+		
+		// Every rung is: coil = enabled && value > limit
+		std::shared_ptr<BytecodeProgram<Input, Output>> program = std::make_shared<BytecodeProgram<Input, Output>>();
+		for (int i = 0; i < BYTECODE_RUNGS; i++) {
+			program->emit(BytecodeOpcode::LOAD_INPUT, 0, 0, 0, program->bindInput(&Input::values, i));
+			program->emit(BytecodeOpcode::LOAD_INPUT, 1, 0, 0, program->bindInput(&Input::limits, i));
+			program->emit(BytecodeOpcode::LOAD_INPUT, 2, 0, 0, program->bindInput(&Input::enabled, i));
+			program->emit(BytecodeOpcode::LESS, 3, 1, 0);
+			program->emit(BytecodeOpcode::AND, 3, 3, 2);
+			program->emit(BytecodeOpcode::STORE_OUTPUT, 0, 3, 0, program->bindOutput(&Output::coils, i));
+		}
+		BytecodeObject<Input, Output> object;
+		object.load(program);
+		
+		std::unique_ptr<Input> in = std::make_unique<Input>();
+		std::unique_ptr<Output> out = std::make_unique<Output>();
+		for (int i = 0; i < BYTECODE_RUNGS; i++) {
+			in->values[i] = float(i % 7);
+			in->limits[i] = 3;
+			in->enabled[i] = i % 3;
+		}
+		const int repetitions = 2000;
+		Stopwatch stopwatch;
+		for (int i = 0; i < repetitions; i++)
+			object.tick(*in, *out);
+		double elapsed = stopwatch.microseconds();
+		std::cout << "Rungs " << BYTECODE_RUNGS << ", " << elapsed / repetitions << " us per tick, "
+				<< BYTECODE_RUNGS * repetitions / (elapsed / 1000) << " rungs per ms" << std::endl;
+	}
+	
+	std::cout << "Replication overhead benchmark" << std::endl;
+	{
+#define REPLICATED_OBJECTS 1000
+		struct Input {
+			float values[REPLICATED_OBJECTS];
+		};
+		struct Output {
+			float values[REPLICATED_OBJECTS * 16];
+		};
+		
+		class Filter : public StateMachine<Input, Output, int> {
+			int index_;
+			float filtered_ = 0;
+		public:
+			Filter(int index) : index_(index)
+			{
+				state(0);
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				filtered_ = filtered_ * 0.9f + in.values[index_] * 0.1f;
+				// Only a few outputs change every tick
+				if (index_ % 10 == frameTime() % 10)
+					out.values[index_ * 16] = filtered_;
+			}
+			virtual void saveState(std::vector<unsigned char> &to) const
+			{
+				const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&filtered_);
+				to.insert(to.end(), bytes, bytes + sizeof(filtered_));
+			}
+			virtual void loadState(const unsigned char *from, std::size_t size)
+			{
+				if (size == sizeof(filtered_))
+					std::memcpy(&filtered_, from, size);
+			}
+		};
+		
+		std::unique_ptr<StateMachineManager<Input, Output>> primary = std::make_unique<StateMachineManager<Input, Output>>(Input{}, Output{}, 5);
+		std::unique_ptr<StateMachineManager<Input, Output>> follower = std::make_unique<StateMachineManager<Input, Output>>(Input{}, Output{}, 5);
+		for (int i = 0; i < REPLICATED_OBJECTS; i++) {
+			primary->addTimedObject(5, std::make_shared<Filter>(i));
+			follower->addTimedObject(5, std::make_shared<Filter>(i));
+		}
+		
+		Stopwatch cycle;
+		double total = 0;
+		int cycles = 0;
+		primary->setInputTrigger([&](Input &) {
+			cycle = Stopwatch();
+		});
+		primary->setOutputTrigger([&](const Output &) {
+			total += cycle.microseconds();
+			cycles++;
+		});
+		primary->unpause();
+		std::this_thread::sleep_for (std::chrono::seconds(1));
+		primary->pause();
+		double withoutReplication = total / cycles;
+		
+		ReplicationPrimary<Input, Output> replicationPrimary(*primary, "/tmp/state_machine_benchmark.sock");
+		primary->unpause();
+		ReplicationFollower<Input, Output> replicationFollower(*follower, "/tmp/state_machine_benchmark.sock");
+		std::this_thread::sleep_for (std::chrono::seconds(1));
+		primary->pause();
+		std::cout << "Objects " << REPLICATED_OBJECTS << ", tick without replication " << withoutReplication << " us, replication adds "
+				<< replicationPrimary.overhead() << " us per tick, messages " << replicationPrimary.messages() << std::endl;
+	}
+	
+	std::cout << "Dirty page tracking benchmark" << std::endl;
+	{
+#define TRACKED_MEGABYTES 16
+		struct Image {
+			std::int32_t values[TRACKED_MEGABYTES * 1024 * 1024 / sizeof(std::int32_t)];
+		};
+		const std::size_t count = sizeof(Image) / sizeof(std::int32_t);
+		std::unique_ptr<Image> initial = std::make_unique<Image>();
+		std::unique_ptr<Image> working = std::make_unique<Image>();
+		std::unique_ptr<Image> published = std::make_unique<Image>();
+		DirtyPageImage<Image> tracked(*initial);
+		const std::size_t stride = tracked.pageSize() / sizeof(std::int32_t);
+		const int repetitions = 50;
+		for (double ratio : { 0.001, 0.01, 0.1, 0.5, 1.0 }) {
+			std::size_t step = std::size_t(1 / ratio);
+			Stopwatch full;
+			for (int i = 0; i < repetitions; i++) {
+				for (std::size_t j = 0; j < count; j += stride * step)
+					working->values[j] = i;
+				std::memcpy(published.get(), working.get(), sizeof(Image));
+			}
+			double fullTime = full.microseconds() / repetitions;
+			Stopwatch dirty;
+			for (int i = 0; i < repetitions; i++) {
+				tracked.track();
+				for (std::size_t j = 0; j < count; j += stride * step)
+					tracked.value().values[j] = i;
+				tracked.copyDirty(*published);
+			}
+			double dirtyTime = dirty.microseconds() / repetitions;
+			std::cout << "Size " << TRACKED_MEGABYTES << " MB, dirty pages " << ratio * 100 << " %, full copy " << fullTime
+					<< " us, dirty page copy " << dirtyTime << " us" << std::endl;
+		}
+	}
+	
+	std::cout << "Huge pages benchmark" << std::endl;
+	{
+#define HUGE_PAGE_POINTS (4 * 1024 * 1024)
+#define HUGE_PAGE_OBJECTS 20000
+		struct Input {
+			float values[HUGE_PAGE_POINTS];
+		};
+		struct Output {
+			float values[HUGE_PAGE_POINTS];
+		};
+		
+		class Scattered : public TimedObject<Input, Output> {
+			std::uint32_t indexes_[16];
+			float gains_[16];
+		public:
+			Scattered(std::mt19937 &random)
+			{
+				for (int i = 0; i < 16; i++) {
+					indexes_[i] = random() % HUGE_PAGE_POINTS;
+					gains_[i] = float(random() % 100) / 100;
+				}
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				for (int i = 0; i < 16; i++)
+					out.values[indexes_[(i + 1) % 16]] += in.values[indexes_[i]] * gains_[i];
+			}
+		};
+		
+		for (bool huge : { false, true }) {
+			std::unique_ptr<Input> input = std::make_unique<Input>();
+			std::unique_ptr<Output> output = std::make_unique<Output>();
+			// The manager holds the structures, it doesn't fit on the stack
+			std::unique_ptr<StateMachineManager<Input, Output>> manager = std::make_unique<StateMachineManager<Input, Output>>(*input, *output, 20);
+			std::shared_ptr<HugePageArena> arena = HugePageArena::create();
+			HugePageKind kind = HugePageKind::NONE;
+			if (huge)
+				kind = manager->useHugePages();
+			std::mt19937 random(1);
+			std::vector<std::shared_ptr<Scattered>> unused; // Interleaved with the objects when not using the arena, like real allocations
+			for (int i = 0; i < HUGE_PAGE_OBJECTS; i++) {
+				if (huge) {
+					manager->addTimedObject(20, arena->make<Scattered>(random));
+				} else {
+					manager->addTimedObject(20, std::make_shared<Scattered>(random));
+					unused.push_back(std::make_shared<Scattered>(random));
+				}
+			}
+			
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager->setInputTrigger([&](Input &) {
+				cycle = Stopwatch();
+			});
+			manager->setOutputTrigger([&](const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			TlbMissCounter counter;
+			manager->unpause();
+			std::this_thread::sleep_for (std::chrono::seconds(2));
+			manager->pause();
+			long long misses = counter.misses();
+			std::cout << (huge ? (kind == HugePageKind::EXPLICIT ? "Explicit huge pages" : kind == HugePageKind::TRANSPARENT ? "Transparent huge pages" : "Huge pages unavailable")
+					: "Ordinary pages") << ", objects " << HUGE_PAGE_OBJECTS << ", mean cycle " << total / cycles << " us, TLB misses per cycle ";
+			if (misses < 0)
+				std::cout << "unavailable" << std::endl;
+			else
+				std::cout << misses / cycles << std::endl;
+		}
+	}
+	
+	std::cout << "Prefetching benchmark" << std::endl;
+	{
+		struct Input {
+			float values[64];
+		};
+		struct Output {
+			float values[64];
+		};
+		
+		class Accumulator : public TimedObject<Input, Output> {
+			float sum_ = 0;
+			int index_;
+		public:
+			Accumulator(int index) : index_(index)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				sum_ += in.values[index_];
+				out.values[index_] = sum_;
+			}
+		};
+		class Counter : public StateMachine<Input, Output, int> {
+			int index_;
+		public:
+			Counter(int index) : index_(index)
+			{
+				state(0);
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				if (in.values[index_] > out.values[index_])
+					state(state() + 1);
+			}
+		};
+		
+		for (int objects : { 1000, 10000, 100000 }) {
+			// Scatter the objects over the heap like long-running allocations do
+			std::mt19937 random(1);
+			std::vector<std::shared_ptr<TimedObject<Input, Output>>> created;
+			std::vector<std::unique_ptr<char[]>> padding;
+			for (int i = 0; i < objects; i++) {
+				if (i % 2)
+					created.push_back(std::make_shared<Accumulator>(i % 64));
+				else
+					created.push_back(std::make_shared<Counter>(i % 64));
+				padding.push_back(std::make_unique<char[]>(64 + random() % 512));
+			}
+			std::shuffle(created.begin(), created.end(), random);
+			padding.clear();
+			
+			StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+			for (auto &object : created)
+				manager.addTimedObject(10, object);
+			std::cout << "Objects " << objects << ", mean cycle";
+			for (unsigned int distance : { 0, 2, 4, 8, 16 }) {
+				manager.setPrefetchDistance(distance);
+				Stopwatch cycle;
+				double total = 0;
+				int cycles = 0;
+				manager.setInputTrigger([&](Input &) {
+					cycle = Stopwatch();
+				});
+				manager.setOutputTrigger([&](const Output &) {
+					total += cycle.microseconds();
+					cycles++;
+				});
+				manager.unpause();
+				std::this_thread::sleep_for (std::chrono::milliseconds(500));
+				manager.pause();
+				std::cout << ", distance " << distance << ": " << total / cycles << " us";
+			}
+			std::cout << std::endl;
+		}
+	}
+	
+	std::cout << "Type grouping benchmark" << std::endl;
+	{
+		struct Input {
+			float values[64];
+		};
+		struct Output {
+			float values[64];
+		};
+		
+		typedef void (*Adder)(StateMachineManager<Input, Output> &, int);
+		const Adder adders[] = {
+			addMixedObjects<Input, Output, 1>, addMixedObjects<Input, Output, 2>, addMixedObjects<Input, Output, 3>,
+			addMixedObjects<Input, Output, 4>, addMixedObjects<Input, Output, 5>, addMixedObjects<Input, Output, 6>,
+			addMixedObjects<Input, Output, 7>, addMixedObjects<Input, Output, 8>, addMixedObjects<Input, Output, 9>,
+			addMixedObjects<Input, Output, 10>, addMixedObjects<Input, Output, 11>, addMixedObjects<Input, Output, 12>,
+			addMixedObjects<Input, Output, 13>, addMixedObjects<Input, Output, 14>, addMixedObjects<Input, Output, 15>,
+			addMixedObjects<Input, Output, 16>
+		};
+		const int kinds = sizeof(adders) / sizeof(adders[0]);
+		for (int objects : { 1600, 16000 }) {
+			StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+			std::mt19937 random(1);
+			for (int i = 0; i < objects; i++)
+				adders[random() % kinds](manager, i);
+			std::cout << "Objects " << objects << " of " << kinds << " classes";
+			for (bool grouped : { false, true }) {
+				manager.groupByType(grouped);
+				Stopwatch cycle;
+				double total = 0;
+				int cycles = 0;
+				manager.setInputTrigger([&](Input &) {
+					cycle = Stopwatch();
+				});
+				manager.setOutputTrigger([&](const Output &) {
+					total += cycle.microseconds();
+					cycles++;
+				});
+				manager.unpause();
+				std::this_thread::sleep_for (std::chrono::seconds(1));
+				manager.pause();
+				std::cout << (grouped ? ", grouped " : ", interleaved ") << total / cycles << " us";
+			}
+			std::cout << std::endl;
+		}
+	}
+	
+	std::cout << "Profile-guided order benchmark" << std::endl;
+	{
+		struct Input {
+			float values[64];
+		};
+		struct Output {
+			float values[64];
+		};
+		
+		typedef std::shared_ptr<TimedObject<Input, Output>> (*Maker)(int);
+		const Maker makers[] = {
+			makeMixedObject<Input, Output, 1>, makeMixedObject<Input, Output, 2>, makeMixedObject<Input, Output, 3>,
+			makeMixedObject<Input, Output, 4>, makeMixedObject<Input, Output, 5>, makeMixedObject<Input, Output, 6>,
+			makeMixedObject<Input, Output, 7>, makeMixedObject<Input, Output, 8>
+		};
+		const int kinds = sizeof(makers) / sizeof(makers[0]);
+		for (int objects : { 2000, 50000 }) {
+			// Objects created in one order and inserted in another, scattered over the heap
+			std::mt19937 random(1);
+			std::vector<std::shared_ptr<TimedObject<Input, Output>>> created;
+			std::vector<std::unique_ptr<char[]>> padding;
+			for (int i = 0; i < objects; i++) {
+				created.push_back(makers[random() % kinds](i));
+				padding.push_back(std::make_unique<char[]>(64 + random() % 256));
+			}
+			padding.clear();
+			std::shuffle(created.begin(), created.end(), random);
+			StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+			for (auto &object : created)
+				manager.addTimedObject(10, object);
+			manager.unpause();
+			StateMachineManager<Input, Output>::OrderReport report = manager.optimizeOrder(20);
+			manager.pause();
+			std::cout << "Objects " << objects << ", before " << report.before << " us, after " << report.after << " us, grouped by type "
+					<< report.groupedByType << ", ordered by address " << report.orderedByAddress << std::endl;
+		}
+	}
+
+	std::cout << "Timer bank benchmark" << std::endl;
+	{
+		struct Input {
+			bool values[64];
+		};
+		struct Output {
+			bool values[64];
+		};
+		
+		// An on-delay timer written the usual way, with its own object and timer
+		class OnDelay : public TimedObject<Input, Output> {
+			Timer timer_;
+			int index_;
+		public:
+			OnDelay(int index) : index_(index)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				if (!in.values[index_])
+					timer_.deactivate();
+				else if (!timer_.active())
+					timer_ = makeTimer();
+				out.values[index_] = timer_.active() && timer_.time() >= 300;
+			}
+		};
+		// The same timers in a bank, with one object setting their inputs and reading their outputs
+		typedef TimerBank<Input, Output> Bank;
+		class Logic : public TimedObject<Input, Output> {
+			Bank &bank_;
+			std::vector<Bank::OnDelay> timers_;
+		public:
+			Logic(Bank &bank, int timers) : bank_(bank)
+			{
+				for (int i = 0; i < timers; i++)
+					timers_.push_back(bank_.addOnDelay(300));
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				for (std::size_t i = 0; i < timers_.size(); i++) {
+					bank_.set(timers_[i], in.values[i % 64]);
+					out.values[i % 64] = bank_.output(timers_[i]);
+				}
+			}
+		};
+		
+		for (int timers : { 1000, 10000, 100000 }) {
+			auto measure = [&] (StateMachineManager<Input, Output> &manager) {
+				Stopwatch cycle;
+				double total = 0;
+				int cycles = 0;
+				manager.setInputTrigger([&](Input &in) {
+					for (int i = 0; i < 64; i++)
+						in.values[i] = (cycles / 8 + i) % 3;
+					cycle = Stopwatch();
+				});
+				manager.setOutputTrigger([&](const Output &) {
+					total += cycle.microseconds();
+					cycles++;
+				});
+				manager.unpause();
+				std::this_thread::sleep_for (std::chrono::milliseconds(500));
+				manager.pause();
+				return total / cycles;
+			};
+			StateMachineManager<Input, Output> objects(Input{}, Output{}, 10);
+			for (int i = 0; i < timers; i++)
+				objects.addTimedObject(10, std::make_shared<OnDelay>(i % 64));
+			StateMachineManager<Input, Output> banked(Input{}, Output{}, 10);
+			auto bank = std::make_shared<Bank>();
+			banked.addTimedObject(10, std::make_shared<Logic>(*bank, timers));
+			banked.addTimedObject(10, bank);
+			std::cout << "Timers " << timers << ", mean cycle with objects " << measure(objects) << " us, with a bank "
+					<< measure(banked) << " us" << std::endl;
+		}
+	}
+
+	std::cout << "Edge detection benchmark" << std::endl;
+	{
+		const int channels = 8192;
+		struct Input {
+			bool values[channels];
+			DigitalImage<channels> image;
+		};
+		struct Output {
+			int edges;
+		};
+		
+		// Compares with its own copy of the previous value, like an R_TRIG block
+		class BoolEdge : public TimedObject<Input, Output> {
+			int channel_;
+			bool previous_ = false;
+		public:
+			BoolEdge(int channel) : channel_(channel)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.edges += in.values[channel_] && !previous_;
+				previous_ = in.values[channel_];
+			}
+		};
+		class ImageEdge : public TimedObject<Input, Output> {
+			int channel_;
+		public:
+			ImageEdge(int channel) : channel_(channel)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.edges += in.image.rose(channel_);
+			}
+		};
+		
+		auto measure = [&] (bool packed) {
+			std::unique_ptr<StateMachineManager<Input, Output>> manager(new StateMachineManager<Input, Output>(Input{}, Output{}, 10));
+			for (int i = 0; i < channels; i++) {
+				if (packed)
+					manager->addTimedObject(10, std::make_shared<ImageEdge>(i));
+				else
+					manager->addTimedObject(10, std::make_shared<BoolEdge>(i));
+			}
+			if (packed)
+				manager->addInputStage(detectEdges(&Input::image));
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager->setInputTrigger([&](Input &in) {
+				for (int i = 0; i < channels; i++) {
+					bool value = (i + cycles) % 3 == 0;
+					if (packed)
+						in.image.set(i, value);
+					else
+						in.values[i] = value;
+				}
+				cycle = Stopwatch();
+			});
+			manager->setOutputTrigger([&](const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			manager->unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(500));
+			manager->pause();
+			return total / cycles;
+		};
+		std::cout << "Channels " << channels << ", mean cycle with bool arrays " << measure(false) << " us, with a digital image "
+				<< measure(true) << " us" << std::endl;
+	}
+
+	std::cout << "Analog conditioning benchmark" << std::endl;
+	{
+		const int channels = 4096;
+		struct Input {
+			short raw[channels];
+			float values[channels];
+		};
+		struct Output {
+			float sum;
+		};
+		
+		// Scales and filters its own channel
+		class FilteringObject : public TimedObject<Input, Output> {
+			int channel_;
+			float b0_, b1_, b2_, a1_, a2_;
+			float z1_ = 0, z2_ = 0;
+		public:
+			FilteringObject(int channel) : channel_(channel)
+			{
+				// The same low-pass filter as AnalogConditioning::setLowPass(channel, 1, 10)
+				const double omega = 2 * 3.14159265358979323846 * 0.01;
+				const double alpha = std::sin(omega) / std::sqrt(2.0);
+				b0_ = b2_ = float((1 - std::cos(omega)) / 2 / (1 + alpha));
+				b1_ = 2 * b0_;
+				a1_ = float(-2 * std::cos(omega) / (1 + alpha));
+				a2_ = float((1 - alpha) / (1 + alpha));
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				float scaled = in.raw[channel_] * 0.01f - 5;
+				float filtered = b0_ * scaled + z1_;
+				z1_ = b1_ * scaled - a1_ * filtered + z2_;
+				z2_ = b2_ * scaled - a2_ * filtered;
+				out.sum += filtered;
+			}
+		};
+		class ReadingObject : public TimedObject<Input, Output> {
+			int channel_;
+		public:
+			ReadingObject(int channel) : channel_(channel)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.sum += in.values[channel_];
+			}
+		};
+		
+		auto measure = [&] (bool staged) {
+			std::unique_ptr<StateMachineManager<Input, Output>> manager(new StateMachineManager<Input, Output>(Input{}, Output{}, 10));
+			for (int i = 0; i < channels; i++) {
+				if (staged)
+					manager->addTimedObject(10, std::make_shared<ReadingObject>(i));
+				else
+					manager->addTimedObject(10, std::make_shared<FilteringObject>(i));
+			}
+			if (staged) {
+				auto conditioning = std::make_shared<AnalogConditioning<channels>>();
+				for (int i = 0; i < channels; i++) {
+					conditioning->setScaling(i, 0.01f, -5);
+					conditioning->setLowPass(i, 1, 10);
+				}
+				manager->addInputStage(conditionAnalog(conditioning, &Input::raw, &Input::values));
+			}
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager->setInputTrigger([&](Input &in) {
+				for (int i = 0; i < channels; i++)
+					in.raw[i] = short((i * 7 + cycles) % 1000);
+				cycle = Stopwatch();
+			});
+			manager->setOutputTrigger([&](const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			manager->unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(500));
+			manager->pause();
+			return total / cycles;
+		};
+		std::cout << "Channels " << channels << ", mean cycle filtering in objects " << measure(false) << " us, in an input stage "
+				<< measure(true) << " us" << std::endl;
+	}
+
+	std::cout << "Output limiting benchmark" << std::endl;
+	{
+		const int channels = 4096;
+		struct Input {
+			float setpoint;
+		};
+		struct Output {
+			float targets[channels];
+			float values[channels];
+		};
+		
+		// Clamps and rate limits its own channel
+		class LimitingObject : public TimedObject<Input, Output> {
+			int channel_;
+			float last_ = 0;
+		public:
+			LimitingObject(int channel) : channel_(channel)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				float wanted = std::min(std::max(in.setpoint * channel_, 0.0f), 100.0f);
+				last_ += std::min(std::max(wanted - last_, -0.5f), 0.5f);
+				out.values[channel_] = last_;
+			}
+		};
+		class WritingObject : public TimedObject<Input, Output> {
+			int channel_;
+		public:
+			WritingObject(int channel) : channel_(channel)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.targets[channel_] = in.setpoint * channel_;
+			}
+		};
+		
+		auto measure = [&] (bool staged) {
+			std::unique_ptr<StateMachineManager<Input, Output>> manager(new StateMachineManager<Input, Output>(Input{}, Output{}, 10));
+			for (int i = 0; i < channels; i++) {
+				if (staged)
+					manager->addTimedObject(10, std::make_shared<WritingObject>(i));
+				else
+					manager->addTimedObject(10, std::make_shared<LimitingObject>(i));
+			}
+			if (staged) {
+				auto limiting = std::make_shared<OutputLimiting<channels>>();
+				for (int i = 0; i < channels; i++) {
+					limiting->setLimits(i, 0, 100);
+					limiting->setRate(i, 50);
+				}
+				manager->addOutputStage(limitOutput(limiting, &Output::targets, &Output::values, 10));
+			}
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager->setInputTrigger([&](Input &in) {
+				in.setpoint = float(cycles % 100) / 100;
+				cycle = Stopwatch();
+			});
+			manager->setOutputTrigger([&](const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			manager->unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(500));
+			manager->pause();
+			return total / cycles;
+		};
+		std::cout << "Channels " << channels << ", mean cycle limiting in objects " << measure(false) << " us, in an output stage "
+				<< measure(true) << " us" << std::endl;
+	}
+
+	std::cout << "Profile engine benchmark" << std::endl;
+	{
+		const int recipes = 1000;
+		struct Input {
+		};
+		struct Output {
+			float setpoints[recipes];
+		};
+		
+		// A ramp, a soak and a ramp back, written like TemperatureProgrammer in heater_example.cpp
+		class Programmer : public StateMachine<Input, Output, int> {
+			int index_;
+		public:
+			Programmer(int index) : index_(index)
+			{
+				state(0);
+			}
+			virtual void tick(const Input &, Output &out)
+			{
+				float ramp = 0.01f * (1 + index_ % 10);
+				switch (state()) {
+					case 0: {
+						float wanted = 20 + timeInState() * ramp;
+						if (wanted > 100) {
+							wanted = 100;
+							state(1);
+						}
+						out.setpoints[index_] = wanted;
+						break;
+					}
+					case 1:
+						out.setpoints[index_] = 100;
+						if (timeInState() > 5000)
+							state(2);
+						break;
+					case 2: {
+						float wanted = 100 - timeInState() * ramp;
+						if (wanted < 20) {
+							wanted = 20;
+							state(0);
+						}
+						out.setpoints[index_] = wanted;
+						break;
+					}
+				}
+			}
+		};
+		class Copier : public TimedObject<Input, Output> {
+			ProfileEngine<Input, Output> &engine_;
+			std::vector<ProfileEngine<Input, Output>::Run> runs_;
+		public:
+			Copier(ProfileEngine<Input, Output> &engine) : engine_(engine)
+			{
+				std::vector<ProfileEngine<Input, Output>::Profile> profiles;
+				for (int i = 0; i < 10; i++) {
+					float duration = 80 / (0.01f * (1 + i));
+					profiles.push_back(engine_.addProfile(20, { ProfileSegment::ramp(100, duration), ProfileSegment::soak(5000),
+							ProfileSegment::ramp(20, duration) }));
+				}
+				for (int i = 0; i < recipes; i++) {
+					runs_.push_back(engine_.addRun(profiles[i % 10]));
+					engine_.start(runs_.back());
+				}
+			}
+			virtual void tick(const Input &, Output &out)
+			{
+				for (int i = 0; i < recipes; i++) {
+					out.setpoints[i] = engine_.setpoint(runs_[i]);
+					if (!engine_.running(runs_[i]))
+						engine_.start(runs_[i]);
+				}
+			}
+		};
+		
+		auto measure = [&] (bool engined) {
+			StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+			if (engined) {
+				auto engine = std::make_shared<ProfileEngine<Input, Output>>();
+				manager.addTimedObject(10, engine);
+				manager.addTimedObject(10, std::make_shared<Copier>(*engine));
+			} else {
+				for (int i = 0; i < recipes; i++)
+					manager.addTimedObject(10, std::make_shared<Programmer>(i));
+			}
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager.setInputTrigger([&](Input &) {
+				cycle = Stopwatch();
+			});
+			manager.setOutputTrigger([&](const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			manager.unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(500));
+			manager.pause();
+			return total / cycles;
+		};
+		std::cout << "Recipes " << recipes << ", mean cycle with state machines " << measure(false) << " us, with a profile engine "
+				<< measure(true) << " us" << std::endl;
+	}
+
+	std::cout << "Alarm engine benchmark" << std::endl;
+	{
+		const int channels = 4096;
+		const int alarms = 20000;
+		struct Input {
+			float values[channels];
+		};
+		struct Output {
+			int changes;
+		};
+		
+		// A high alarm with hysteresis and delay, checked in its own object
+		class AlarmObject : public TimedObject<Input, Output> {
+			int channel_;
+			float limit_;
+			Timer beyond_;
+			bool active_ = false;
+		public:
+			AlarmObject(int channel, float limit) : channel_(channel), limit_(limit)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				float value = in.values[channel_];
+				if (value > limit_ - (active_ ? 5 : 0)) {
+					if (!beyond_.active())
+						beyond_ = makeTimer();
+				} else
+					beyond_.deactivate();
+				bool active = beyond_.active() && (active_ || beyond_.time() >= 50);
+				out.changes += active != active_;
+				active_ = active;
+			}
+		};
+		
+		auto measure = [&] (bool engined) {
+			std::unique_ptr<StateMachineManager<Input, Output>> manager(new StateMachineManager<Input, Output>(Input{}, Output{}, 10));
+			std::shared_ptr<AlarmEngine<Input, Output>> engine;
+			if (engined) {
+				engine = std::make_shared<AlarmEngine<Input, Output>>([](const Input &in) {
+					return in.values;
+				}, 65536);
+				for (int i = 0; i < alarms; i++)
+					engine->addAlarm(i % channels, 50 + i % 40, true, 5, 50);
+				manager->addTimedObject(10, engine);
+			} else {
+				for (int i = 0; i < alarms; i++)
+					manager->addTimedObject(10, std::make_shared<AlarmObject>(i % channels, 50 + i % 40));
+			}
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager->setInputTrigger([&](Input &in) {
+				for (int i = 0; i < channels; i++)
+					in.values[i] = float((i + cycles) % 100);
+				cycle = Stopwatch();
+			});
+			manager->setOutputTrigger([&](const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+				AlarmEvent event;
+				while (engine && engine->nextEvent(event)) {
+				}
+			});
+			manager->unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(500));
+			manager->pause();
+			return total / cycles;
+		};
+		std::cout << "Alarms " << alarms << ", mean cycle with objects " << measure(false) << " us, with an alarm engine "
+				<< measure(true) << " us" << std::endl;
+	}
+
+	std::cout << "Derived values benchmark" << std::endl;
+	{
+		const int sensors = 256;
+		const int objects = 1000;
+		struct Input {
+			float temperatures[sensors];
+		};
+		struct Output {
+			int overheated;
+		};
+		
+		auto average = [](const Input &in) {
+			float sum = 0;
+			for (int i = 0; i < sensors; i++)
+				sum += in.temperatures[i];
+			return sum / sensors;
+		};
+		// Computes the average on its own
+		class Computing : public TimedObject<Input, Output> {
+			std::function<float(const Input &)> average_;
+		public:
+			Computing(std::function<float(const Input &)> average) : average_(average)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.overheated += average_(in) > 50;
+			}
+		};
+		class Reading : public TimedObject<Input, Output> {
+			DerivedValues<Input>::Value<float> average_;
+		public:
+			Reading(DerivedValues<Input>::Value<float> average) : average_(average)
+			{
+			}
+			virtual void tick(const Input &, Output &out)
+			{
+				out.overheated += average_.get() > 50;
+			}
+		};
+		
+		auto measure = [&] (bool shared) {
+			StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+			auto derived = std::make_shared<DerivedValues<Input>>();
+			auto value = derived->add<float>("average", average);
+			for (int i = 0; i < objects; i++) {
+				if (shared)
+					manager.addTimedObject(10, std::make_shared<Reading>(value));
+				else
+					manager.addTimedObject(10, std::make_shared<Computing>(average));
+			}
+			manager.addInputStage(refreshDerived(derived));
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager.setInputTrigger([&](Input &in) {
+				for (int i = 0; i < sensors; i++)
+					in.temperatures[i] = float((i + cycles) % 100);
+				cycle = Stopwatch();
+			});
+			manager.setOutputTrigger([&](const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			manager.unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(500));
+			manager.pause();
+			return total / cycles;
+		};
+		std::cout << "Objects " << objects << ", mean cycle computing in every object " << measure(false) << " us, with a derived value "
+				<< measure(true) << " us" << std::endl;
+	}
+
+	std::cout << "Channel array benchmark" << std::endl;
+	{
+		const int channels = 65536;
+		struct Input {
+		};
+		struct PlainOutput {
+			float values[channels];
+		};
+		struct ArrayOutput {
+			ChannelArray<float, channels> values;
+		};
+		
+		// Writes a few scattered channels every tick
+		class PlainWriter : public TimedObject<Input, PlainOutput> {
+			int index_;
+			int ticks_ = 0;
+		public:
+			PlainWriter(int index) : index_(index)
+			{
+			}
+			virtual void tick(const Input &, PlainOutput &out)
+			{
+				ticks_++;
+				out.values[(index_ * 7919 + ticks_ * 13) % channels] = float(ticks_);
+			}
+		};
+		class ArrayWriter : public TimedObject<Input, ArrayOutput> {
+			int index_;
+			int ticks_ = 0;
+		public:
+			ArrayWriter(int index) : index_(index)
+			{
+			}
+			virtual void tick(const Input &, ArrayOutput &out)
+			{
+				ticks_++;
+				out.values.set((index_ * 7919 + ticks_ * 13) % channels, float(ticks_));
+			}
+		};
+		
+		auto measure = [&] (auto &manager) {
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager.setInputTrigger([&](Input &) {
+				cycle = Stopwatch();
+			});
+			manager.setTickTrigger([&](const Input &, const auto &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			manager.outputSnapshot();
+			manager.unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(500));
+			manager.pause();
+			return total / cycles;
+		};
+		for (int writers : { 100, 1000 }) {
+			std::unique_ptr<StateMachineManager<Input, PlainOutput>> plain(new StateMachineManager<Input, PlainOutput>(Input{}, PlainOutput{}, 10));
+			std::unique_ptr<StateMachineManager<Input, ArrayOutput>> array(new StateMachineManager<Input, ArrayOutput>(Input{}, ArrayOutput{}, 10));
+			for (int i = 0; i < writers; i++) {
+				plain->addTimedObject(10, std::make_shared<PlainWriter>(i));
+				array->addTimedObject(10, std::make_shared<ArrayWriter>(i));
+			}
+			array->addChannelArray(&ArrayOutput::values);
+			std::cout << "Channels " << channels << ", changed per tick " << writers << ", mean cycle copying everything " << measure(*plain)
+					<< " us, copying changed channels " << measure(*array) << " us" << std::endl;
+		}
+	}
+	
+	std::cout << "Frame clock benchmark" << std::endl;
+	{
+		struct Input {
+			int value;
+		};
+		struct Output {
+			int value;
+		};
+		
+		// Typical small state machine, reads its timing every tick
+		class Blinker : public StateMachine<Input, Output, bool> {
+		public:
+			Blinker()
+			{
+				state(false);
+			}
+			virtual void tick(const Input &, Output &out)
+			{
+				if (timeInState() >= 500)
+					state(!state());
+				out.value += state();
+			}
+		};
+		
+		for (int objects : { 1000, 100000 }) {
+			std::unique_ptr<StateMachineManager<Input, Output>> manager(new StateMachineManager<Input, Output>(Input{}, Output{}, 10));
+			for (int i = 0; i < objects; i++)
+				manager->addTimedObject(10 * (1 + i % 4), std::make_shared<Blinker>());
+			Stopwatch cycle;
+			double total = 0;
+			int cycles = 0;
+			manager->setInputTrigger([&](Input &) {
+				cycle = Stopwatch();
+			});
+			manager->setTickTrigger([&](const Input &, const Output &) {
+				total += cycle.microseconds();
+				cycles++;
+			});
+			manager->unpause();
+			std::this_thread::sleep_for (std::chrono::seconds(1));
+			manager->pause();
+			std::cout << "Objects " << objects << " with 4 periods, mean cycle " << total / cycles << " us" << std::endl;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,522 @@
+/*
+* \brief A timed object whose logic is a program loaded at runtime, without recompiling
+*
+* The program is a sequence of instructions for a simple register machine. Registers hold double precision values and
+* are kept between ticks. Instructions load members of the input structure into registers, store registers into members
+* of the output structure, compute arithmetic and comparisons, jump, start and read timers and change the state.
+* Comparisons yield 1 or 0, conditional jumps treat 0 as false. Values stored into integer fields or the state are
+* saturated to their range, NaN becomes 0. Jumps can only go forward, so that every tick ends after at most as many
+* instructions as the program has, repeating something over ticks needs the state or registers.
+*
+* Programs are built using BytecodeProgram and loaded by BytecodeObject::load() from any thread. Loading validates and
+* translates the program outside the execution, the new program replaces the old one at the beginning of the next tick.
+* With GCC or Clang, the translated program is run with direct threaded dispatch, each instruction jumping straight to
+* the next one's handler.
+*/
+
+#ifndef BYTECODE_OBJECT_H
+#define BYTECODE_OBJECT_H
+
+#include "io_mapping.hpp"
+#include <stdexcept>
+#include <limits>
+
+#if defined(__GNUC__) && !defined(STATE_MACHINE_NO_THREADED_DISPATCH)
+#define STATE_MACHINE_THREADED_DISPATCH
+#endif
+
+enum class BytecodeOpcode : std::uint8_t {
+	LOAD_CONSTANT, // destination = constant(operand)
+	LOAD_INPUT, // destination = input field(operand)
+	STORE_OUTPUT, // output field(operand) = first
+	MOVE, // destination = first
+	ADD, // destination = first + second
+	SUBTRACT, // destination = first - second
+	MULTIPLY, // destination = first * second
+	DIVIDE, // destination = first / second
+	MINIMUM, // destination = min(first, second)
+	MAXIMUM, // destination = max(first, second)
+	LESS, // destination = first < second
+	LESS_EQUAL, // destination = first <= second
+	EQUAL, // destination = first == second
+	NOT_EQUAL, // destination = first != second
+	AND, // destination = first && second
+	OR, // destination = first || second
+	NOT, // destination = !first
+	JUMP, // continue at instruction operand
+	JUMP_IF_ZERO, // continue at instruction operand if first is 0
+	JUMP_IF_NOT_ZERO, // continue at instruction operand if first is not 0
+	START_TIMER, // start timer(operand)
+	STOP_TIMER, // deactivate timer(operand)
+	TIMER_TIME, // destination = time of timer(operand) in milliseconds, 0 if not started
+	SET_STATE, // state = first
+	GET_STATE, // destination = state
+	TIME_IN_STATE, // destination = time in state in milliseconds
+	AFTER_STATE_CHANGE, // destination = 1 if this is the first tick in the current state
+	END // ends the tick
+};
+
+enum class BytecodeFieldType : std::uint8_t {
+	BOOL,
+	INT16,
+	UINT16,
+	INT32,
+	UINT32,
+	FLOAT,
+	DOUBLE
+};
+
+template<typename T> struct BytecodeFieldTypeOf;
+template<> struct BytecodeFieldTypeOf<bool> { static constexpr BytecodeFieldType value = BytecodeFieldType::BOOL; };
+template<> struct BytecodeFieldTypeOf<std::int16_t> { static constexpr BytecodeFieldType value = BytecodeFieldType::INT16; };
+template<> struct BytecodeFieldTypeOf<std::uint16_t> { static constexpr BytecodeFieldType value = BytecodeFieldType::UINT16; };
+template<> struct BytecodeFieldTypeOf<std::int32_t> { static constexpr BytecodeFieldType value = BytecodeFieldType::INT32; };
+template<> struct BytecodeFieldTypeOf<std::uint32_t> { static constexpr BytecodeFieldType value = BytecodeFieldType::UINT32; };
+template<> struct BytecodeFieldTypeOf<float> { static constexpr BytecodeFieldType value = BytecodeFieldType::FLOAT; };
+template<> struct BytecodeFieldTypeOf<double> { static constexpr BytecodeFieldType value = BytecodeFieldType::DOUBLE; };
+
+template<typename Input, typename Output>
+class BytecodeProgram {
+public:
+	struct Instruction {
+		BytecodeOpcode opcode;
+		std::uint8_t destination;
+		std::uint8_t first;
+		std::uint8_t second;
+		std::int32_t operand;
+	};
+	struct Field {
+		std::size_t offset;
+		BytecodeFieldType type;
+	};
+
+private:
+	std::vector<Instruction> instructions_;
+	std::vector<double> constants_;
+	std::vector<Field> inputs_;
+	std::vector<Field> outputs_;
+	int registers_ = 0;
+	int timers_ = 0;
+
+	template<typename In, typename Out> friend class BytecodeObject;
+
+public:
+	/*!
+	* \brief Makes a member of the input structure readable by LOAD_INPUT
+	*
+	* \param Pointer to the member, must be bool, float, double or a 16 or 32 bit integer
+	*
+	* \return The operand to use in LOAD_INPUT
+	*/
+	template<typename T>
+	int bindInput(T Input::*member)
+	{
+		inputs_.push_back(Field{ memberOffset(member), BytecodeFieldTypeOf<T>::value });
+		return int(inputs_.size() - 1);
+	}
+
+	/*!
+	* \brief Makes an element of an array in the input structure readable by LOAD_INPUT
+	*
+	* \param Pointer to the array member, its elements must be bool, float, double or 16 or 32 bit integers
+	* \param The index of the element
+	*
+	* \return The operand to use in LOAD_INPUT
+	*/
+	template<typename T, std::size_t N>
+	int bindInput(T (Input::*member)[N], std::size_t index)
+	{
+		if(index >= N)
+			throw std::invalid_argument("Bound element out of range");
+		inputs_.push_back(Field{ memberOffset(member) + index * sizeof(T), BytecodeFieldTypeOf<T>::value });
+		return int(inputs_.size() - 1);
+	}
+
+	/*!
+	* \brief Makes a member of the output structure writable by STORE_OUTPUT
+	*
+	* \param Pointer to the member, must be bool, float, double or a 16 or 32 bit integer
+	*
+	* \return The operand to use in STORE_OUTPUT
+	*/
+	template<typename T>
+	int bindOutput(T Output::*member)
+	{
+		outputs_.push_back(Field{ memberOffset(member), BytecodeFieldTypeOf<T>::value });
+		return int(outputs_.size() - 1);
+	}
+
+	/*!
+	* \brief Makes an element of an array in the output structure writable by STORE_OUTPUT
+	*
+	* \param Pointer to the array member, its elements must be bool, float, double or 16 or 32 bit integers
+	* \param The index of the element
+	*
+	* \return The operand to use in STORE_OUTPUT
+	*/
+	template<typename T, std::size_t N>
+	int bindOutput(T (Output::*member)[N], std::size_t index)
+	{
+		if(index >= N)
+			throw std::invalid_argument("Bound element out of range");
+		outputs_.push_back(Field{ memberOffset(member) + index * sizeof(T), BytecodeFieldTypeOf<T>::value });
+		return int(outputs_.size() - 1);
+	}
+
+	/*!
+	* \brief Adds a constant
+	*
+	* \param The value
+	*
+	* \return The operand to use in LOAD_CONSTANT
+	*/
+	int constant(double value)
+	{
+		constants_.push_back(value);
+		return int(constants_.size() - 1);
+	}
+
+	/*!
+	* \brief Appends an instruction, the registers and timers it uses are allocated automatically
+	*
+	* \param The opcode
+	* \param The destination register
+	* \param The first source register
+	* \param The second source register
+	* \param The operand, meaning the constant, field, timer or jump target, depending on the opcode
+	*
+	* \return The index of the instruction, usable as target of jumps
+	*/
+	int emit(BytecodeOpcode opcode, int destination = 0, int first = 0, int second = 0, int operand = 0)
+	{
+		if(destination < 0 || destination > 255 || first < 0 || first > 255 || second < 0 || second > 255)
+			throw std::invalid_argument("Bytecode registers must be between 0 and 255");
+		instructions_.push_back(Instruction{ opcode, std::uint8_t(destination), std::uint8_t(first), std::uint8_t(second), operand });
+		registers_ = std::max(registers_, std::max(destination, std::max(first, second)) + 1);
+		if(opcode == BytecodeOpcode::START_TIMER || opcode == BytecodeOpcode::STOP_TIMER || opcode == BytecodeOpcode::TIMER_TIME)
+			timers_ = std::max(timers_, operand + 1);
+		return int(instructions_.size() - 1);
+	}
+
+	/*!
+	* \brief Returns the index the next appended instruction will have
+	*
+	* \return The index
+	*/
+	int position() const
+	{
+		return int(instructions_.size());
+	}
+
+	/*!
+	* \brief Changes the operand of an already appended instruction, meant to set targets of forward jumps
+	*
+	* \param The index of the instruction
+	* \param The new operand
+	*/
+	void setOperand(int instruction, int operand)
+	{
+		instructions_.at(instruction).operand = operand;
+	}
+};
+
+template<typename Input, typename Output>
+class BytecodeObject : public StateMachine<Input, Output, int> {
+	typedef BytecodeProgram<Input, Output> Program;
+	typedef StateMachine<Input, Output, int> Machine;
+	typedef typename TimedObject<Input, Output>::Timer Timer;
+
+	struct Threaded {
+		const void *handler;
+		std::uint8_t destination;
+		std::uint8_t first;
+		std::uint8_t second;
+		std::int32_t operand;
+		double constant;
+	};
+	struct Loaded {
+		std::shared_ptr<const Program> program;
+		std::vector<Threaded> code;
+		std::vector<double> registers;
+		std::vector<Timer> timers;
+	};
+
+	std::unique_ptr<Loaded> current_;
+	std::atomic<Loaded *> pending_;
+	std::atomic<Loaded *> retired_;
+
+	template<typename T>
+	static double readField(const unsigned char *from)
+	{
+		T value;
+		std::memcpy(&value, from, sizeof(T));
+		return double(value);
+	}
+
+	// Converting NaN or values out of range to integers is undefined, so they are saturated and NaN becomes 0
+	template<typename T>
+	static T convert(double value)
+	{
+		if(std::is_integral<T>::value && !std::is_same<T, bool>::value) {
+			value = (value == value) ? value : 0;
+			value = std::min(std::max(value, double(std::numeric_limits<T>::lowest())), double(std::numeric_limits<T>::max()));
+		}
+		return T(value);
+	}
+
+	template<typename T>
+	static void writeField(unsigned char *to, double value)
+	{
+		T converted = convert<T>(value);
+		std::memcpy(to, &converted, sizeof(T));
+	}
+
+#ifdef STATE_MACHINE_THREADED_DISPATCH
+#define BYTECODE_HANDLER(name) name:
+#define BYTECODE_NEXT goto *(++ip)->handler
+#define BYTECODE_JUMP(target) { ip = code + (target); goto *ip->handler; }
+#else
+#define BYTECODE_HANDLER(name) case Handler::name:
+#define BYTECODE_NEXT { ++ip; continue; }
+#define BYTECODE_JUMP(target) { ip = code + (target); continue; }
+#endif
+#define BYTECODE_FIELD_HANDLERS(type, name) \
+	BYTECODE_HANDLER(LOAD_##name) \
+		r[ip->destination] = readField<type>(input + ip->operand); \
+		BYTECODE_NEXT; \
+	BYTECODE_HANDLER(STORE_##name) \
+		writeField<type>(output + ip->operand, r[ip->first]); \
+		BYTECODE_NEXT;
+#define BYTECODE_BINARY_HANDLER(name, expression) \
+	BYTECODE_HANDLER(name) \
+		r[ip->destination] = (expression); \
+		BYTECODE_NEXT;
+
+	enum class Handler : std::uint8_t {
+		LOAD_CONSTANT, LOAD_BOOL, STORE_BOOL, LOAD_INT16, STORE_INT16, LOAD_UINT16, STORE_UINT16, LOAD_INT32, STORE_INT32,
+		LOAD_UINT32, STORE_UINT32, LOAD_FLOAT, STORE_FLOAT, LOAD_DOUBLE, STORE_DOUBLE, MOVE, ADD, SUBTRACT, MULTIPLY,
+		DIVIDE, MINIMUM, MAXIMUM, LESS, LESS_EQUAL, EQUAL, NOT_EQUAL, AND, OR, NOT, JUMP, JUMP_IF_ZERO, JUMP_IF_NOT_ZERO,
+		START_TIMER, STOP_TIMER, TIMER_TIME, SET_STATE, GET_STATE, TIME_IN_STATE, AFTER_STATE_CHANGE, END
+	};
+
+	// Returns the table of handlers' addresses if called with null code
+	const void *const *run(const Threaded *code, double *r, Timer *timers, const unsigned char *input, unsigned char *output)
+	{
+#ifdef STATE_MACHINE_THREADED_DISPATCH
+		static const void *const handlers[] = {
+			&&LOAD_CONSTANT, &&LOAD_BOOL, &&STORE_BOOL, &&LOAD_INT16, &&STORE_INT16, &&LOAD_UINT16, &&STORE_UINT16,
+			&&LOAD_INT32, &&STORE_INT32, &&LOAD_UINT32, &&STORE_UINT32, &&LOAD_FLOAT, &&STORE_FLOAT, &&LOAD_DOUBLE,
+			&&STORE_DOUBLE, &&MOVE, &&ADD, &&SUBTRACT, &&MULTIPLY, &&DIVIDE, &&MINIMUM, &&MAXIMUM, &&LESS, &&LESS_EQUAL,
+			&&EQUAL, &&NOT_EQUAL, &&AND, &&OR, &&NOT, &&JUMP, &&JUMP_IF_ZERO, &&JUMP_IF_NOT_ZERO, &&START_TIMER,
+			&&STOP_TIMER, &&TIMER_TIME, &&SET_STATE, &&GET_STATE, &&TIME_IN_STATE, &&AFTER_STATE_CHANGE, &&END
+		};
+		if(!code)
+			return handlers;
+		const Threaded *ip = code;
+		goto *ip->handler;
+#else
+		if(!code)
+			return nullptr;
+		const Threaded *ip = code;
+		while(true) switch(Handler(reinterpret_cast<std::uintptr_t>(ip->handler))) {
+#endif
+		BYTECODE_HANDLER(LOAD_CONSTANT)
+			r[ip->destination] = ip->constant;
+			BYTECODE_NEXT;
+		BYTECODE_FIELD_HANDLERS(bool, BOOL)
+		BYTECODE_FIELD_HANDLERS(std::int16_t, INT16)
+		BYTECODE_FIELD_HANDLERS(std::uint16_t, UINT16)
+		BYTECODE_FIELD_HANDLERS(std::int32_t, INT32)
+		BYTECODE_FIELD_HANDLERS(std::uint32_t, UINT32)
+		BYTECODE_FIELD_HANDLERS(float, FLOAT)
+		BYTECODE_FIELD_HANDLERS(double, DOUBLE)
+		BYTECODE_BINARY_HANDLER(MOVE, r[ip->first])
+		BYTECODE_BINARY_HANDLER(ADD, r[ip->first] + r[ip->second])
+		BYTECODE_BINARY_HANDLER(SUBTRACT, r[ip->first] - r[ip->second])
+		BYTECODE_BINARY_HANDLER(MULTIPLY, r[ip->first] * r[ip->second])
+		BYTECODE_BINARY_HANDLER(DIVIDE, r[ip->first] / r[ip->second])
+		BYTECODE_BINARY_HANDLER(MINIMUM, std::min(r[ip->first], r[ip->second]))
+		BYTECODE_BINARY_HANDLER(MAXIMUM, std::max(r[ip->first], r[ip->second]))
+		BYTECODE_BINARY_HANDLER(LESS, r[ip->first] < r[ip->second])
+		BYTECODE_BINARY_HANDLER(LESS_EQUAL, r[ip->first] <= r[ip->second])
+		BYTECODE_BINARY_HANDLER(EQUAL, r[ip->first] == r[ip->second])
+		BYTECODE_BINARY_HANDLER(NOT_EQUAL, r[ip->first] != r[ip->second])
+		BYTECODE_BINARY_HANDLER(AND, r[ip->first] != 0 && r[ip->second] != 0)
+		BYTECODE_BINARY_HANDLER(OR, r[ip->first] != 0 || r[ip->second] != 0)
+		BYTECODE_BINARY_HANDLER(NOT, r[ip->first] == 0)
+		BYTECODE_HANDLER(JUMP)
+			BYTECODE_JUMP(ip->operand);
+		BYTECODE_HANDLER(JUMP_IF_ZERO)
+			if(r[ip->first] == 0)
+				BYTECODE_JUMP(ip->operand);
+			BYTECODE_NEXT;
+		BYTECODE_HANDLER(JUMP_IF_NOT_ZERO)
+			if(r[ip->first] != 0)
+				BYTECODE_JUMP(ip->operand);
+			BYTECODE_NEXT;
+		BYTECODE_HANDLER(START_TIMER)
+			timers[ip->operand] = TimedObject<Input, Output>::makeTimer();
+			BYTECODE_NEXT;
+		BYTECODE_HANDLER(STOP_TIMER)
+			timers[ip->operand].deactivate();
+			BYTECODE_NEXT;
+		BYTECODE_BINARY_HANDLER(TIMER_TIME, double(timers[ip->operand].time()))
+		BYTECODE_HANDLER(SET_STATE)
+			Machine::state(convert<int>(r[ip->first]));
+			BYTECODE_NEXT;
+		BYTECODE_BINARY_HANDLER(GET_STATE, double(Machine::state()))
+		BYTECODE_BINARY_HANDLER(TIME_IN_STATE, double(Machine::timeInState()))
+		BYTECODE_BINARY_HANDLER(AFTER_STATE_CHANGE, Machine::afterStateChange())
+		BYTECODE_HANDLER(END)
+			return nullptr;
+#ifndef STATE_MACHINE_THREADED_DISPATCH
+		}
+#endif
+	}
+
+#undef BYTECODE_HANDLER
+#undef BYTECODE_NEXT
+#undef BYTECODE_JUMP
+#undef BYTECODE_FIELD_HANDLERS
+#undef BYTECODE_BINARY_HANDLER
+
+	std::unique_ptr<Loaded> translate(std::shared_ptr<const Program> program)
+	{
+		std::unique_ptr<Loaded> made = std::make_unique<Loaded>();
+		made->registers.resize(std::max(program->registers_, 1));
+		made->timers.resize(program->timers_);
+		const void *const *handlers = run(nullptr, nullptr, nullptr, nullptr, nullptr);
+		auto handler = [handlers](Handler chosen) -> const void * {
+			if(handlers)
+				return handlers[int(chosen)];
+			return reinterpret_cast<const void *>(std::uintptr_t(chosen));
+		};
+		auto fieldHandler = [&handler](BytecodeFieldType type, bool storing) {
+			return handler(Handler(int(Handler::LOAD_BOOL) + int(type) * 2 + (storing ? 1 : 0)));
+		};
+		int size = int(program->instructions_.size());
+		int index = 0;
+		for(const typename Program::Instruction &instruction : program->instructions_) {
+			Threaded threaded = { nullptr, instruction.destination, instruction.first, instruction.second, instruction.operand, 0 };
+			switch(instruction.opcode) {
+				case BytecodeOpcode::LOAD_CONSTANT:
+					threaded.constant = program->constants_.at(instruction.operand);
+					threaded.handler = handler(Handler::LOAD_CONSTANT);
+					break;
+				case BytecodeOpcode::LOAD_INPUT: {
+					const typename Program::Field &field = program->inputs_.at(instruction.operand);
+					threaded.operand = std::int32_t(field.offset);
+					threaded.handler = fieldHandler(field.type, false);
+					break;
+				}
+				case BytecodeOpcode::STORE_OUTPUT: {
+					const typename Program::Field &field = program->outputs_.at(instruction.operand);
+					threaded.operand = std::int32_t(field.offset);
+					threaded.handler = fieldHandler(field.type, true);
+					break;
+				}
+				case BytecodeOpcode::JUMP:
+				case BytecodeOpcode::JUMP_IF_ZERO:
+				case BytecodeOpcode::JUMP_IF_NOT_ZERO:
+					if(instruction.operand <= index || instruction.operand > size)
+						throw std::invalid_argument("Bytecode jumps must go forward, at most to the end of the program");
+					// Fall through
+				default:
+					if((instruction.opcode == BytecodeOpcode::START_TIMER || instruction.opcode == BytecodeOpcode::STOP_TIMER
+							|| instruction.opcode == BytecodeOpcode::TIMER_TIME) && (instruction.operand < 0 || instruction.operand >= program->timers_))
+						throw std::invalid_argument("Bytecode timer index out of range");
+					if(instruction.opcode > BytecodeOpcode::END)
+						throw std::invalid_argument("Unknown bytecode opcode");
+					threaded.handler = handler(Handler(int(Handler::MOVE) + int(instruction.opcode) - int(BytecodeOpcode::MOVE)));
+			}
+			made->code.push_back(threaded);
+			index++;
+		}
+		// Jumps to the end and running past the last instruction end the tick
+		Threaded end = { handler(Handler::END), 0, 0, 0, 0, 0 };
+		made->code.push_back(end);
+		made->program = program;
+		return made;
+	}
+
+public:
+	/*!
+	* \brief The constructor, the object does nothing until a program is loaded
+	*
+	* \param The initial state
+	*/
+	BytecodeObject(int initialState = 0) :
+		pending_(nullptr),
+		retired_(nullptr)
+	{
+		Machine::state(initialState);
+	}
+
+	/*!
+	* \brief Destructor
+	*/
+	~BytecodeObject()
+	{
+		delete pending_.load();
+		delete retired_.load();
+	}
+
+	/*!
+	* \brief Loads a program, it will be run from the next tick on, registers and timers are reset, the state is kept
+	*
+	* \param The program
+	*
+	* \note Can be called from any thread, but only one at a time. Throws std::invalid_argument if the program refers to
+	* nonexistent constants, fields, timers or instructions or jumps backwards
+	*/
+	void load(std::shared_ptr<const Program> program)
+	{
+		std::unique_ptr<Loaded> made = translate(program);
+		delete retired_.exchange(nullptr, std::memory_order_acq_rel);
+		delete pending_.exchange(made.release(), std::memory_order_acq_rel);
+	}
+
+	/*!
+	* \brief Returns the program that was run in the last tick
+	*
+	* \return The program, null if none was run yet
+	*
+	* \note Meant to be called from the objects' tick() methods
+	*/
+	std::shared_ptr<const Program> program() const
+	{
+		return current_ ? current_->program : nullptr;
+	}
+
+	/*!
+	* \brief Returns a register's value
+	*
+	* \param The register's index
+	*
+	* \return The value, 0 if out of range
+	*
+	* \note Meant to be called from the objects' tick() methods
+	*/
+	double registerValue(int index) const
+	{
+		if(!current_ || index < 0 || index >= int(current_->registers.size()))
+			return 0;
+		return current_->registers[index];
+	}
+
+	virtual void tick(const Input &in, Output &out)
+	{
+		if(pending_.load(std::memory_order_relaxed)) {
+			Loaded *next = pending_.exchange(nullptr, std::memory_order_acq_rel);
+			// The loading thread frees the old one, unless it's loading too fast
+			delete retired_.exchange(current_.release(), std::memory_order_acq_rel);
+			current_.reset(next);
+		}
+		if(!current_)
+			return;
+		run(current_->code.data(), current_->registers.data(), current_->timers.data(),
+				reinterpret_cast<const unsigned char *>(&in), reinterpret_cast<unsigned char *>(&out));
+	}
+};
+
+#endif // BYTECODE_OBJECT_H
@@ -0,0 +1,167 @@
+/*
+* \brief An array of output channels that records which channels changed
+*
+* A ChannelArray is meant to be a member of the output structure instead of a large array. Its channels are changed only
+* through set(), which marks the channel in a bitmap if the value differs. The bitmap is scanned a 64-bit word at a time,
+* so parts of the array without changes are skipped quickly. If it's registered in the manager using
+* StateMachineManager::addChannelArray(), the bitmap is cleared at the beginning of every tick and only the changed
+* channels are copied into the output and its snapshot, whose bitmaps then tell readers which channels changed in the
+* last tick.
+*/
+
+#ifndef STATE_MACHINE_CHANNEL_ARRAY_H
+#define STATE_MACHINE_CHANNEL_ARRAY_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+template<typename T, std::size_t Channels>
+class ChannelArray {
+public:
+	static constexpr std::size_t WORDS = (Channels + 63) / 64;
+
+private:
+	T values_[Channels];
+	std::uint64_t dirty_[WORDS];
+
+	static unsigned int lowestBit(std::uint64_t word)
+	{
+#ifdef __GNUC__
+		return unsigned(__builtin_ctzll(word));
+#else
+		unsigned int bit = 0;
+		while(!(word & 1)) {
+			word >>= 1;
+			bit++;
+		}
+		return bit;
+#endif
+	}
+
+public:
+	/*!
+	* \brief Reads a channel
+	*
+	* \param The channel's index
+	*
+	* \return The value
+	*/
+	const T &operator[](std::size_t channel) const
+	{
+		return values_[channel];
+	}
+
+	/*!
+	* \brief Changes a channel and marks it as changed if the value is different
+	*
+	* \param The channel's index
+	* \param The value
+	*/
+	void set(std::size_t channel, const T &value)
+	{
+		if(!(values_[channel] == value)) {
+			values_[channel] = value;
+			dirty_[channel / 64] |= std::uint64_t(1) << (channel % 64);
+		}
+	}
+
+	/*!
+	* \brief Checks if a channel changed since the bitmap was last cleared
+	*
+	* \param The channel's index
+	*
+	* \return If it did
+	*/
+	bool changed(std::size_t channel) const
+	{
+		return (dirty_[channel / 64] >> (channel % 64)) & 1;
+	}
+
+	/*!
+	* \brief Forgets all changes
+	*/
+	void clearChanges()
+	{
+		std::memset(dirty_, 0, sizeof(dirty_));
+	}
+
+	/*!
+	* \brief Calls a function for each sequence of neighbouring changed channels
+	*
+	* \param The function, taking the index of the first channel and the number of channels
+	*/
+	template<typename Function>
+	void forEachChangedRun(Function function) const
+	{
+		std::size_t start = 0;
+		std::size_t end = 0;
+		for(std::size_t i = 0; i < WORDS; i++) {
+			std::uint64_t word = dirty_[i];
+			while(word) {
+				std::size_t channel = i * 64 + lowestBit(word);
+				word &= word - 1;
+				if(channel != end) {
+					if(end > start)
+						function(start, end - start);
+					start = channel;
+				}
+				end = channel + 1;
+			}
+		}
+		if(end > start)
+			function(start, end - start);
+	}
+
+	/*!
+	* \brief Calls a function for each part of the array's memory that changed, including the bitmap, parts closer to
+	* each other than a cache line are joined, because copying the few unchanged bytes between them is cheaper than
+	* another call
+	*
+	* \param The function, taking the offset from the beginning of the array and the length, in bytes
+	*/
+	template<typename Function>
+	void forEachChangedBytes(Function function) const
+	{
+		const std::size_t values = reinterpret_cast<const unsigned char *>(values_) - reinterpret_cast<const unsigned char *>(this);
+		std::size_t start = 0;
+		std::size_t end = 0;
+		forEachChangedRun([&](std::size_t first, std::size_t count) {
+			std::size_t offset = values + first * sizeof(T);
+			if(end > start && offset - end > 64) {
+				function(start, end - start);
+				start = offset;
+			} else if(end == start)
+				start = offset;
+			end = offset + count * sizeof(T);
+		});
+		if(end > start)
+			function(start, end - start);
+		function(reinterpret_cast<const unsigned char *>(dirty_) - reinterpret_cast<const unsigned char *>(this), sizeof(dirty_));
+	}
+
+	/*!
+	* \brief Returns the values
+	*
+	* \return The array of all channels
+	*/
+	const T *data() const
+	{
+		return values_;
+	}
+
+	/*!
+	* \brief Returns the number of channels
+	*
+	* \return The number
+	*/
+	static constexpr std::size_t size()
+	{
+		return Channels;
+	}
+};
+
+template<typename T, std::size_t Channels>
+constexpr std::size_t ChannelArray<T, Channels>::WORDS;
+
+#endif // STATE_MACHINE_CHANNEL_ARRAY_H
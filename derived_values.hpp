@@ -0,0 +1,166 @@
+/*
+* \brief Values derived from the input that are computed once per tick, shared by all objects
+*
+* A DerivedValues holds named functions computing values from the input, like averages of groups of sensors or summaries
+* of interlocks. A value is computed when an object first reads it in a tick and the result is kept for the rest of the
+* tick, so other objects reading it get it without computing it again. The values are invalidated by an input stage
+* created by refreshDerived(), which counts the ticks, a value is recomputed if it was computed in an older tick.
+*
+* Names are used only to find the values when the objects are set up, reading a value through its handle involves no
+* lookup. The functions may read other derived values, but they must not depend on each other in a cycle.
+*/
+
+#ifndef STATE_MACHINE_DERIVED_VALUES_H
+#define STATE_MACHINE_DERIVED_VALUES_H
+
+#include <string>
+#include <memory>
+#include <typeindex>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+
+template<typename Input>
+class DerivedValues {
+	struct SlotBase {
+		std::type_index type;
+		unsigned long long tick = 0; // When it was last computed
+		bool computing = false;
+
+		SlotBase(std::type_index type) :
+			type(type)
+		{
+		}
+		virtual ~SlotBase() = default;
+	};
+	template<typename T>
+	struct Slot : SlotBase {
+		std::function<T(const Input &)> compute;
+		T value;
+
+		Slot(std::function<T(const Input &)> compute) :
+			SlotBase(typeid(T)),
+			compute(compute),
+			value()
+		{
+		}
+	};
+
+	std::unordered_map<std::string, std::unique_ptr<SlotBase>> slots_;
+	unsigned long long tick_ = 1; // Slots start at 0, so that nothing is considered computed before the first tick
+	const Input *input_ = nullptr;
+
+	template<typename T>
+	const T &read(Slot<T> &slot) const
+	{
+		if(slot.tick != tick_) {
+			if(!input_)
+				throw std::logic_error("Derived values can be read only during ticks");
+			if(slot.computing)
+				throw std::logic_error("Derived values depend on each other in a cycle");
+			slot.computing = true;
+			try {
+				slot.value = slot.compute(*input_);
+			} catch(...) {
+				slot.computing = false;
+				throw;
+			}
+			slot.computing = false;
+			slot.tick = tick_;
+		}
+		return slot.value;
+	}
+
+	template<typename Owner>
+	friend std::function<void(Owner &)> refreshDerived(std::shared_ptr<DerivedValues<Owner>> values);
+
+public:
+	// Handle of a value, valid as long as the DerivedValues exists
+	template<typename T>
+	class Value {
+		Slot<T> *slot_ = nullptr;
+		const DerivedValues *owner_ = nullptr;
+
+		Value(Slot<T> *slot, const DerivedValues *owner) :
+			slot_(slot),
+			owner_(owner)
+		{
+		}
+
+	public:
+		Value() = default;
+
+		/*!
+		* \brief Returns the value, computes it if it wasn't computed in this tick yet
+		*
+		* \return The value
+		*
+		* \note Must be called only from objects' ticks
+		*/
+		const T &get() const
+		{
+			return owner_->read(*slot_);
+		}
+
+		friend class DerivedValues;
+	};
+
+	/*!
+	* \brief Adds a value
+	*
+	* \param The name, unique
+	* \param The function computing it, taking the input
+	*
+	* \return The handle of the value
+	*
+	* \note The execution must be paused to call this safely. Throws std::invalid_argument if the name is used already
+	*/
+	template<typename T>
+	Value<T> add(const std::string &name, std::function<T(const Input &)> compute)
+	{
+		std::unique_ptr<Slot<T>> slot(new Slot<T>(compute));
+		Slot<T> *added = slot.get();
+		if(!slots_.emplace(name, std::move(slot)).second)
+			throw std::invalid_argument("A derived value named " + name + " exists already");
+		return Value<T>(added, this);
+	}
+
+	/*!
+	* \brief Finds a value
+	*
+	* \param The name
+	*
+	* \return The handle of the value
+	*
+	* \note The execution must be paused to call this safely. Throws std::invalid_argument if there is no such value or
+	* it has a different type
+	*/
+	template<typename T>
+	Value<T> find(const std::string &name) const
+	{
+		auto found = slots_.find(name);
+		if(found == slots_.end())
+			throw std::invalid_argument("There is no derived value named " + name);
+		if(found->second->type != std::type_index(typeid(T)))
+			throw std::invalid_argument("Derived value " + name + " has a different type");
+		return Value<T>(static_cast<Slot<T> *>(found->second.get()), this);
+	}
+};
+
+/*!
+* \brief Creates an input stage that invalidates the derived values at the beginning of every tick
+*
+* \param The derived values, kept alive by the stage
+*
+* \return The stage, to be added to the manager by addInputStage()
+*/
+template<typename Input>
+std::function<void(Input &)> refreshDerived(std::shared_ptr<DerivedValues<Input>> values)
+{
+	return [values](Input &input) {
+		values->tick_++;
+		values->input_ = &input;
+	};
+}
+
+#endif // STATE_MACHINE_DERIVED_VALUES_H
@@ -0,0 +1,143 @@
+/*
+* \brief A bit-packed image of digital channels with their rising and falling edges
+*
+* A DigitalImage is meant to be a member of the input structure instead of an array of bool. It stores the channels as
+* bits of 64-bit words together with their rising and falling edges since the previous tick. The edges of all channels
+* are computed by a stage returned by detectEdges(), which is added to the manager using addInputStage() and processes a
+* whole word with a single operation, so objects only read one bit to check for an edge (like R_TRIG and F_TRIG).
+*/
+
+#ifndef STATE_MACHINE_DIGITAL_IMAGE_H
+#define STATE_MACHINE_DIGITAL_IMAGE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+template<std::size_t Channels>
+class DigitalImage {
+public:
+	static constexpr std::size_t WORDS = (Channels + 63) / 64;
+
+	std::uint64_t values[WORDS];
+	std::uint64_t rising[WORDS];
+	std::uint64_t falling[WORDS];
+
+	/*!
+	* \brief Returns the value of a channel
+	*
+	* \param The channel's index
+	*
+	* \return The value
+	*/
+	bool get(std::size_t channel) const
+	{
+		return (values[channel / 64] >> (channel % 64)) & 1;
+	}
+
+	/*!
+	* \brief Sets the value of a channel
+	*
+	* \param The channel's index
+	* \param The value
+	*/
+	void set(std::size_t channel, bool value)
+	{
+		const std::uint64_t bit = std::uint64_t(1) << (channel % 64);
+		values[channel / 64] = value ? (values[channel / 64] | bit) : (values[channel / 64] & ~bit);
+	}
+
+	/*!
+	* \brief Checks if a channel changed from false to true since the previous tick
+	*
+	* \param The channel's index
+	*
+	* \return If it did
+	*/
+	bool rose(std::size_t channel) const
+	{
+		return (rising[channel / 64] >> (channel % 64)) & 1;
+	}
+
+	/*!
+	* \brief Checks if a channel changed from true to false since the previous tick
+	*
+	* \param The channel's index
+	*
+	* \return If it did
+	*/
+	bool fell(std::size_t channel) const
+	{
+		return (falling[channel / 64] >> (channel % 64)) & 1;
+	}
+
+	/*!
+	* \brief Checks if any channel changed since the previous tick
+	*
+	* \return If any did
+	*/
+	bool changed() const
+	{
+		std::uint64_t any = 0;
+		for(std::size_t i = 0; i < WORDS; i++)
+			any |= rising[i] | falling[i];
+		return any != 0;
+	}
+};
+
+template<std::size_t Channels>
+constexpr std::size_t DigitalImage<Channels>::WORDS;
+
+/*!
+* \brief Creates an input stage computing the edges of a digital image in the input
+*
+* The stage runs every base tick, so objects with a longer period would miss the edges of the ticks they don't run in.
+* To avoid it, the edges can be accumulated over a number of base ticks, so that objects running every that many base
+* ticks see all edges since their previous tick. The accumulation is aligned to the first tick of the execution, like
+* the ticks of the objects, so the stage must be added before the execution is first unpaused. Objects with other
+* periods than the accumulated one should use a different image.
+*
+* \param Pointer to the member of the input structure
+* \param The period of the objects reading the edges divided by the base period, 1 if they run every base tick
+*
+* \return The stage, to be added to the manager by addInputStage(), it keeps the values of the previous tick, so it
+* must be added only once. All channels that are true in the first tick have a rising edge
+*/
+template<typename Input, std::size_t Channels>
+std::function<void(Input &)> detectEdges(DigitalImage<Channels> Input::*member, int ticks = 1)
+{
+	struct Stage {
+		DigitalImage<Channels> Input::*member;
+		int ticks;
+		int count;
+		bool clear;
+		std::uint64_t previous[DigitalImage<Channels>::WORDS];
+		std::uint64_t rising[DigitalImage<Channels>::WORDS];
+		std::uint64_t falling[DigitalImage<Channels>::WORDS];
+
+		void operator()(Input &input)
+		{
+			// The edges are forgotten in the tick after the one the objects ran in
+			bool forget = clear;
+			clear = count == 0;
+			if(++count == ticks)
+				count = 0;
+			DigitalImage<Channels> &image = input.*member;
+			for(std::size_t i = 0; i < DigitalImage<Channels>::WORDS; i++) {
+				std::uint64_t rose = image.values[i] & ~previous[i];
+				std::uint64_t fell = ~image.values[i] & previous[i];
+				rising[i] = forget ? rose : rising[i] | rose;
+				falling[i] = forget ? fell : falling[i] | fell;
+				image.rising[i] = rising[i];
+				image.falling[i] = falling[i];
+				previous[i] = image.values[i];
+			}
+		}
+	};
+	if(ticks < 1)
+		ticks = 1;
+	Stage stage = { member, ticks, 0, true, {}, {}, {} };
+	return stage;
+}
+
+#endif // STATE_MACHINE_DIGITAL_IMAGE_H
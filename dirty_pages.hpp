@@ -0,0 +1,274 @@
+/*
+* \brief Tracking which pages of a large structure were written, so that only they have to be copied
+*
+* The structure is placed in its own page-aligned memory. At the beginning of each tracked period, the pages written in
+* the previous one are write-protected again. The first write into a protected page causes a fault, which is handled by
+* recording the page as dirty and making it writable, so each page costs at most one fault per period and reading is
+* never slowed down. The soft-dirty bits of the kernel were not used, because reading them requires going through
+* /proc/self/pagemap for every page.
+*
+* Only the thread that tracks the image may write into it. The fault handler is installed for SIGSEGV when the first
+* image is created and passes faults outside the images to the previous handler. Available only on Linux.
+*/
+
+#ifndef DIRTY_PAGES_H
+#define DIRTY_PAGES_H
+
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <mutex>
+#include <type_traits>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+class DirtyPageRegion {
+	static constexpr int MAX_REGIONS = 64;
+
+	static std::atomic<DirtyPageRegion *> *regions()
+	{
+		static std::atomic<DirtyPageRegion *> regions[MAX_REGIONS] = {};
+		return regions;
+	}
+
+	static struct sigaction &previousHandler()
+	{
+		static struct sigaction previous;
+		return previous;
+	}
+
+	static void handleFault(int signal, siginfo_t *info, void *context)
+	{
+		unsigned char *address = static_cast<unsigned char *>(info->si_addr);
+		for(int i = 0; i < MAX_REGIONS; i++) {
+			DirtyPageRegion *region = regions()[i].load(std::memory_order_acquire);
+			if(region && address >= region->memory_ && address < region->memory_ + region->pages_ * region->pageSize_) {
+				std::size_t page = (address - region->memory_) / region->pageSize_;
+				::mprotect(region->memory_ + page * region->pageSize_, region->pageSize_, PROT_READ | PROT_WRITE);
+				if(!region->dirty_[page]) {
+					region->dirty_[page] = 1;
+					region->dirtyList_.push_back(page); // Reserved for all pages, never allocates
+				}
+				return;
+			}
+		}
+		struct sigaction &previous = previousHandler();
+		if(previous.sa_flags & SA_SIGINFO)
+			previous.sa_sigaction(signal, info, context);
+		else if(previous.sa_handler != SIG_IGN && previous.sa_handler != SIG_DFL)
+			previous.sa_handler(signal);
+		else {
+			// Returning makes the instruction fault again, this time killing the process
+			::signal(signal, SIG_DFL);
+		}
+	}
+
+	void protect(std::size_t first, std::size_t count)
+	{
+		::mprotect(memory_ + first * pageSize_, count * pageSize_, PROT_READ);
+	}
+
+protected:
+	unsigned char *memory_;
+	std::size_t size_;
+	std::size_t pageSize_;
+	std::size_t pages_;
+	std::vector<unsigned char> dirty_;
+	std::vector<std::size_t> dirtyList_;
+	bool assigned_ = true;
+
+	DirtyPageRegion(std::size_t size) :
+		size_(size),
+		pageSize_(std::size_t(::sysconf(_SC_PAGESIZE))),
+		pages_((size + pageSize_ - 1) / pageSize_),
+		dirty_(pages_, 1)
+	{
+		void *memory = ::mmap(nullptr, pages_ * pageSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(memory == MAP_FAILED)
+			throw std::runtime_error("Cannot allocate memory for dirty page tracking");
+		memory_ = static_cast<unsigned char *>(memory);
+		dirtyList_.reserve(pages_);
+
+		static std::once_flag installed;
+		std::call_once(installed, []() {
+			struct sigaction action = {};
+			action.sa_sigaction = &DirtyPageRegion::handleFault;
+			action.sa_flags = SA_SIGINFO | SA_NODEFER;
+			sigemptyset(&action.sa_mask);
+			::sigaction(SIGSEGV, &action, &previousHandler());
+		});
+		for(int i = 0; i < MAX_REGIONS; i++) {
+			DirtyPageRegion *expected = nullptr;
+			if(regions()[i].compare_exchange_strong(expected, this))
+				return;
+		}
+		::munmap(memory_, pages_ * pageSize_);
+		throw std::runtime_error("Too many regions with dirty page tracking");
+	}
+
+	~DirtyPageRegion()
+	{
+		for(int i = 0; i < MAX_REGIONS; i++) {
+			DirtyPageRegion *expected = this;
+			regions()[i].compare_exchange_strong(expected, nullptr);
+		}
+		::munmap(memory_, pages_ * pageSize_);
+	}
+
+	DirtyPageRegion(const DirtyPageRegion &) = delete;
+	DirtyPageRegion &operator=(const DirtyPageRegion &) = delete;
+
+public:
+	/*!
+	* \brief Starts a new tracked period, the pages written from now on are reported as dirty until the next call
+	*
+	* \note If the contents were replaced by assign(), all pages are reported as dirty in the period started by this
+	*/
+	void track()
+	{
+		std::size_t first = 0;
+		std::size_t count = 0;
+		for(std::size_t page = 0; page < pages_; page++) {
+			if(dirty_[page]) {
+				if(!count)
+					first = page;
+				count++;
+				dirty_[page] = 0;
+			} else if(count) {
+				protect(first, count);
+				count = 0;
+			}
+		}
+		if(count)
+			protect(first, count);
+		dirtyList_.clear();
+		if(assigned_) {
+			std::fill(dirty_.begin(), dirty_.end(), 1);
+			for(std::size_t page = 0; page < pages_; page++)
+				dirtyList_.push_back(page);
+			assigned_ = false;
+		}
+	}
+
+	/*!
+	* \brief Calls a function with every run of neighbouring dirty pages, clipped to the structure's size
+	*
+	* \param The function, called with the offset and length of the run in bytes, in increasing order of offsets
+	*/
+	template<typename Function>
+	void forEachDirtyRun(Function function) const
+	{
+		std::size_t page = 0;
+		while(page < pages_) {
+			if(!dirty_[page]) {
+				page++;
+				continue;
+			}
+			std::size_t end = page + 1;
+			while(end < pages_ && dirty_[end])
+				end++;
+			std::size_t offset = page * pageSize_;
+			function(offset, std::min(end * pageSize_, size_) - offset);
+			page = end;
+		}
+	}
+
+	/*!
+	* \brief Returns the number of pages written in the current tracked period
+	*
+	* \return The number of pages
+	*/
+	std::size_t dirtyPages() const
+	{
+		return dirtyList_.size();
+	}
+
+	/*!
+	* \brief Returns the number of pages of the structure
+	*
+	* \return The number of pages
+	*/
+	std::size_t pages() const
+	{
+		return pages_;
+	}
+
+	/*!
+	* \brief Returns the size of a page
+	*
+	* \return The size in bytes
+	*/
+	std::size_t pageSize() const
+	{
+		return pageSize_;
+	}
+};
+
+template<typename T>
+class DirtyPageImage : public DirtyPageRegion {
+public:
+	/*!
+	* \brief The constructor, allocates the memory and copies the initial value into it
+	*
+	* \param The initial value, all pages are dirty in the first tracked period
+	*
+	* \note Throws std::runtime_error if the memory cannot be allocated
+	*/
+	DirtyPageImage(const T &initial) :
+		DirtyPageRegion(sizeof(T))
+	{
+		// Checked here, so that managers only refuse outputs that can't be tracked when tracking is used
+		static_assert(std::is_trivially_copyable<T>::value, "Structures with tracked pages must be trivially copyable");
+		std::memcpy(memory_, &initial, sizeof(T));
+	}
+
+	/*!
+	* \brief Gives access to the structure, it may be written only by the thread that calls track()
+	*
+	* \return The structure
+	*/
+	T &value()
+	{
+		return *reinterpret_cast<T *>(memory_);
+	}
+
+	/*!
+	* \brief Gives access to the const structure
+	*
+	* \return The structure
+	*/
+	const T &value() const
+	{
+		return *reinterpret_cast<const T *>(memory_);
+	}
+
+	/*!
+	* \brief Replaces the whole contents, all pages will be dirty in the next tracked period
+	*
+	* \param The new value
+	*/
+	void assign(const T &value)
+	{
+		::mprotect(memory_, pages_ * pageSize_, PROT_READ | PROT_WRITE);
+		std::memcpy(memory_, &value, sizeof(T));
+		std::fill(dirty_.begin(), dirty_.end(), 1);
+		assigned_ = true;
+	}
+
+	/*!
+	* \brief Copies the pages written in the current tracked period into another structure
+	*
+	* \param The structure to copy into, the rest of it is expected to have the same contents already
+	*/
+	void copyDirty(T &destination) const
+	{
+		unsigned char *to = reinterpret_cast<unsigned char *>(&destination);
+		forEachDirtyRun([this, to](std::size_t offset, std::size_t length) {
+			std::memcpy(to + offset, memory_ + offset, length);
+		});
+	}
+};
+
+#endif // DIRTY_PAGES_H
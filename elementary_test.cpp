@@ -1,5 +1,27 @@
 #include <iostream>
-#include "state_machine.hpp"
+#include "modbus_server.hpp"
+#include "websocket_server.hpp"
+#include "static_schedule.hpp"
+#include "timer_bank.hpp"
+#include "digital_image.hpp"
+#include "analog_conditioning.hpp"
+#include "output_limiting.hpp"
+#include "profile_engine.hpp"
+#include "alarm_engine.hpp"
+#include "derived_values.hpp"
+#include "bytecode_object.hpp"
+#include "replication.hpp"
+#include "plugin.hpp"
+#include <cstdlib>
+
+// The same as in plugin_example.cpp, local classes would let the compiler assume no other classes derive from
+// TimedObject<PluginInput, PluginOutput> and devirtualise calls to objects created by the plugin
+struct PluginInput {
+	int value;
+};
+struct PluginOutput {
+	int scaled;
+};
 
 int main()
 {
@@ -59,7 +81,7 @@ int main()
 						}
 						break;
 					case 1:
-						if (timer.getTime() >= 1000)
+						if (timer.time() >= 1000)
 							status_ = 2;
 						break;
 					case 2:
@@ -69,7 +91,7 @@ int main()
 						}
 						break;
 					case 3:
-						if (timer.getTime() >= 1000)
+						if (timer.time() >= 1000)
 							status_ = 4;
 						break;
 				}
@@ -112,5 +134,1051 @@ int main()
 			std::cout << std::endl;
 		}
 	}
+	
+	std::cout << "Input segments test" << std::endl;
+	{
+		struct Input {
+			int analog;
+			int digital;
+		};
+		struct Output {
+			int sum;
+		};
+		
+		StateMachineManager<Input, Output> manager(Input{ 0, 0 }, Output{ 0 }, 100);
+		auto analog = manager.addInputSegment(&Input::analog);
+		auto digital = manager.addInputSegment(&Input::digital);
+		
+		class Adder : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.sum = in.analog + in.digital;
+			}
+		};
+		manager.addTimedObject(100, std::make_shared<Adder>());
+		manager.unpause();
+		
+		std::thread analogDriver([&analog]() {
+			for (int i = 1; i <= 1000; i++)
+				analog->publish(i);
+		});
+		std::thread digitalDriver([&digital]() {
+			for (int i = 1; i <= 1000; i++)
+				digital->publish(i * 1000);
+		});
+		analogDriver.join();
+		digitalDriver.join();
+		
+		std::this_thread::sleep_for (std::chrono::milliseconds(300));
+		auto out = manager.output();
+		std::cout << "Sum " << out->sum << " (expected 1001000)" << std::endl;
+	}
+	
+	std::cout << "I/O mapping test" << std::endl;
+	{
+		struct Input {
+			std::int32_t first;
+			std::int32_t second;
+			std::int16_t apart;
+			std::int16_t overlapping;
+			std::int32_t again;
+		};
+		struct Output {
+			std::int32_t first;
+			std::int32_t second;
+			std::int32_t apart;
+		};
+		
+		unsigned char inputs[16];
+		for (int i = 0; i < 16; i++)
+			inputs[i] = std::uint8_t(i * 17 + 1);
+		unsigned char outputs[16];
+		std::memset(outputs, 0xee, sizeof(outputs));
+		IoMapping<Input, Output> mapping;
+		// Mapped out of order, the first two are adjacent in both and merged
+		mapping.mapInput(inputs, 4, &Input::second);
+		mapping.mapInput(inputs, 0, &Input::first);
+		mapping.mapInput(inputs, 10, &Input::apart);
+		// These overlap with the first field in the buffer
+		mapping.mapInput(inputs, 2, &Input::overlapping);
+		mapping.mapInput(inputs, 0, &Input::again);
+		mapping.mapOutput(outputs, 4, &Output::second);
+		mapping.mapOutput(outputs, 0, &Output::first);
+		mapping.mapOutput(outputs, 12, &Output::apart);
+		
+		Input in = {};
+		mapping.scatter(in);
+		bool scattered = !std::memcmp(&in.first, inputs, 4) && !std::memcmp(&in.second, inputs + 4, 4) && !std::memcmp(&in.apart, inputs + 10, 2)
+				&& !std::memcmp(&in.overlapping, inputs + 2, 2) && !std::memcmp(&in.again, inputs, 4);
+		Output out = { in.first, in.second, in.apart };
+		mapping.gather(out);
+		bool gathered = !std::memcmp(outputs, inputs, 8) && !std::memcmp(outputs + 12, &out.apart, 4);
+		bool untouched = outputs[8] == 0xee && outputs[11] == 0xee;
+		std::cout << "Regions " << mapping.regionCount() << ", scattered " << scattered << ", gathered " << gathered << ", untouched "
+				<< untouched << " (expected 6 1 1 1)" << std::endl;
+	}
+	
+	std::cout << "Modbus test" << std::endl;
+	{
+		struct Input {
+			std::int16_t setpoint;
+		};
+		struct Output {
+			std::int16_t doubled;
+			float ratio;
+		};
+		
+		StateMachineManager<Input, Output> manager(Input{ 4 }, Output{ 0, 0 }, 50);
+		
+		class Doubler : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.doubled = in.setpoint * 2;
+				out.ratio = in.setpoint / 4.0f;
+			}
+		};
+		manager.addTimedObject(50, std::make_shared<Doubler>());
+		
+		ModbusServer<Input, Output> server(manager);
+		server.mapInput(0, &Input::setpoint);
+		server.mapOutput(10, &Output::doubled);
+		server.mapOutput(11, &Output::ratio);
+		bool overlapRefused = false;
+		try {
+			server.mapOutput(9, &Output::ratio); // Overlaps register 10 only with its second register
+		} catch(std::invalid_argument &) {
+			overlapRefused = true;
+		}
+		server.start(0, true);
+		manager.unpause();
+		
+		int client = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(std::uint16_t(server.port()));
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+		auto transact = [client](std::vector<std::uint8_t> pdu) {
+			std::vector<std::uint8_t> frame = { 0, 1, 0, 0, 0, std::uint8_t(pdu.size() + 1), 1 };
+			frame.insert(frame.end(), pdu.begin(), pdu.end());
+			send(client, frame.data(), frame.size(), 0);
+			std::uint8_t response[260];
+			ssize_t got = recv(client, response, sizeof(response), 0);
+			return std::vector<std::uint8_t>(response + 7, response + std::max<ssize_t>(got, 7));
+		};
+		
+		std::vector<std::uint8_t> written = transact({ 6, 0, 0, 0, 21 });
+		std::cout << "Write echoed " << (written.size() == 5 && written[4] == 21) << std::endl;
+		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		std::vector<std::uint8_t> read = transact({ 3, 0, 10, 0, 3 });
+		float ratio;
+		std::uint32_t raw = (std::uint32_t(read[4]) << 24) | (read[5] << 16) | (read[6] << 8) | read[7];
+		std::memcpy(&ratio, &raw, sizeof(ratio));
+		std::cout << "Doubled " << ((read[2] << 8) | read[3]) << " ratio " << ratio << " (expected 42 5.25)" << std::endl;
+		std::vector<std::uint8_t> wrong = transact({ 6, 0, 10, 0, 1 });
+		std::cout << "Writing output refused " << (wrong.size() == 2 && wrong[0] == 0x86 && wrong[1] == 2) << std::endl;
+		std::vector<std::uint8_t> unmapped = transact({ 3, 0, 9, 0, 1 });
+		std::cout << "Overlapping mapping refused " << overlapRefused << ", left unmapped "
+				<< (unmapped.size() == 2 && unmapped[0] == 0x83 && unmapped[1] == 2) << " (expected 1 1)" << std::endl;
+		close(client);
+	}
+	
+	std::cout << "WebSocket test" << std::endl;
+	{
+		struct Input {
+			int value;
+		};
+		struct Output {
+			int doubled;
+			int constant;
+		};
+		
+		StateMachineManager<Input, Output> manager(Input{ 21 }, Output{ 0, 0 }, 10);
+		
+		class Doubler : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.doubled = in.value * 2;
+				out.constant = 7;
+			}
+		};
+		manager.addTimedObject(10, std::make_shared<Doubler>());
+		
+		WebSocketServer<Input, Output> server(manager, std::chrono::milliseconds(20));
+		server.addField("doubled", &Output::doubled);
+		server.addField("constant", &Output::constant);
+		server.start(0, true);
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		
+		int client = socket(AF_INET, SOCK_STREAM, 0);
+		timeval timeout = { 0, 100000 };
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(std::uint16_t(server.port()));
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+		// The key from the RFC's example, followed by a masked ping in the same packet
+		std::string request = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+				"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+		const char ping[] = { char(0x89), char(0x82), 1, 2, 3, 4, char('h' ^ 1), char('i' ^ 2) };
+		request.append(ping, sizeof(ping));
+		send(client, request.data(), request.size(), 0);
+		
+		std::string received;
+		auto start = std::chrono::steady_clock::now();
+		while(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500)) {
+			char buffer[1024];
+			ssize_t got = recv(client, buffer, sizeof(buffer), 0);
+			if(got > 0)
+				received.append(buffer, got);
+		}
+		close(client);
+		
+		std::size_t headerEnd = received.find("\r\n\r\n");
+		std::cout << "Accept key right " << (received.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") < headerEnd) << std::endl;
+		bool described = false, ponged = false;
+		int deltas = 0, doubledSent = 0, constantSent = 0;
+		int doubled = 0;
+		for(std::size_t position = headerEnd + 4; headerEnd != std::string::npos && position + 2 <= received.size();) {
+			int opcode = received[position] & 0x0f;
+			std::size_t length = std::uint8_t(received[position + 1]);
+			std::string payload = received.substr(position + 2, length);
+			position += 2 + length;
+			if(opcode == 0x1)
+				described = payload == "{\"fields\":[{\"name\":\"doubled\",\"size\":4},{\"name\":\"constant\",\"size\":4}]}";
+			else if(opcode == 0xA)
+				ponged = payload == "hi";
+			else if(opcode == 0x2) {
+				deltas++;
+				// The version, then the changed fields as their index and contents
+				for(std::size_t field = 8; field + 6 <= payload.size(); field += 6) {
+					int index = std::uint8_t(payload[field]) | (std::uint8_t(payload[field + 1]) << 8);
+					if(index == 0) {
+						std::memcpy(&doubled, payload.data() + field + 2, sizeof(doubled));
+						doubledSent++;
+					} else {
+						constantSent++;
+					}
+				}
+			}
+		}
+		std::cout << "Described " << described << ", ponged " << ponged << ", deltas " << deltas << ", doubled " << doubled << " sent "
+				<< doubledSent << ", constant sent " << constantSent << " (expected 1 1 1 42 1 1)" << std::endl;
+	}
+	
+	std::cout << "Online change test" << std::endl;
+	{
+		struct Input {
+			int value;
+		};
+		struct Output {
+			int count;
+		};
+		
+		StateMachineManager<Input, Output> manager(Input{ 0 }, Output{ 0 }, 20);
+		
+		class CounterOne : public StateMachine<Input, Output, int> {
+		public:
+			CounterOne()
+			{
+				state(0);
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.count = ++count_;
+			}
+			int count_ = 0;
+		};
+		class CounterTen : public StateMachine<Input, Output, int> {
+		public:
+			CounterTen()
+			{
+				state(0);
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				count_ += 10;
+				out.count = count_;
+			}
+			int count_ = 0;
+		};
+		
+		std::shared_ptr<CounterOne> first = std::make_shared<CounterOne>();
+		manager.addTimedObject(20, first);
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		
+		std::shared_ptr<CounterTen> second = std::make_shared<CounterTen>();
+		manager.replaceTimedObject(first, second, [](CounterOne &from, CounterTen &to) {
+			to.count_ = from.count_ * 100;
+		});
+		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		bool thrown = false;
+		try {
+			manager.replaceTimedObject(second, std::make_shared<CounterOne>(), [](CounterTen &, CounterOne &) {
+				throw std::runtime_error("Transfer failed");
+			});
+		} catch(std::runtime_error &) {
+			thrown = true;
+		}
+		int before = second->count_;
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		manager.pause();
+		auto out = manager.output();
+		std::cout << "Old object stopped at " << first->count_ << ", the new one continued from " << first->count_ * 100
+				<< " to " << out->count << std::endl;
+		std::cout << "Failed transfer reported " << thrown << ", the object kept running " << (second->count_ > before)
+				<< " (expected 1 1)" << std::endl;
+	}
+	
+	std::cout << "Dirty pages test" << std::endl;
+	{
+		struct Input {
+			int value;
+		};
+		struct Output {
+			int values[100000];
+		};
+		
+		std::unique_ptr<Output> initial = std::make_unique<Output>();
+		initial->values[99999] = 7;
+		StateMachineManager<Input, Output> manager(Input{ 0 }, *initial, 20);
+		manager.trackDirtyPages();
+		std::shared_ptr<const PublishedSnapshot<Output>> snapshot = manager.outputSnapshot();
+		
+		class Writer : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.values[50000] += 1;
+			}
+		};
+		manager.addTimedObject(20, std::make_shared<Writer>());
+		std::size_t dirty = 0;
+		manager.setTickTrigger([&](const Input &, const Output &) {
+			dirty = manager.dirtyPages()->dirtyPages();
+		});
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		manager.pause();
+		std::unique_ptr<Output> published = std::make_unique<Output>();
+		snapshot->read(*published);
+		auto out = manager.output();
+		std::cout << "Written " << (out->values[50000] > 5) << ", kept " << out->values[99999] << ", published "
+				<< (published->values[50000] == out->values[50000]) << ", dirty pages " << dirty << " (expected 1 7 1 1)" << std::endl;
+	}
+	
+	std::cout << "Grouping test" << std::endl;
+	{
+		struct Input {
+			int value;
+		};
+		struct Output {
+			int value;
+		};
+		
+		StateMachineManager<Input, Output> manager(Input{ 0 }, Output{ 0 }, 20);
+		std::vector<char> order;
+		class First : public TimedObject<Input, Output> {
+			std::vector<char> &order_;
+		public:
+			First(std::vector<char> &order) : order_(order)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				order_.push_back('a');
+			}
+		};
+		class Second : public TimedObject<Input, Output> {
+			std::vector<char> &order_;
+		public:
+			Second(std::vector<char> &order) : order_(order)
+			{
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				order_.push_back('b');
+			}
+		};
+		std::shared_ptr<Second> late = std::make_shared<Second>(order);
+		std::shared_ptr<First> dependent = std::make_shared<First>(order);
+		manager.addTimedObject(20, std::make_shared<First>(order));
+		manager.addTimedObject(20, late);
+		manager.addTimedObject(20, std::make_shared<First>(order));
+		manager.addTimedObject(20, std::make_shared<Second>(order));
+		manager.addTimedObject(20, dependent);
+		manager.addDependency(late, dependent);
+		manager.groupByType();
+		bool refused = false;
+		try {
+			manager.addDependency(dependent, late);
+		} catch(std::invalid_argument &) {
+			refused = true;
+		}
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(30));
+		manager.pause();
+		std::cout << "Order " << std::string(order.begin(), order.begin() + 5) << ", cycle refused " << refused << " (expected aabba 1)" << std::endl;
+
+		// Pausing while other orders are measured must leave the grouping as it was
+		manager.unpause();
+		auto optimizing = std::async(std::launch::async, [&manager]() {
+			manager.optimizeOrder(10, 1);
+		});
+		std::this_thread::sleep_for (std::chrono::milliseconds(330));
+		manager.pause();
+		bool interrupted = false;
+		try {
+			optimizing.get();
+		} catch(std::logic_error &) {
+			interrupted = true;
+		}
+		order.clear();
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(30));
+		manager.pause();
+		std::cout << "Optimisation interrupted " << interrupted << ", order kept " << std::string(order.begin(), order.begin() + 5)
+				<< " (expected 1 aabba)" << std::endl;
+	}
+	
+	std::cout << "Static schedule test" << std::endl;
+	{
+		struct Input {
+			int value;
+		};
+		struct Output {
+			int value;
+		};
+		
+		class Counter : public StateMachine<Input, Output, int> {
+		public:
+			Counter()
+			{
+				state(0);
+			}
+			virtual void tick(const Input &in, Output &out)
+			{
+				count_++;
+			}
+			int count_ = 0;
+		};
+		class Fast : public Counter {
+		};
+		class Medium : public Counter {
+		};
+		class Slow : public Counter {
+		};
+		
+		typedef StaticStateMachineManager<Input, Output, 10, Scheduled<10, Fast, 100>, Scheduled<20, Medium, 200>,
+				Scheduled<30, Slow, 300>> Manager;
+		static_assert(Manager::hyperperiod == 60 && Manager::slots == 6 && Manager::longestSlot == 600, "Wrong schedule");
+		Manager manager(Input{ 0 }, Output{ 0 });
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		manager.pause();
+		int fast = manager.object<0>().count_;
+		int medium = manager.object<1>().count_;
+		int slow = manager.object<2>().count_;
+		std::cout << "Ticks " << fast << ", every second " << (medium == (fast + 1) / 2) << ", every third " << (slow == (fast + 2) / 3)
+				<< " (expected about 20 1 1)" << std::endl;
+	}
+
+	std::cout << "Timer bank test" << std::endl;
+	{
+		struct Input {
+		};
+		struct Output {
+		};
+		
+		TimerBank<Input, Output> bank;
+		auto onDelay = bank.addOnDelay(300);
+		auto offDelay = bank.addOffDelay(200);
+		auto pulse = bank.addPulse(250);
+		const std::string inputs = "011110001100";
+		std::string outputs;
+		for(char input : inputs) {
+			bank.set(onDelay, input == '1');
+			bank.set(offDelay, input == '1');
+			bank.set(pulse, input == '1');
+			bank.update(100);
+			outputs += std::to_string(bank.output(onDelay)) + std::to_string(bank.output(offDelay)) + std::to_string(bank.output(pulse)) + " ";
+		}
+		std::cout << "Outputs " << outputs << "(expected 000 011 011 011 110 010 010 000 011 011 011 010)" << std::endl;
+	}
+
+	std::cout << "Digital image test" << std::endl;
+	{
+		struct Input {
+			DigitalImage<100> switches;
+			DigitalImage<10> pulses;
+		};
+		struct Output {
+			int rises;
+			int falls;
+			int steadyRises;
+			int slowRuns;
+			int slowBoth;
+		};
+		
+		class EdgeCounter : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.rises += in.switches.rose(70);
+				out.falls += in.switches.fell(70);
+				out.steadyRises += in.switches.rose(3);
+			}
+		};
+		// Runs every third tick and must see the edges of the ticks in between
+		class SlowEdgeCounter : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &in, Output &out)
+			{
+				out.slowRuns++;
+				out.slowBoth += in.pulses.rose(5) && in.pulses.fell(5);
+			}
+		};
+		
+		Input initial = {};
+		initial.switches.set(3, true);
+		StateMachineManager<Input, Output> manager(initial, Output{ 0, 0, 0, 0, 0 }, 10);
+		manager.addTimedObject(10, std::make_shared<EdgeCounter>());
+		manager.addTimedObject(30, std::make_shared<SlowEdgeCounter>());
+		manager.addInputStage(detectEdges(&Input::switches));
+		manager.addInputStage(detectEdges(&Input::pulses, 3));
+		manager.setInputTrigger([](Input &in) {
+			in.switches.set(70, !in.switches.get(70));
+			in.pulses.set(5, !in.pulses.get(5));
+		});
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		manager.pause();
+		auto out = manager.output();
+		std::cout << "Rises " << out->rises << ", falls " << out->falls << ", alternating " << (out->rises - out->falls <= 1 && out->rises >= out->falls)
+				<< ", steady channel rose " << out->steadyRises << " (expected about 10 10 1 1)" << std::endl;
+		std::cout << "Slow object saw both edges " << (out->slowRuns > 1 && out->slowBoth == out->slowRuns - 1) << " (expected 1)" << std::endl;
+	}
+
+	std::cout << "Analog conditioning test" << std::endl;
+	{
+		struct Input {
+			short raw[3];
+			float values[3];
+		};
+		struct Output {
+			float values[3];
+		};
+		
+		class Copier : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &in, Output &out)
+			{
+				for (int i = 0; i < 3; i++)
+					out.values[i] = in.values[i];
+			}
+		};
+		
+		auto conditioning = std::make_shared<AnalogConditioning<3>>();
+		conditioning->setScaling(0, 0.1f, -5);
+		conditioning->setScaling(1, 0.5f, 0);
+		conditioning->setCalibration(1, 0, 100, { 0, 20, 60 });
+		conditioning->setLowPass(2, 1, 10);
+		conditioning->setDeadband(2, 0.5f);
+		StateMachineManager<Input, Output> manager(Input{ { 250, 150, 300 }, {} }, Output{}, 10);
+		manager.addTimedObject(10, std::make_shared<Copier>());
+		manager.addInputStage(conditionAnalog(conditioning, &Input::raw, &Input::values));
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		manager.pause();
+		auto out = manager.output();
+		std::cout << "Scaled " << out->values[0] << ", calibrated " << out->values[1] << ", filtered " << std::round(out->values[2])
+				<< " (expected 20 40 300)" << std::endl;
+	}
+
+	std::cout << "Output limiting test" << std::endl;
+	{
+		struct Input {
+		};
+		struct Output {
+			int ticks;
+			float targets[5];
+			float values[5];
+		};
+		
+		class Writer : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &, Output &out)
+			{
+				out.targets[0] = 1000;
+				out.targets[1] = out.ticks ? 50 : 0;
+				out.targets[2] = 10 + (out.ticks % 2) * 0.3f;
+				if(out.ticks == 1) {
+					out.targets[3] = 50; // Written only once
+					out.targets[4] = 5;
+				}
+				out.ticks++;
+			}
+		};
+		
+		auto limiting = std::make_shared<OutputLimiting<5>>();
+		limiting->setLimits(0, 0, 100);
+		limiting->setRate(1, 100);
+		limiting->setDeadband(2, 0.5f);
+		limiting->setRate(3, 100);
+		limiting->setDeadband(4, 1);
+		limiting->setRate(4, 100);
+		StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+		manager.addTimedObject(10, std::make_shared<Writer>());
+		manager.addOutputStage(limitOutput(limiting, &Output::targets, &Output::values, 10));
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		manager.pause();
+		auto out = manager.output();
+		std::cout << "Clamped " << out->values[0] << ", ramping " << (std::round(out->values[1]) == out->ticks - 1) << ", kept "
+				<< out->values[2] << ", target written once " << (std::round(out->values[3]) == out->ticks - 1)
+				<< ", reached with deadband " << out->values[4] << " (expected 100 1 10 1 5)" << std::endl;
+	}
+
+	std::cout << "Profile engine test" << std::endl;
+	{
+		struct Input {
+		};
+		struct Output {
+		};
+		
+		ProfileEngine<Input, Output> engine;
+		auto profile = engine.addProfile(20, { ProfileSegment::ramp(100, 400), ProfileSegment::soak(200), ProfileSegment::hold(),
+				ProfileSegment::ramp(20, 200) });
+		auto run = engine.addRun(profile);
+		auto idle = engine.addRun(profile);
+		engine.start(run);
+		std::string setpoints;
+		for (int i = 0; i < 12; i++) {
+			if (i == 9)
+				engine.resume(run);
+			engine.update(100);
+			setpoints += std::to_string(int(engine.setpoint(run))) + " ";
+		}
+		std::cout << "Setpoints " << setpoints << "finished " << !engine.running(run) << ", idle " << engine.setpoint(idle)
+				<< " (expected 40 60 80 100 100 100 100 100 100 60 20 20 1 20)" << std::endl;
+	}
+
+	std::cout << "Alarm engine test" << std::endl;
+	{
+		struct Input {
+			float values[2];
+		};
+		struct Output {
+		};
+		
+		AlarmEngine<Input, Output> engine([](const Input &in) {
+			return in.values;
+		});
+		auto high = engine.addAlarm(0, 100, true, 5, 200);
+		auto low = engine.addAlarm(1, 10, false, 2);
+		auto prompt = engine.addAlarm(0, 100, true, 0, 100); // Raised one update after the value goes above the limit
+		const float highValues[] = { 90, 101, 103, 104, 94, 120 };
+		const float lowValues[] = { 20, 9, 11, 13, 5, 5 };
+		std::string events;
+		for (int i = 0; i < 6; i++) {
+			if (i == 5)
+				engine.acknowledge(low);
+			const float values[] = { highValues[i], lowValues[i] };
+			engine.update(values, 100);
+			AlarmEvent event;
+			while (engine.nextEvent(event))
+				events += std::to_string(i) + ":" + std::to_string(event.alarm) + "RCA"[event.kind] + " ";
+		}
+		std::cout << "Events " << events << "high " << engine.active(high) << engine.acknowledged(high) << ", low "
+				<< engine.active(low) << engine.acknowledged(low) << ", prompt " << engine.active(prompt)
+				<< " (expected 1:1R 2:2R 3:0R 3:1C 4:0C 4:1R 4:2C 5:1A high 00, low 11, prompt 0)" << std::endl;
+	}
+
+	std::cout << "Derived values test" << std::endl;
+	{
+		struct Input {
+			float temperatures[4];
+		};
+		struct Output {
+			int computed;
+			int ticks;
+			float hottest;
+		};
+		
+		typedef DerivedValues<Input> Derived;
+		class Reader : public TimedObject<Input, Output> {
+			Derived::Value<float> average_;
+			Derived::Value<bool> overheated_;
+		public:
+			Reader(const Derived &derived) :
+				average_(derived.find<float>("average")),
+				overheated_(derived.find<bool>("overheated"))
+			{
+			}
+			virtual void tick(const Input &, Output &out)
+			{
+				if (overheated_.get())
+					out.hottest = average_.get();
+			}
+		};
+		class TickCounter : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &, Output &out)
+			{
+				out.ticks++;
+			}
+		};
+		
+		auto derived = std::make_shared<Derived>();
+		int computed = 0;
+		auto average = derived->add<float>("average", [&computed](const Input &in) {
+			computed++;
+			return (in.temperatures[0] + in.temperatures[1] + in.temperatures[2] + in.temperatures[3]) / 4;
+		});
+		derived->add<bool>("overheated", [average](const Input &) {
+			return average.get() > 50;
+		});
+		bool wrongType = false;
+		try {
+			derived->find<int>("average");
+		} catch (std::invalid_argument &) {
+			wrongType = true;
+		}
+		StateMachineManager<Input, Output> manager(Input{ { 40, 50, 60, 70 } }, Output{ 0, 0, 0 }, 10);
+		for (int i = 0; i < 3; i++)
+			manager.addTimedObject(10, std::make_shared<Reader>(*derived));
+		manager.addTimedObject(10, std::make_shared<TickCounter>());
+		manager.addInputStage(refreshDerived(derived));
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		manager.pause();
+		auto out = manager.output();
+		std::cout << "Average " << out->hottest << ", computed once per tick " << (computed == out->ticks) << ", wrong type refused "
+				<< wrongType << " (expected 55 1 1)" << std::endl;
+	}
+
+	std::cout << "Channel array test" << std::endl;
+	{
+		struct Input {
+		};
+		struct Output {
+			int ticks;
+			ChannelArray<int, 1000> values;
+		};
+		
+		class Writer : public TimedObject<Input, Output> {
+		public:
+			virtual void tick(const Input &, Output &out)
+			{
+				out.ticks++;
+				out.values.set(out.ticks, out.ticks);
+				out.values.set(999, 7);
+			}
+		};
+		
+		StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+		manager.addTimedObject(10, std::make_shared<Writer>());
+		manager.addChannelArray(&Output::values);
+		auto snapshot = manager.outputSnapshot();
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		manager.pause();
+		auto out = manager.output();
+		Output published;
+		snapshot->read(published);
+		int changed = 0;
+		out->values.forEachChangedRun([&](std::size_t, std::size_t count) {
+			changed += int(count);
+		});
+		std::cout << "Values kept " << (out->values[1] == 1 && out->values[out->ticks] == out->ticks && out->values[999] == 7)
+				<< ", changed in the last tick " << changed << " " << out->values.changed(out->ticks) << ", published "
+				<< (published.ticks == out->ticks && published.values[out->ticks] == out->ticks) << " (expected 1 1 1 1)" << std::endl;
+	}
+
+	std::cout << "Frame clock test" << std::endl;
+	{
+		struct Input {
+		};
+		struct Output {
+		};
+
+		class Stepper : public StateMachine<Input, Output, int> {
+		public:
+			Stepper()
+			{
+				state(0);
+			}
+			virtual void tick(const Input &, Output &)
+			{
+				ticks_++;
+				if(ticks_ == 1)
+					firstTick_ = afterStateChange() && timeInState() == 0;
+				else {
+					summed_ += lastPeriod();
+					if(afterStateChange())
+						changes_++;
+					if(timeInState() != summed_)
+						wrongTimes_++;
+				}
+				if(ticks_ % 3 == 0) {
+					state(state() + 1);
+					summed_ = 0;
+				}
+			}
+			int ticks_ = 0;
+			bool firstTick_ = false;
+			int changes_ = 0;
+			int wrongTimes_ = 0;
+			long long summed_ = 0;
+		};
+
+		StateMachineManager<Input, Output> manager(Input{}, Output{}, 10);
+		std::shared_ptr<Stepper> early = std::make_shared<Stepper>();
+		std::shared_ptr<Stepper> late = std::make_shared<Stepper>();
+		manager.addTimedObject(20, early);
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		manager.addTimedObject(30, late); // A new period, its clock is created while running
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		manager.pause();
+		std::cout << "First ticks " << early->firstTick_ << late->firstTick_ << ", changes noticed "
+				<< (early->changes_ == (early->ticks_ - 1) / 3 && late->changes_ == (late->ticks_ - 1) / 3)
+				<< ", wrong times " << early->wrongTimes_ + late->wrongTimes_ << " (expected 11 1 0)" << std::endl;
+	}
+
+	std::cout << "Bytecode test" << std::endl;
+	{
+		struct Input {
+			std::int32_t count;
+			float ratio;
+			std::uint16_t raw;
+			bool enabled;
+		};
+		struct Output {
+			double results[15];
+			std::int16_t negative;
+			bool flag;
+			float timed;
+			float inState;
+		};
+		typedef BytecodeOpcode Op;
+
+		auto program = std::make_shared<BytecodeProgram<Input, Output>>();
+		program->emit(Op::LOAD_INPUT, 0, 0, 0, program->bindInput(&Input::count));
+		program->emit(Op::LOAD_INPUT, 1, 0, 0, program->bindInput(&Input::ratio));
+		program->emit(Op::LOAD_INPUT, 2, 0, 0, program->bindInput(&Input::raw));
+		program->emit(Op::LOAD_INPUT, 3, 0, 0, program->bindInput(&Input::enabled));
+		program->emit(Op::LOAD_CONSTANT, 4, 0, 0, program->constant(3));
+		const Op computed[] = { Op::ADD, Op::SUBTRACT, Op::MULTIPLY, Op::DIVIDE, Op::MINIMUM, Op::MAXIMUM, Op::LESS,
+				Op::LESS_EQUAL, Op::EQUAL, Op::NOT_EQUAL, Op::AND, Op::OR };
+		for (int i = 0; i < 12; i++) {
+			program->emit(computed[i], 5, 0, i < 6 ? 1 : 4);
+			program->emit(Op::STORE_OUTPUT, 0, 5, 0, program->bindOutput(&Output::results, i));
+		}
+		program->emit(Op::NOT, 5, 3);
+		program->emit(Op::STORE_OUTPUT, 0, 5, 0, program->bindOutput(&Output::results, 12));
+		// All jumps are taken and skip storing 99
+		const Op jumps[] = { Op::JUMP_IF_ZERO, Op::JUMP_IF_NOT_ZERO };
+		program->emit(Op::LOAD_CONSTANT, 6, 0, 0, program->constant(99));
+		for (int i = 0; i < 2; i++) {
+			int jump = program->emit(jumps[i], 0, i == 0 ? 3 : 5);
+			program->emit(Op::STORE_OUTPUT, 0, 6, 0, program->bindOutput(&Output::results, 13 + i));
+			program->setOperand(jump, program->position());
+		}
+		int jump = program->emit(Op::JUMP);
+		program->emit(Op::STORE_OUTPUT, 0, 6, 0, program->bindOutput(&Output::negative));
+		program->setOperand(jump, program->position());
+		program->emit(Op::MULTIPLY, 5, 2, 4);
+		program->emit(Op::SUBTRACT, 5, 4, 5);
+		program->emit(Op::STORE_OUTPUT, 0, 5, 0, program->bindOutput(&Output::negative));
+		program->emit(Op::STORE_OUTPUT, 0, 3, 0, program->bindOutput(&Output::flag));
+		// A timer started when entering state 1 measures the same time as the state
+		program->emit(Op::GET_STATE, 7);
+		int started = program->emit(Op::JUMP_IF_NOT_ZERO, 0, 7);
+		program->emit(Op::START_TIMER, 0, 0, 0, 0);
+		program->emit(Op::LOAD_CONSTANT, 7, 0, 0, program->constant(1));
+		program->emit(Op::SET_STATE, 0, 7);
+		program->setOperand(started, program->position());
+		program->emit(Op::TIMER_TIME, 8, 0, 0, 0);
+		program->emit(Op::STORE_OUTPUT, 0, 8, 0, program->bindOutput(&Output::timed));
+		program->emit(Op::TIME_IN_STATE, 8);
+		program->emit(Op::STORE_OUTPUT, 0, 8, 0, program->bindOutput(&Output::inState));
+
+		auto object = std::make_shared<BytecodeObject<Input, Output>>();
+		object->load(program);
+		StateMachineManager<Input, Output> manager(Input{ 7, 2.5f, 2, false }, Output{}, 10);
+		manager.addTimedObject(10, object);
+		manager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		manager.pause();
+		auto out = manager.output();
+		std::cout << "Results";
+		for (double result : out->results)
+			std::cout << " " << result;
+		std::cout << ", stored " << out->negative << " " << out->flag << ", timer " << (out->timed > 0 && out->timed == out->inState)
+				<< std::endl;
+		std::cout << "(expected 9.5 4.5 17.5 2.8 2.5 7 0 0 0 1 1 1 1 0 0, stored -3 0, timer 1)" << std::endl;
+
+		auto looping = std::make_shared<BytecodeProgram<Input, Output>>();
+		looping->emit(Op::JUMP, 0, 0, 0, 0);
+		bool refused = false;
+		try {
+			object->load(looping);
+		} catch(std::invalid_argument &) {
+			refused = true;
+		}
+#ifdef STATE_MACHINE_THREADED_DISPATCH
+		std::cout << "Threaded dispatch";
+#else
+		std::cout << "Switch dispatch";
+#endif
+		std::cout << ", backward jump refused " << refused << " (expected 1)" << std::endl;
+
+		// A timer index changed after emitting the instruction isn't counted in the program's timers
+		auto timing = std::make_shared<BytecodeProgram<Input, Output>>();
+		int start = timing->emit(Op::START_TIMER, 0, 0, 0, 0);
+		timing->setOperand(start, 5);
+		bool timerRefused = false;
+		try {
+			object->load(timing);
+		} catch(std::invalid_argument &) {
+			timerRefused = true;
+		}
+		auto saturating = std::make_shared<BytecodeProgram<Input, Output>>();
+		saturating->emit(Op::LOAD_CONSTANT, 0, 0, 0, saturating->constant(1e9));
+		saturating->emit(Op::STORE_OUTPUT, 0, 0, 0, saturating->bindOutput(&Output::negative));
+		auto saturated = std::make_shared<BytecodeObject<Input, Output>>();
+		saturated->load(saturating);
+		StateMachineManager<Input, Output> saturatingManager(Input{}, Output{}, 10);
+		saturatingManager.addTimedObject(10, saturated);
+		saturatingManager.unpause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(50));
+		saturatingManager.pause();
+		std::cout << "Unknown timer refused " << timerRefused << ", stored " << saturatingManager.output()->negative << " (expected 1 32767)" << std::endl;
+	}
+
+	std::cout << "Replication test" << std::endl;
+	{
+		struct Input {
+			int value;
+		};
+		struct Output {
+			int count;
+		};
+
+		class Counter : public StateMachine<Input, Output, int> {
+		public:
+			Counter()
+			{
+				state(0);
+			}
+			virtual void tick(const Input &, Output &out)
+			{
+				out.count = ++count_;
+				if(count_ == 5)
+					state(1);
+			}
+			virtual void saveState(std::vector<unsigned char> &to) const
+			{
+				const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&count_);
+				to.insert(to.end(), bytes, bytes + sizeof(count_));
+			}
+			virtual void loadState(const unsigned char *from, std::size_t size)
+			{
+				if(size == sizeof(count_))
+					std::memcpy(&count_, from, size);
+			}
+			int currentState()
+			{
+				return state();
+			}
+			long long stateTime()
+			{
+				return timeInState();
+			}
+			int count_ = 0;
+		};
+
+		StateMachineManager<Input, Output> primary(Input{ 0 }, Output{ 0 }, 10);
+		StateMachineManager<Input, Output> follower(Input{ 0 }, Output{ 0 }, 10);
+		auto original = std::make_shared<Counter>();
+		auto copy = std::make_shared<Counter>();
+		primary.addTimedObject(20, original);
+		follower.addTimedObject(20, copy);
+		// In a directory of its own, so that parallel runs don't take each other's socket
+		char directoryName[] = "/tmp/state_machine_replication_XXXXXX";
+		if(!mkdtemp(directoryName))
+			std::cout << "Cannot create a directory for the socket" << std::endl;
+		const std::string socketPath = std::string(directoryName) + "/replication.sock";
+		ReplicationPrimary<Input, Output> replicationPrimary(primary, socketPath);
+		primary.unpause();
+		ReplicationFollower<Input, Output> replicationFollower(follower, socketPath);
+		std::this_thread::sleep_for (std::chrono::milliseconds(300));
+		primary.pause();
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		replicationFollower.stop();
+		std::cout << "Messages " << (replicationFollower.messages() > 0) << ", count " << (copy->count_ == original->count_)
+				<< ", state " << copy->currentState() << ", frame time " << (copy->frameTime() == original->frameTime())
+				<< ", time in state " << (copy->stateTime() == original->stateTime()) << ", output "
+				<< (follower.output()->count == original->count_) << " (expected 1 1 1 1 1 1)" << std::endl;
+		unlink(socketPath.c_str());
+		rmdir(directoryName);
+	}
+
+	std::cout << "Plugin test" << std::endl;
+	{
+		// Builds the sample plugin with the compiler from variable CXX, as is and with a different TimedObject
+		std::string source = __FILE__;
+		std::string directory = source.substr(0, source.find_last_of('/') + 1);
+		const char *compiler = std::getenv("CXX");
+		std::string command = std::string(compiler ? compiler : "c++") + " -std=c++14 -shared -fPIC -I" + (directory.empty() ? "." : directory)
+				+ " " + directory + "plugin_example.cpp -o ";
+		// In a directory of its own, so that neither a library from an earlier run nor parallel runs can interfere
+		char directoryName[] = "/tmp/state_machine_plugin_XXXXXX";
+		bool built = mkdtemp(directoryName) != nullptr;
+		const std::string plugins = directoryName;
+		built = built && std::system((command + plugins + "/plugin.so").c_str()) == 0
+				&& std::system((command + plugins + "/minimal.so -DSTATE_MACHINE_MINIMAL").c_str()) == 0;
+		
+		if(!built) {
+			std::cout << "Cannot build the sample plugin, the compiler can be set by variable CXX (expected it to build)" << std::endl;
+		} else {
+			StateMachineManager<PluginInput, PluginOutput> manager(PluginInput{ 7 }, PluginOutput{ 0 }, 10);
+			std::string name;
+			try {
+				auto plugin = TimedObjectPlugin<PluginInput, PluginOutput>::load(plugins + "/plugin.so", 1);
+				name = plugin->name();
+				manager.addTimedObject(10, plugin->create("3"));
+			} catch(std::exception &e) {
+				std::cout << e.what() << std::endl;
+			}
+			bool mismatchRefused = false;
+			try {
+				TimedObjectPlugin<PluginInput, PluginOutput>::load(plugins + "/minimal.so", 1);
+			} catch(std::runtime_error &) {
+				mismatchRefused = true;
+			}
+			bool layoutRefused = false;
+			try {
+				TimedObjectPlugin<PluginInput, PluginOutput>::load(plugins + "/plugin.so", 2);
+			} catch(std::runtime_error &) {
+				layoutRefused = true;
+			}
+			manager.unpause();
+			std::this_thread::sleep_for (std::chrono::milliseconds(100));
+			manager.pause();
+			std::cout << "Name " << name << ", scaled " << manager.output()->scaled << ", refused " << mismatchRefused << " "
+					<< layoutRefused << " (expected Scaler 21 1 1)" << std::endl;
+		}
+		unlink((plugins + "/plugin.so").c_str());
+		unlink((plugins + "/minimal.so").c_str());
+		rmdir(directoryName);
+	}
 	return 0;
 }
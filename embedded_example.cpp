@@ -0,0 +1,111 @@
+// The heater example for small targets, it can be built with -fno-exceptions -fno-rtti and allocates no memory
+#define STATE_MACHINE_MINIMAL
+#include <cstdio>
+#include <unistd.h>
+#include "fixed_manager.hpp"
+
+// Declare input and output structures
+struct Input {
+	float temperature;
+};
+struct Output {
+	float power;
+};
+
+// Declare a PID controller class
+class TemperatureController : public TimedObject<Input, Output> {
+	const float proportional_ = 0.3f;
+	const float integral_ = 0.02f;
+	const float differential_ = -0.2f;
+	float integralTotal = 0;
+	float previous_ = 0;
+public:
+	virtual void tick(const Input &in, Output &out)
+	{
+		float difference = desired_ - in.temperature;
+		float needed = difference * proportional_ + integral_ * integralTotal + differential_ * (difference - previous_);
+
+		if (needed < 0.0f)
+			out.power = 0.0f;
+		else if (needed > 100.0f)
+			out.power = 100.0f;
+		else {
+			out.power = needed;
+			integralTotal += difference;
+		}
+		previous_ = difference;
+	}
+	float desired_ = 0;
+};
+
+// Declare states for a class that would control the heating process
+enum TemperatureProgrammerState {
+	STARTING = 0,
+	HEATING,
+	HOT
+};
+
+// Declare the class for controlling the process, it refers to the controller without a smart pointer
+class TemperatureProgrammer : public StateMachine<Input, Output, TemperatureProgrammerState> {
+	float ramp_ = 0.005f;
+	float max_ = 100.0f;
+	TemperatureController &controller_;
+
+public:
+	TemperatureProgrammer(TemperatureController &controller) : controller_(controller)
+	{
+		state(STARTING);
+	}
+
+	virtual void tick(const Input &in, Output &out)
+	{
+		switch(state()) {
+			case STARTING:
+				state(HEATING);
+				break;
+			case HEATING: {
+				float wanted = timeInState() * ramp_;
+				if (wanted > max_) {
+					wanted = max_;
+					state(HOT);
+				}
+				controller_.desired_ = wanted;
+				break;
+			}
+			case HOT:
+				break;
+		}
+	}
+};
+
+// The controller is a static object, the programmer is constructed in the manager's storage
+static TemperatureController controller;
+
+// Capacity for 4 objects and 256 bytes of storage for objects constructed inside the manager
+static FixedStateMachineManager<Input, Output, 4, 256> manager(Input{ 20 }, Output{ 0 }, 100);
+
+int main()
+{
+	if (!manager.addTimedObject(200, controller) || !manager.emplaceTimedObject<TemperatureProgrammer>(500, controller)) {
+		std::printf("Cannot add the objects\n");
+		return 1;
+	}
+
+	// Start the manager, this has to be done from the thread that created it
+	if (!manager.unpause())
+		return 1;
+
+	// Periodic reading of output and setting of input for the next turn
+	for (int i = 0; i < 40; i++) {
+		usleep(100000);
+		auto out = manager.output(); // These two operations are thread-safe because of locks
+		auto in = manager.input();
+		in->temperature = 20 + (in->temperature - 20) * 0.95f + out->power;
+		std::printf("Power: %f temperature %f desired %f\n", out->power, in->temperature, controller.desired_);
+		// Destroying the returned objects unlocks the structures
+	}
+
+	manager.pause();
+	std::printf("Manager size %u bytes\n", unsigned(sizeof(manager)));
+	return 0;
+}
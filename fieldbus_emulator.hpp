@@ -0,0 +1,175 @@
+/*
+* \brief A local emulator of a fieldbus with many I/O points, for benchmarking the I/O path without hardware
+*
+* The emulated device runs in its own thread, updating its input points periodically. The master side reads the input
+* points and writes the output points in transactions that take a configurable time with a configurable jitter. With
+* loopback enabled, the device copies its output points into its input points when updating, so that the whole
+* acquisition-compute-publish pipeline can be checked.
+*
+* The master side's process images are plain buffers of 32-bit points, so they can be bound to the manager's input and
+* output structures through an IoMapping.
+*/
+
+#ifndef FIELDBUS_EMULATOR_H
+#define FIELDBUS_EMULATOR_H
+
+#include "io_mapping.hpp"
+#include <random>
+
+class FieldbusEmulator {
+public:
+	struct Configuration {
+		std::size_t inputPoints = 1000;
+		std::size_t outputPoints = 1000;
+		std::chrono::microseconds latency = std::chrono::microseconds(100);
+		std::chrono::microseconds jitter = std::chrono::microseconds(0);
+		std::chrono::milliseconds updatePeriod = std::chrono::milliseconds(1);
+		bool loopback = false;
+	};
+
+private:
+	Configuration configuration_;
+	std::vector<std::int32_t> deviceInputs_;
+	std::vector<std::int32_t> deviceOutputs_;
+	std::vector<std::int32_t> masterInputs_;
+	std::vector<std::int32_t> masterOutputs_;
+	std::mutex deviceMutex_;
+	std::mt19937 random_;
+	std::atomic<long long> deviceCycles_;
+	std::atomic<long long> transactions_;
+	std::unique_ptr<LoopingThread> device_;
+
+	void update()
+	{
+		std::lock_guard<std::mutex> lock(deviceMutex_);
+		long long cycle = deviceCycles_.load(std::memory_order_relaxed);
+		if(configuration_.loopback && !deviceOutputs_.empty()) {
+			for(std::size_t i = 0; i < deviceInputs_.size(); i++)
+				deviceInputs_[i] = deviceOutputs_[i % deviceOutputs_.size()];
+		} else {
+			for(std::size_t i = 0; i < deviceInputs_.size(); i++)
+				deviceInputs_[i] = std::int32_t(cycle + i);
+		}
+		deviceCycles_.store(cycle + 1, std::memory_order_release);
+	}
+
+	void transaction()
+	{
+		long long jitter = configuration_.jitter.count();
+		long long duration = configuration_.latency.count();
+		if(jitter)
+			duration += std::uniform_int_distribution<long long>(-jitter, jitter)(random_);
+		// Sleeping is too coarse for latencies of tens of microseconds
+		auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(duration);
+		while(std::chrono::steady_clock::now() < end);
+		transactions_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+public:
+	/*!
+	* \brief The constructor, starts the emulated device
+	*
+	* \param The configuration, the numbers of points, duration of transactions and the device's update period
+	*/
+	FieldbusEmulator(Configuration configuration) :
+		configuration_(configuration),
+		deviceInputs_(configuration.inputPoints),
+		deviceOutputs_(configuration.outputPoints),
+		masterInputs_(configuration.inputPoints),
+		masterOutputs_(configuration.outputPoints),
+		deviceCycles_(0),
+		transactions_(0)
+	{
+		device_ = std::make_unique<LoopingThread>(configuration_.updatePeriod, [this]() {
+			update();
+		});
+	}
+
+	/*!
+	* \brief Reads all the input points of the device into the master's input image, takes the configured latency
+	*
+	* \note Meant to be called from one thread only, usually from the manager's input trigger
+	*/
+	void read()
+	{
+		transaction();
+		std::lock_guard<std::mutex> lock(deviceMutex_);
+		std::copy(deviceInputs_.begin(), deviceInputs_.end(), masterInputs_.begin());
+	}
+
+	/*!
+	* \brief Writes all the master's output image into the output points of the device, takes the configured latency
+	*
+	* \note Meant to be called from one thread only, usually from the manager's output trigger
+	*/
+	void write()
+	{
+		transaction();
+		std::lock_guard<std::mutex> lock(deviceMutex_);
+		std::copy(masterOutputs_.begin(), masterOutputs_.end(), deviceOutputs_.begin());
+	}
+
+	/*!
+	* \brief Returns the master's input image, filled by read()
+	*
+	* \return Pointer to the first point
+	*/
+	const std::int32_t *inputs() const
+	{
+		return masterInputs_.data();
+	}
+
+	/*!
+	* \brief Returns the master's output image, sent by write()
+	*
+	* \return Pointer to the first point
+	*/
+	std::int32_t *outputs()
+	{
+		return masterOutputs_.data();
+	}
+
+	/*!
+	* \brief Returns the number of times the device updated its inputs
+	*
+	* \return The number of updates
+	*/
+	long long deviceCycles() const
+	{
+		return deviceCycles_.load(std::memory_order_acquire);
+	}
+
+	/*!
+	* \brief Returns the number of reads and writes done
+	*
+	* \return The number of transactions
+	*/
+	long long transactions() const
+	{
+		return transactions_.load(std::memory_order_relaxed);
+	}
+
+	/*!
+	* \brief Connects the emulator to a manager, reading before every tick and writing after every tick
+	*
+	* \param The manager
+	* \param The mapping of the master's images onto the input and output structures, use inputs() and outputs() as buffers
+	*
+	* \note The execution must be paused to call this safely, the emulator and the mapping must outlive the manager's
+	* execution, other triggers set to the manager are replaced
+	*/
+	template<typename Input, typename Output>
+	void attach(StateMachineManager<Input, Output> &manager, const IoMapping<Input, Output> &mapping)
+	{
+		manager.setInputTrigger([this, &mapping](Input &in) {
+			read();
+			mapping.scatter(in);
+		});
+		manager.setOutputTrigger([this, &mapping](const Output &out) {
+			mapping.gather(out);
+			write();
+		});
+	}
+};
+
+#endif // FIELDBUS_EMULATOR_H
@@ -0,0 +1,330 @@
+/*
+* \brief A manager of timed objects for small targets, with fixed capacity and no dynamic memory
+*
+* It runs the objects with the same semantics as StateMachineManager: each tick takes a copy of the input, runs the due
+* objects in the order they were added in with the same frame time and publishes the output afterwards. It uses no
+* containers, smart pointers, std::function or streams, throws no exceptions and needs no RTTI, so it can be built with
+* -fno-exceptions -fno-rtti. Objects are either owned by the caller (typically static) or constructed inside the
+* manager's own storage, whose size is a template argument. The thread is a POSIX thread sleeping until absolute times.
+*
+* Define STATE_MACHINE_MINIMAL before including it to leave out the replication hooks of the objects.
+*/
+
+#ifndef STATE_MACHINE_FIXED_MANAGER_H
+#define STATE_MACHINE_FIXED_MANAGER_H
+
+#include "timed_object.hpp"
+#include <new>
+#include <atomic>
+#include <utility>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+template<typename Input, typename Output, std::size_t Capacity, std::size_t Storage = 0>
+class FixedStateMachineManager {
+	TimedObject<Input, Output> *objects_[Capacity];
+	int divisors_[Capacity];
+	typename TimedObject<Input, Output>::FrameClock clocks_[Capacity]; // One for each divisor of periods
+	int clockDivisors_[Capacity];
+	std::size_t clockCount_ = 0;
+	bool owned_[Capacity];
+	std::size_t count_ = 0;
+	alignas(std::max_align_t) unsigned char storage_[Storage ? Storage : 1];
+	std::size_t storageUsed_ = 0;
+	Input input_;
+	Output output_;
+	Input workingInput_;
+	Output workingOutput_;
+	int tickOrder_ = 0;
+	int period_;
+	int paused_ = 1;
+	std::atomic<bool> running_;
+	pthread_t thread_;
+	pthread_mutex_t inputMutex_;
+	pthread_mutex_t outputMutex_;
+	void (*inputTrigger_)(Input &, void *) = nullptr;
+	void *inputTriggerContext_ = nullptr;
+	void (*outputTrigger_)(const Output &, void *) = nullptr;
+	void *outputTriggerContext_ = nullptr;
+
+	FixedStateMachineManager(const FixedStateMachineManager &) = delete;
+	FixedStateMachineManager &operator=(const FixedStateMachineManager &) = delete;
+
+	void tick()
+	{
+		if(inputTrigger_)
+			inputTrigger_(input_, inputTriggerContext_);
+		pthread_mutex_lock(&inputMutex_);
+		workingInput_ = input_;
+		pthread_mutex_unlock(&inputMutex_);
+		workingOutput_ = output_; // It's const in the other threads
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		long long start = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+		for(std::size_t i = 0; i < clockCount_; i++)
+			if(tickOrder_ % clockDivisors_[i] == 0)
+				clocks_[i].advance(start);
+		for(std::size_t i = 0; i < count_; i++)
+			if(tickOrder_ % divisors_[i] == 0)
+				objects_[i]->tick(workingInput_, workingOutput_);
+		tickOrder_++;
+		pthread_mutex_lock(&outputMutex_);
+		output_ = workingOutput_;
+		pthread_mutex_unlock(&outputMutex_);
+		if(outputTrigger_)
+			outputTrigger_(output_, outputTriggerContext_);
+	}
+
+	static void *loop(void *argument)
+	{
+		FixedStateMachineManager *self = static_cast<FixedStateMachineManager *>(argument);
+		timespec next;
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		while(self->running_) {
+			self->tick();
+			next.tv_nsec += (long)self->period_ * 1000000;
+			while(next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			int result;
+			while((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr)) == EINTR) {
+			}
+			// Other errors don't go away, ticking without sleeping would take the whole processor
+			if(result)
+				break;
+		}
+		return nullptr;
+	}
+
+	bool insert(int period, TimedObject<Input, Output> *object, bool owned)
+	{
+		if(!paused_ || count_ == Capacity || period <= 0 || period % period_)
+			return false;
+		objects_[count_] = object;
+		divisors_[count_] = period / period_;
+		owned_[count_] = owned;
+		std::size_t clock = 0;
+		while(clock < clockCount_ && clockDivisors_[clock] != divisors_[count_])
+			clock++;
+		if(clock == clockCount_)
+			clockDivisors_[clockCount_++] = divisors_[count_];
+		object->attach(&clocks_[clock]);
+		count_++;
+		return true;
+	}
+
+public:
+	template<typename T>
+	class Access {
+		T *content_;
+		pthread_mutex_t *mutex_;
+		Access(T *content, pthread_mutex_t *mutex) :
+			content_(content),
+			mutex_(mutex)
+		{
+			pthread_mutex_lock(mutex_);
+		}
+		Access &operator=(const Access &) = delete;
+	public:
+		/*!
+		* \brief Moves the access, only the new one holds the lock
+		*/
+		Access(Access &&other) :
+			content_(other.content_),
+			mutex_(other.mutex_)
+		{
+			other.mutex_ = nullptr;
+		}
+
+		/*!
+		* \brief Destructor, releases the structure
+		*/
+		~Access()
+		{
+			if(mutex_)
+				pthread_mutex_unlock(mutex_);
+		}
+
+		/*!
+		* \brief Gives access to the structure
+		*/
+		T *operator->() const
+		{
+			return content_;
+		}
+
+		/*!
+		* \brief Gives access to the structure
+		*/
+		T &operator*() const
+		{
+			return *content_;
+		}
+
+		friend class FixedStateMachineManager;
+	};
+
+	/*!
+	* \brief The constructor, leaves the thread in a paused state
+	*
+	* \param The initial input structure
+	* \param The initial output structure
+	* \param The base period that divides all other periods of inserted objects, in milliseconds
+	*
+	* \note The execution starts paused, it will have to be unpaused after inserting the contents
+	*/
+	FixedStateMachineManager(const Input &input, const Output &output, int basePeriod) :
+		input_(input),
+		output_(output),
+		workingInput_(input),
+		workingOutput_(output),
+		period_(basePeriod),
+		running_(false)
+	{
+		pthread_mutex_init(&inputMutex_, nullptr);
+		pthread_mutex_init(&outputMutex_, nullptr);
+	}
+
+	/*!
+	* \brief Destructor, stops the execution and destroys the objects constructed by emplaceTimedObject()
+	*/
+	~FixedStateMachineManager()
+	{
+		if(!paused_) {
+			paused_ = 1;
+			running_ = false;
+			pthread_join(thread_, nullptr);
+		}
+		for(std::size_t i = count_; i > 0; i--)
+			if(owned_[i - 1])
+				objects_[i - 1]->~TimedObject();
+		pthread_mutex_destroy(&inputMutex_);
+		pthread_mutex_destroy(&outputMutex_);
+	}
+
+	/*!
+	* \brief Adds an object owned by the caller, it must exist as long as the manager
+	*
+	* \param The period in milliseconds, must be a positive multiple of the base period
+	* \param The object
+	*
+	* \return False if the manager is full or running or the period is wrong
+	*/
+	bool addTimedObject(int period, TimedObject<Input, Output> &added)
+	{
+		return insert(period, &added, false);
+	}
+
+	/*!
+	* \brief Constructs an object inside the manager's storage and adds it
+	*
+	* \param The period in milliseconds, must be a positive multiple of the base period
+	* \param The arguments of the object's constructor
+	*
+	* \return The object, null if the manager is full or running, the period is wrong or the storage is exhausted
+	*/
+	template<typename T, typename... Args>
+	T *emplaceTimedObject(int period, Args &&... args)
+	{
+		std::size_t start = (storageUsed_ + alignof(T) - 1) / alignof(T) * alignof(T);
+		if(!paused_ || count_ == Capacity || start + sizeof(T) > Storage || alignof(T) > alignof(std::max_align_t))
+			return nullptr;
+		T *created = new(storage_ + start) T(std::forward<Args>(args)...);
+		if(!insert(period, created, true)) {
+			created->~T();
+			return nullptr;
+		}
+		storageUsed_ = start + sizeof(T);
+		return created;
+	}
+
+	/*!
+	* \brief Pauses execution, must be resumed with unpause(), if paused twice, it will have to be unpaused twice, making pausing reentrant
+	*
+	* \note Must be called from the thread that created the manager
+	*/
+	void pause()
+	{
+		if(!paused_) {
+			running_ = false;
+			pthread_join(thread_, nullptr);
+			paused_ = 1;
+		}
+		else paused_++;
+	}
+
+	/*!
+	* \brief Resumes execution paused by pause(), if paused twice, it will have to be unpaused twice, making pausing reentrant
+	*
+	* \return False if the thread could not be started
+	*
+	* \note Must be called from the thread that created the manager. The thread stops ticking if waiting for the next
+	* tick fails for another reason than a signal
+	*/
+	bool unpause()
+	{
+		if(paused_ == 1) {
+			running_ = true;
+			if(pthread_create(&thread_, nullptr, &FixedStateMachineManager::loop, this)) {
+				running_ = false;
+				return false;
+			}
+			paused_ = 0;
+		}
+		else if(paused_)
+			paused_--;
+		return true;
+	}
+
+	/*!
+	* \brief Returns the input structure and holds it until the returned object is destroyed
+	*
+	* \return The access to the input structure, must be destroyed asap to avoid disturbing the execution
+	*/
+	Access<Input> input()
+	{
+		return Access<Input>(&input_, &inputMutex_);
+	}
+
+	/*!
+	* \brief Returns the output structure and holds it in that state until the returned object is destroyed
+	*
+	* \return The access to the output structure, must be destroyed asap to avoid disturbing the execution
+	*/
+	Access<const Output> output()
+	{
+		return Access<const Output>(&output_, &outputMutex_);
+	}
+
+	/*!
+	* \brief Sets input trigger, a function that is called before every execution
+	*
+	* \param The function, taking a reference to the input and the context
+	* \param A pointer passed to the function
+	*
+	* \note The execution must be paused to call this safely, the trigger itself is run on the same thread as the loop
+	*/
+	void setInputTrigger(void (*trigger)(Input &, void *), void *context = nullptr)
+	{
+		inputTrigger_ = trigger;
+		inputTriggerContext_ = context;
+	}
+
+	/*!
+	* \brief Sets output trigger, a function that is called after every execution
+	*
+	* \param The function, taking a const reference to the output and the context
+	* \param A pointer passed to the function
+	*
+	* \note The execution must be paused to call this safely, the trigger itself is run on the same thread as the loop
+	*/
+	void setOutputTrigger(void (*trigger)(const Output &, void *), void *context = nullptr)
+	{
+		outputTrigger_ = trigger;
+		outputTriggerContext_ = context;
+	}
+};
+
+#endif // STATE_MACHINE_FIXED_MANAGER_H
@@ -0,0 +1,218 @@
+/*
+* \brief Memory backed by 2 MB huge pages, to reduce TLB misses when large structures or many objects are accessed
+*
+* Explicit huge pages (MAP_HUGETLB) are used if the system has some reserved, otherwise the memory is aligned to 2 MB and
+* transparent huge pages are requested using madvise(), if that isn't available either, ordinary pages are used. The
+* memory is touched when allocated, so that the page faults don't happen during ticks.
+*
+* Available only on Linux.
+*/
+
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <sys/mman.h>
+
+enum class HugePageKind {
+	EXPLICIT,
+	TRANSPARENT,
+	NONE
+};
+
+class HugePageMemory {
+	void *memory_;
+	std::size_t size_;
+	HugePageKind kind_;
+
+	HugePageMemory(const HugePageMemory &) = delete;
+	HugePageMemory &operator=(const HugePageMemory &) = delete;
+
+public:
+	static constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	/*!
+	* \brief The constructor, allocates the memory
+	*
+	* \param The size in bytes, it's rounded up to whole huge pages
+	*
+	* \note Throws std::bad_alloc if no memory can be allocated
+	*/
+	HugePageMemory(std::size_t size) :
+		size_((size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE)
+	{
+		if(!size_)
+			size_ = HUGE_PAGE_SIZE;
+		memory_ = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if(memory_ != MAP_FAILED) {
+			kind_ = HugePageKind::EXPLICIT;
+			return;
+		}
+		// Allocate more to be able to align it, then give back the parts that are not needed
+		void *allocated = ::mmap(nullptr, size_ + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(allocated == MAP_FAILED)
+			throw std::bad_alloc();
+		std::uintptr_t start = reinterpret_cast<std::uintptr_t>(allocated);
+		std::uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		if(aligned > start)
+			::munmap(allocated, aligned - start);
+		::munmap(reinterpret_cast<void *>(aligned + size_), start + HUGE_PAGE_SIZE - aligned);
+		memory_ = reinterpret_cast<void *>(aligned);
+#ifdef MADV_HUGEPAGE
+		kind_ = (::madvise(memory_, size_, MADV_HUGEPAGE) == 0) ? HugePageKind::TRANSPARENT : HugePageKind::NONE;
+#else
+		kind_ = HugePageKind::NONE;
+#endif
+		std::memset(memory_, 0, size_);
+	}
+
+	/*!
+	* \brief Destructor, frees the memory
+	*/
+	~HugePageMemory()
+	{
+		::munmap(memory_, size_);
+	}
+
+	/*!
+	* \brief Returns the memory, aligned at least to the size of an ordinary page
+	*
+	* \return The memory
+	*/
+	void *data()
+	{
+		return memory_;
+	}
+
+	/*!
+	* \brief Returns the size of the memory
+	*
+	* \return The size in bytes, a multiple of the huge page size
+	*/
+	std::size_t size() const
+	{
+		return size_;
+	}
+
+	/*!
+	* \brief Returns what kind of pages back the memory
+	*
+	* \return The kind, TRANSPARENT means that they were requested, the kernel may still use ordinary pages
+	*/
+	HugePageKind kind() const
+	{
+		return kind_;
+	}
+};
+
+class HugePageArena : public std::enable_shared_from_this<HugePageArena> {
+	std::vector<std::unique_ptr<HugePageMemory>> blocks_;
+	std::size_t used_ = 0;
+	std::size_t blockSize_;
+	std::mutex mutex_;
+
+	HugePageArena(std::size_t blockSize) :
+		blockSize_(blockSize)
+	{
+	}
+
+	template<typename T>
+	struct Allocator {
+		typedef T value_type;
+		std::shared_ptr<HugePageArena> arena;
+
+		Allocator(std::shared_ptr<HugePageArena> arena) :
+			arena(arena)
+		{
+		}
+		template<typename U>
+		Allocator(const Allocator<U> &other) :
+			arena(other.arena)
+		{
+		}
+		T *allocate(std::size_t count)
+		{
+			return static_cast<T *>(arena->allocate(count * sizeof(T), alignof(T)));
+		}
+		void deallocate(T *, std::size_t)
+		{
+		}
+		template<typename U>
+		bool operator==(const Allocator<U> &other) const
+		{
+			return arena == other.arena;
+		}
+		template<typename U>
+		bool operator!=(const Allocator<U> &other) const
+		{
+			return arena != other.arena;
+		}
+	};
+
+public:
+	/*!
+	* \brief Creates an arena
+	*
+	* \param The size of the blocks of memory it allocates when it's full, rounded up to whole huge pages
+	*
+	* \return The arena
+	*/
+	static std::shared_ptr<HugePageArena> create(std::size_t blockSize = HugePageMemory::HUGE_PAGE_SIZE)
+	{
+		return std::shared_ptr<HugePageArena>(new HugePageArena(blockSize));
+	}
+
+	/*!
+	* \brief Allocates memory from the arena, it's freed only when the arena is destroyed
+	*
+	* \param The size in bytes
+	* \param The alignment, a power of two
+	*
+	* \return The memory
+	*
+	* \note Thread-safe, throws std::bad_alloc if no memory can be allocated
+	*/
+	void *allocate(std::size_t size, std::size_t alignment)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::size_t start = (used_ + alignment - 1) / alignment * alignment;
+		if(blocks_.empty() || start + size > blocks_.back()->size()) {
+			blocks_.push_back(std::make_unique<HugePageMemory>(std::max(size + alignment, blockSize_)));
+			start = 0;
+		}
+		used_ = start + size;
+		return static_cast<unsigned char *>(blocks_.back()->data()) + start;
+	}
+
+	/*!
+	* \brief Constructs an object in the arena, meant for timed objects, so that those ticked together are next to each
+	* other in memory
+	*
+	* \param The arguments of the object's constructor
+	*
+	* \return A shared pointer to the object, it keeps the arena alive
+	*/
+	template<typename T, typename... Args>
+	std::shared_ptr<T> make(Args &&... args)
+	{
+		return std::allocate_shared<T>(Allocator<T>(shared_from_this()), std::forward<Args>(args)...);
+	}
+
+	/*!
+	* \brief Returns what kind of pages back the arena's memory
+	*
+	* \return The kind of the first block, NONE if nothing was allocated yet
+	*/
+	HugePageKind kind()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return blocks_.empty() ? HugePageKind::NONE : blocks_.front()->kind();
+	}
+};
+
+#endif // HUGE_PAGES_H
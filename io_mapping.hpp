@@ -0,0 +1,141 @@
+/*
+* \brief Binding of fields of the input and output structures to buffers of I/O drivers
+*
+* The mapping is declared once, then the whole input is scattered from the driver buffers and the whole output is
+* gathered into them in a single pass per tick. Mappings of neighbouring fields to neighbouring parts of the same buffer
+* are merged, so that structures laid out the same way as the driver buffer are copied with a single memcpy.
+*/
+
+#ifndef IO_MAPPING_H
+#define IO_MAPPING_H
+
+#include "state_machine.hpp"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+template<typename Class, typename T>
+std::size_t memberOffset(T Class::*member)
+{
+	typename std::aligned_storage<sizeof(Class), alignof(Class)>::type storage;
+	const Class *object = reinterpret_cast<const Class *>(&storage);
+	return std::size_t(reinterpret_cast<const unsigned char *>(&(object->*member)) - reinterpret_cast<const unsigned char *>(object));
+}
+
+template<typename Input, typename Output>
+class IoMapping {
+	struct Region {
+		unsigned char *buffer;
+		std::size_t bufferOffset;
+		std::size_t structOffset;
+		std::size_t size;
+	};
+	std::vector<Region> inputRegions_;
+	std::vector<Region> outputRegions_;
+
+	static void addRegion(std::vector<Region> &regions, Region added)
+	{
+		regions.push_back(added);
+		std::sort(regions.begin(), regions.end(), [](const Region &first, const Region &second) {
+			if(first.buffer != second.buffer) return std::less<unsigned char *>()(first.buffer, second.buffer);
+			return first.bufferOffset < second.bufferOffset;
+		});
+		std::vector<Region> merged;
+		for(const Region &region : regions) {
+			if(!merged.empty()) {
+				Region &last = merged.back();
+				if(last.buffer == region.buffer && last.bufferOffset + last.size == region.bufferOffset
+						&& last.structOffset + last.size == region.structOffset) {
+					last.size += region.size;
+					continue;
+				}
+			}
+			merged.push_back(region);
+		}
+		regions.swap(merged);
+	}
+
+public:
+	/*!
+	* \brief Maps a part of a driver's buffer to a member of the input structure
+	*
+	* \param The driver's buffer, must remain valid while the mapping is used
+	* \param The offset in the buffer in bytes
+	* \param Pointer to the member of the input structure, it must be trivially copyable
+	*/
+	template<typename T>
+	void mapInput(const void *buffer, std::size_t offset, T Input::*member)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable fields can be mapped");
+		addRegion(inputRegions_, Region{ const_cast<unsigned char *>(static_cast<const unsigned char *>(buffer)), offset,
+				memberOffset(member), sizeof(T) });
+	}
+
+	/*!
+	* \brief Maps a member of the output structure to a part of a driver's buffer
+	*
+	* \param The driver's buffer, must remain valid while the mapping is used
+	* \param The offset in the buffer in bytes
+	* \param Pointer to the member of the output structure, it must be trivially copyable
+	*/
+	template<typename T>
+	void mapOutput(void *buffer, std::size_t offset, T Output::*member)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable fields can be mapped");
+		addRegion(outputRegions_, Region{ static_cast<unsigned char *>(buffer), offset, memberOffset(member), sizeof(T) });
+	}
+
+	/*!
+	* \brief Copies all mapped parts of driver buffers into the input structure
+	*
+	* \param The input structure
+	*/
+	void scatter(Input &in) const
+	{
+		unsigned char *destination = reinterpret_cast<unsigned char *>(&in);
+		for(const Region &region : inputRegions_)
+			std::memcpy(destination + region.structOffset, region.buffer + region.bufferOffset, region.size);
+	}
+
+	/*!
+	* \brief Copies all mapped members of the output structure into the driver buffers
+	*
+	* \param The output structure
+	*/
+	void gather(const Output &out) const
+	{
+		const unsigned char *source = reinterpret_cast<const unsigned char *>(&out);
+		for(const Region &region : outputRegions_)
+			std::memcpy(region.buffer + region.bufferOffset, source + region.structOffset, region.size);
+	}
+
+	/*!
+	* \brief Returns the number of memcpy calls a scatter and gather need after merging neighbouring regions
+	*
+	* \return The number of copied regions
+	*/
+	std::size_t regionCount() const
+	{
+		return inputRegions_.size() + outputRegions_.size();
+	}
+
+	/*!
+	* \brief Sets the manager's input and output triggers to scatter and gather through this mapping
+	*
+	* \param The manager
+	*
+	* \note The execution must be paused to call this safely, the mapping must outlive the manager's execution, other
+	* triggers set to the manager are replaced
+	*/
+	void attach(StateMachineManager<Input, Output> &manager) const
+	{
+		manager.setInputTrigger([this](Input &in) {
+			scatter(in);
+		});
+		manager.setOutputTrigger([this](const Output &out) {
+			gather(out);
+		});
+	}
+};
+
+#endif // IO_MAPPING_H
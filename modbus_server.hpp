@@ -0,0 +1,526 @@
+/*
+* \brief A Modbus TCP server exposing the input and output structures of a StateMachineManager as registers
+*
+* Members of the output structure are mapped onto read-only registers, members of the input structure onto registers
+* that can be written and read back. The server runs in a single thread driven by epoll. Reads are served from the
+* manager's output snapshot and writes are passed to the manager through input segments, so the server never takes the
+* manager's locks and cannot delay its ticks.
+*
+* Supported functions are Read Holding Registers (3), Read Input Registers (4), Write Single Register (6) and Write
+* Multiple Registers (16). Holding and input registers share the same address space. Members that are 8 or 16 bits wide
+* take one register per element, wider members take as many registers as they need, the most significant word first.
+*
+* Available only on Linux.
+*/
+
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include "io_mapping.hpp"
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+template<typename Input, typename Output>
+class ModbusServer {
+	enum class Function : std::uint8_t {
+		READ_HOLDING_REGISTERS = 3,
+		READ_INPUT_REGISTERS = 4,
+		WRITE_SINGLE_REGISTER = 6,
+		WRITE_MULTIPLE_REGISTERS = 16
+	};
+	enum class Exception : std::uint8_t {
+		ILLEGAL_FUNCTION = 1,
+		ILLEGAL_DATA_ADDRESS = 2,
+		ILLEGAL_DATA_VALUE = 3
+	};
+	static constexpr int MAX_READ = 125;
+	static constexpr int MAX_WRITE = 123;
+
+	struct Mapping {
+		std::uint16_t address;
+		std::uint16_t count;
+		std::size_t offset;
+		std::size_t size;
+		bool writable;
+		void (*encode)(const unsigned char *field, std::uint16_t *registers, std::size_t size);
+		void (*decode)(const std::uint16_t *registers, unsigned char *field, std::size_t size);
+		std::vector<unsigned char> value; // Only for writable mappings
+		std::function<void(const unsigned char *)> publish;
+	};
+	struct Connection {
+		std::vector<std::uint8_t> received;
+		std::vector<std::uint8_t> toSend;
+		std::size_t sent = 0;
+	};
+
+	std::shared_ptr<const PublishedSnapshot<Output>> snapshot_;
+	StateMachineManager<Input, Output> &manager_;
+	std::vector<Mapping> mappings_;
+	std::vector<std::uint16_t> registers_;
+	std::vector<int> owners_;
+	std::unique_ptr<Output> output_;
+	std::uint64_t outputVersion_ = 0;
+	std::unordered_map<int, Connection> connections_;
+	int listener_ = -1;
+	int epoll_ = -1;
+	int wakeup_ = -1;
+	int port_ = 0;
+	std::atomic<long long> requests_;
+	std::thread thread_;
+
+	template<typename Element>
+	static void encodeElements(const unsigned char *field, std::uint16_t *registers, std::size_t size)
+	{
+		for(std::size_t i = 0; i < size / sizeof(Element); i++) {
+			Element element;
+			std::memcpy(&element, field + i * sizeof(Element), sizeof(Element));
+			if(sizeof(Element) <= 2) {
+				registers[i] = std::uint16_t(element);
+				continue;
+			}
+			unsigned char bytes[sizeof(Element)];
+			std::memcpy(bytes, &element, sizeof(Element));
+			std::uint64_t raw = 0;
+			for(std::size_t j = sizeof(Element); j > 0; j--)
+				raw = (raw << 8) | bytes[j - 1]; // Assumes little endian
+			for(std::size_t j = 0; j < sizeof(Element) / 2; j++)
+				registers[i * sizeof(Element) / 2 + j] = std::uint16_t(raw >> (16 * (sizeof(Element) / 2 - 1 - j)));
+		}
+	}
+
+	template<typename Element>
+	static void decodeElements(const std::uint16_t *registers, unsigned char *field, std::size_t size)
+	{
+		for(std::size_t i = 0; i < size / sizeof(Element); i++) {
+			Element element;
+			if(sizeof(Element) <= 2) {
+				element = Element(registers[i]);
+			} else {
+				std::uint64_t raw = 0;
+				for(std::size_t j = 0; j < sizeof(Element) / 2; j++)
+					raw = (raw << 16) | registers[i * sizeof(Element) / 2 + j];
+				unsigned char bytes[sizeof(Element)];
+				for(std::size_t j = 0; j < sizeof(Element); j++)
+					bytes[j] = (unsigned char)(raw >> (8 * j));
+				std::memcpy(&element, bytes, sizeof(Element));
+			}
+			std::memcpy(field + i * sizeof(Element), &element, sizeof(Element));
+		}
+	}
+
+	template<typename T>
+	static Mapping makeMapping(std::uint16_t address, std::size_t offset, bool writable)
+	{
+		typedef typename std::remove_all_extents<T>::type Element;
+		static_assert(std::is_arithmetic<Element>::value, "Only arithmetic members or their arrays can be mapped");
+		static_assert(sizeof(Element) <= 2 || sizeof(Element) == 4 || sizeof(Element) == 8, "Unsupported element size");
+		Mapping made;
+		made.address = address;
+		made.count = std::uint16_t(sizeof(T) / sizeof(Element) * (sizeof(Element) <= 2 ? 1 : sizeof(Element) / 2));
+		made.offset = offset;
+		made.size = sizeof(T);
+		made.writable = writable;
+		made.encode = &encodeElements<Element>;
+		made.decode = &decodeElements<Element>;
+		return made;
+	}
+
+	// Throws std::invalid_argument if the mapping can't be added, before anything is changed
+	void checkMapping(const Mapping &checked) const
+	{
+		if(std::size_t(checked.address) + checked.count > 0x10000)
+			throw std::invalid_argument("Modbus mapping exceeds the register address space");
+		for(std::size_t i = checked.address; i < std::min(owners_.size(), std::size_t(checked.address) + checked.count); i++)
+			if(owners_[i] != -1)
+				throw std::invalid_argument("Modbus mappings overlap");
+	}
+
+	void addMapping(Mapping &&added)
+	{
+		checkMapping(added);
+		if(registers_.size() < std::size_t(added.address) + added.count) {
+			registers_.resize(added.address + added.count);
+			owners_.resize(added.address + added.count, -1);
+		}
+		for(int i = added.address; i < added.address + added.count; i++)
+			owners_[i] = int(mappings_.size());
+		if(added.writable)
+			added.encode(added.value.data(), &registers_[added.address], added.size);
+		mappings_.push_back(std::move(added));
+	}
+
+	static void throwSystemError(const char *what)
+	{
+		throw std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+	}
+
+	void refreshOutput()
+	{
+		if(snapshot_->version() == outputVersion_)
+			return;
+		outputVersion_ = snapshot_->read(*output_);
+		const unsigned char *source = reinterpret_cast<const unsigned char *>(output_.get());
+		for(const Mapping &mapping : mappings_)
+			if(!mapping.writable)
+				mapping.encode(source + mapping.offset, &registers_[mapping.address], mapping.size);
+	}
+
+	Exception checkRange(int address, int count, bool writing)
+	{
+		if(address + count > int(owners_.size()))
+			return Exception::ILLEGAL_DATA_ADDRESS;
+		for(int i = address; i < address + count; i++)
+			if(owners_[i] == -1 || (writing && !mappings_[owners_[i]].writable))
+				return Exception::ILLEGAL_DATA_ADDRESS;
+		return Exception(0);
+	}
+
+	static std::uint16_t readWord(const std::uint8_t *from)
+	{
+		return std::uint16_t((from[0] << 8) | from[1]);
+	}
+
+	static void appendWord(std::vector<std::uint8_t> &to, std::uint16_t word)
+	{
+		to.push_back(std::uint8_t(word >> 8));
+		to.push_back(std::uint8_t(word));
+	}
+
+	void writeRegisters(int address, int count, const std::uint8_t *values)
+	{
+		for(int i = 0; i < count; i++)
+			registers_[address + i] = readWord(values + 2 * i);
+		int last = -1;
+		for(int i = address; i < address + count; i++) {
+			if(owners_[i] == last)
+				continue;
+			last = owners_[i];
+			Mapping &mapping = mappings_[last];
+			mapping.decode(&registers_[mapping.address], mapping.value.data(), mapping.size);
+			mapping.publish(mapping.value.data());
+		}
+	}
+
+	// Processes one request's PDU and appends the response's PDU
+	void respond(const std::uint8_t *request, std::size_t size, std::vector<std::uint8_t> &response)
+	{
+		Function function = Function(request[0]);
+		Exception exception = Exception(0);
+		int address = size >= 3 ? readWord(request + 1) : 0;
+		int count = size >= 5 ? readWord(request + 3) : 0;
+		switch(function) {
+			case Function::READ_HOLDING_REGISTERS:
+			case Function::READ_INPUT_REGISTERS:
+				if(size != 5 || count < 1 || count > MAX_READ) {
+					exception = Exception::ILLEGAL_DATA_VALUE;
+					break;
+				}
+				exception = checkRange(address, count, false);
+				if(exception != Exception(0))
+					break;
+				refreshOutput();
+				response.push_back(std::uint8_t(function));
+				response.push_back(std::uint8_t(count * 2));
+				for(int i = address; i < address + count; i++)
+					appendWord(response, registers_[i]);
+				return;
+			case Function::WRITE_SINGLE_REGISTER:
+				if(size != 5) {
+					exception = Exception::ILLEGAL_DATA_VALUE;
+					break;
+				}
+				exception = checkRange(address, 1, true);
+				if(exception != Exception(0))
+					break;
+				writeRegisters(address, 1, request + 3);
+				response.insert(response.end(), request, request + 5);
+				return;
+			case Function::WRITE_MULTIPLE_REGISTERS:
+				if(size < 6 || count < 1 || count > MAX_WRITE || request[5] != count * 2 || size != std::size_t(6 + count * 2)) {
+					exception = Exception::ILLEGAL_DATA_VALUE;
+					break;
+				}
+				exception = checkRange(address, count, true);
+				if(exception != Exception(0))
+					break;
+				writeRegisters(address, count, request + 6);
+				response.insert(response.end(), request, request + 5);
+				return;
+			default:
+				exception = Exception::ILLEGAL_FUNCTION;
+		}
+		response.push_back(std::uint8_t(request[0] | 0x80));
+		response.push_back(std::uint8_t(exception));
+	}
+
+	// Returns false if the connection should be closed
+	bool processReceived(Connection &connection)
+	{
+		std::size_t position = 0;
+		std::vector<std::uint8_t> &received = connection.received;
+		while(received.size() - position >= 8) {
+			const std::uint8_t *frame = received.data() + position;
+			std::size_t length = readWord(frame + 4);
+			if(readWord(frame + 2) != 0 || length < 2 || length > 254)
+				return false;
+			if(received.size() - position < 6 + length)
+				break;
+			std::size_t header = connection.toSend.size();
+			connection.toSend.insert(connection.toSend.end(), frame, frame + 7);
+			respond(frame + 7, length - 1, connection.toSend);
+			std::size_t responseLength = connection.toSend.size() - header - 6;
+			connection.toSend[header + 4] = std::uint8_t(responseLength >> 8);
+			connection.toSend[header + 5] = std::uint8_t(responseLength);
+			position += 6 + length;
+			requests_.fetch_add(1, std::memory_order_relaxed);
+		}
+		received.erase(received.begin(), received.begin() + position);
+		return true;
+	}
+
+	// Returns false if the connection should be closed
+	bool flush(int socket, Connection &connection)
+	{
+		while(connection.sent < connection.toSend.size()) {
+			ssize_t written = ::send(socket, connection.toSend.data() + connection.sent, connection.toSend.size() - connection.sent, MSG_NOSIGNAL);
+			if(written < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				return false;
+			}
+			connection.sent += written;
+		}
+		if(connection.sent == connection.toSend.size()) {
+			connection.toSend.clear();
+			connection.sent = 0;
+		}
+		epoll_event event = {};
+		event.events = EPOLLIN | (connection.toSend.empty() ? 0u : std::uint32_t(EPOLLOUT));
+		event.data.fd = socket;
+		epoll_ctl(epoll_, EPOLL_CTL_MOD, socket, &event);
+		return true;
+	}
+
+	void close(int socket)
+	{
+		epoll_ctl(epoll_, EPOLL_CTL_DEL, socket, nullptr);
+		::close(socket);
+		connections_.erase(socket);
+	}
+
+	void accept()
+	{
+		while(true) {
+			int socket = ::accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(socket < 0)
+				return;
+			int enabled = 1;
+			setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+			epoll_event event = {};
+			event.events = EPOLLIN;
+			event.data.fd = socket;
+			epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &event);
+			connections_[socket];
+		}
+	}
+
+	void serve(int socket, std::uint32_t events)
+	{
+		auto found = connections_.find(socket);
+		if(found == connections_.end())
+			return;
+		Connection &connection = found->second;
+		if(events & (EPOLLERR | EPOLLHUP)) {
+			close(socket);
+			return;
+		}
+		if(events & EPOLLIN) {
+			std::uint8_t buffer[4096];
+			while(true) {
+				ssize_t got = ::recv(socket, buffer, sizeof(buffer), 0);
+				if(got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+					close(socket);
+					return;
+				}
+				if(got < 0)
+					break;
+				connection.received.insert(connection.received.end(), buffer, buffer + got);
+			}
+			if(!processReceived(connection)) {
+				close(socket);
+				return;
+			}
+		}
+		if(!flush(socket, connection))
+			close(socket);
+	}
+
+	void run()
+	{
+		epoll_event events[64];
+		while(true) {
+			int count = epoll_wait(epoll_, events, 64, -1);
+			for(int i = 0; i < count; i++) {
+				int socket = events[i].data.fd;
+				if(socket == wakeup_)
+					return;
+				if(socket == listener_)
+					accept();
+				else
+					serve(socket, events[i].events);
+			}
+		}
+	}
+
+public:
+	/*!
+	* \brief The constructor, does not start serving yet
+	*
+	* \param The manager whose input and output are exposed
+	*
+	* \note The execution must be paused, mappings must be added and start() must be called while it's paused
+	*/
+	ModbusServer(StateMachineManager<Input, Output> &manager) :
+		snapshot_(manager.outputSnapshot()),
+		manager_(manager),
+		output_(std::make_unique<Output>(*manager.output())),
+		requests_(0)
+	{
+	}
+
+	/*!
+	* \brief Destructor, stops the server and closes all connections
+	*/
+	~ModbusServer()
+	{
+		if(thread_.joinable()) {
+			// The thread uses the members, so it must end before they are destroyed, a single write can't overflow
+			// the eventfd's counter and only an interruption can make it fail
+			std::uint64_t one = 1;
+			while(::write(wakeup_, &one, sizeof(one)) < 0 && errno == EINTR);
+			thread_.join();
+		}
+		for(auto &connection : connections_)
+			::close(connection.first);
+		for(int socket : { listener_, epoll_, wakeup_ })
+			if(socket >= 0)
+				::close(socket);
+	}
+
+	/*!
+	* \brief Maps a member of the output structure onto read-only registers
+	*
+	* \param The address of the first register
+	* \param Pointer to the member, must be arithmetic or an array of arithmetic values
+	*
+	* \note Throws std::invalid_argument if the registers are already mapped or don't fit, nothing is mapped then
+	*/
+	template<typename T>
+	void mapOutput(std::uint16_t address, T Output::*member)
+	{
+		addMapping(makeMapping<T>(address, memberOffset(member), false));
+	}
+
+	/*!
+	* \brief Maps a member of the input structure onto registers that can be written, writes to them are passed to the
+	* input through an input segment
+	*
+	* \param The address of the first register
+	* \param Pointer to the member, must be arithmetic or an array of arithmetic values
+	*
+	* \note The member becomes owned by the server, changes to it done through the manager's input() are lost. Throws
+	* std::invalid_argument if the registers are already mapped or don't fit, nothing is mapped then
+	*/
+	template<typename T>
+	void mapInput(std::uint16_t address, T Input::*member)
+	{
+		Mapping made = makeMapping<T>(address, memberOffset(member), true);
+		checkMapping(made); // Before the segment takes over the member
+		std::shared_ptr<InputSegment<T>> segment = manager_.addInputSegment(member);
+		made.value.resize(sizeof(T));
+		{
+			auto in = manager_.input();
+			std::memcpy(made.value.data(), &((*in).*member), sizeof(T));
+		}
+		made.publish = [segment](const unsigned char *value) {
+			T published;
+			std::memcpy(&published, value, sizeof(T));
+			segment->publish(published);
+		};
+		addMapping(std::move(made));
+	}
+
+	/*!
+	* \brief Starts listening and serving in a new thread
+	*
+	* \param The TCP port, 502 is standard, 0 picks any free port
+	* \param Whether to listen only on the loopback interface
+	*
+	* \note Throws std::runtime_error if the socket cannot be set up
+	*/
+	void start(int port = 502, bool localOnly = false)
+	{
+		listener_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(listener_ < 0)
+			throwSystemError("Cannot create a Modbus socket");
+		int enabled = 1;
+		setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(std::uint16_t(port));
+		address.sin_addr.s_addr = htonl(localOnly ? INADDR_LOOPBACK : INADDR_ANY);
+		if(::bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+			throwSystemError("Cannot bind the Modbus socket");
+		if(::listen(listener_, SOMAXCONN) < 0)
+			throwSystemError("Cannot listen on the Modbus socket");
+		socklen_t length = sizeof(address);
+		getsockname(listener_, reinterpret_cast<sockaddr *>(&address), &length);
+		port_ = ntohs(address.sin_port);
+
+		epoll_ = epoll_create1(EPOLL_CLOEXEC);
+		wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(epoll_ < 0 || wakeup_ < 0)
+			throwSystemError("Cannot set up the Modbus server's event loop");
+		for(int socket : { listener_, wakeup_ }) {
+			epoll_event event = {};
+			event.events = EPOLLIN;
+			event.data.fd = socket;
+			epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &event);
+		}
+		thread_ = std::thread([this]() {
+			run();
+		});
+	}
+
+	/*!
+	* \brief Returns the port the server listens on, useful if started with port 0
+	*
+	* \return The port
+	*/
+	int port() const
+	{
+		return port_;
+	}
+
+	/*!
+	* \brief Returns the number of requests served
+	*
+	* \return The number of requests
+	*/
+	long long requests() const
+	{
+		return requests_.load(std::memory_order_relaxed);
+	}
+};
+
+#endif // MODBUS_SERVER_H
@@ -0,0 +1,152 @@
+/*
+* \brief Limiting of analog output channels once per tick, as an output stage of the manager
+*
+* An OutputLimiting processes an array of targets in the output after all objects ran and before the output is
+* published, writing the limited values into another array, so that the objects don't have to limit their outputs on
+* their own. The objects only write the targets and the stage never changes them, so a target written once is followed
+* until it's reached, also by objects running less often than every tick. Each channel goes through these steps:
+* - clamping between a minimum and a maximum
+* - a deadband, the accepted target is kept if the new one differs from it by the deadband or less
+* - a slew rate limit, the value approaches the accepted target at most by the rate multiplied by the time of a tick
+*
+* The limits and the previous values of the channels are kept in separate arrays and processed by a loop that the
+* compiler vectorises. The stage is created by limitOutput().
+*/
+
+#ifndef STATE_MACHINE_OUTPUT_LIMITING_H
+#define STATE_MACHINE_OUTPUT_LIMITING_H
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+template<std::size_t Channels>
+class OutputLimiting {
+	alignas(64) float minimum_[Channels];
+	alignas(64) float maximum_[Channels];
+	alignas(64) float deadband_[Channels];
+	alignas(64) float rate_[Channels];
+	alignas(64) float last_[Channels];
+	alignas(64) float held_[Channels]; // The targets accepted by the deadbands
+	alignas(64) float target_[Channels];
+	bool started_ = false;
+
+	void check(std::size_t channel) const
+	{
+		if(channel >= Channels)
+			throw std::out_of_range("No such output channel");
+	}
+
+public:
+	/*!
+	* \brief The constructor, all channels are left unchanged
+	*/
+	OutputLimiting()
+	{
+		for(std::size_t i = 0; i < Channels; i++) {
+			minimum_[i] = -std::numeric_limits<float>::infinity();
+			maximum_[i] = std::numeric_limits<float>::infinity();
+			deadband_[i] = 0;
+			rate_[i] = std::numeric_limits<float>::infinity();
+			last_[i] = 0;
+			held_[i] = 0;
+		}
+	}
+
+	/*!
+	* \brief Sets the range of a channel
+	*
+	* \param The channel's index
+	* \param The minimum
+	* \param The maximum
+	*/
+	void setLimits(std::size_t channel, float minimum, float maximum)
+	{
+		check(channel);
+		if(minimum > maximum)
+			throw std::invalid_argument("The minimum can't be above the maximum");
+		minimum_[channel] = minimum;
+		maximum_[channel] = maximum;
+	}
+
+	/*!
+	* \brief Sets a channel's deadband
+	*
+	* \param The channel's index
+	* \param The largest change that is ignored
+	*/
+	void setDeadband(std::size_t channel, float deadband)
+	{
+		check(channel);
+		deadband_[channel] = deadband;
+	}
+
+	/*!
+	* \brief Sets a channel's slew rate limit
+	*
+	* \param The channel's index
+	* \param The largest change per second, positive
+	*/
+	void setRate(std::size_t channel, float rate)
+	{
+		check(channel);
+		if(!(rate > 0))
+			throw std::invalid_argument("The rate must be positive");
+		rate_[channel] = rate;
+	}
+
+	/*!
+	* \brief Limits all channels, the first values are only clamped
+	*
+	* \param The targets
+	* \param Where to write the limited values, may be the same as the targets
+	* \param The time since the previous call in milliseconds
+	*/
+	void process(const float *targets, float *values, int period)
+	{
+		// Working on members only lets the compiler know that the arrays don't overlap
+		std::copy(targets, targets + Channels, target_);
+		if(!started_) {
+			for(std::size_t i = 0; i < Channels; i++) {
+				last_[i] = std::min(std::max(target_[i], minimum_[i]), maximum_[i]);
+				held_[i] = last_[i];
+			}
+			started_ = true;
+		}
+		const float seconds = period / 1000.0f;
+		for(std::size_t i = 0; i < Channels; i++) {
+			float target = (target_[i] < minimum_[i]) ? minimum_[i] : target_[i];
+			target = (target > maximum_[i]) ? maximum_[i] : target;
+			// The deadband applies to the target, so that a slewing value still reaches it
+			held_[i] = (std::fabs(target - held_[i]) > deadband_[i]) ? target : held_[i];
+			float step = rate_[i] * seconds;
+			last_[i] += std::min(std::max(held_[i] - last_[i], -step), step);
+		}
+		std::copy(last_, last_ + Channels, values);
+	}
+};
+
+/*!
+* \brief Creates an output stage limiting analog channels
+*
+* \param The limiting, it must not be changed or used elsewhere while the execution is running
+* \param Pointer to the member of the output structure with the targets, written by the objects
+* \param Pointer to the member of the output structure with the limited values, written only by the stage
+* \param The manager's base period in milliseconds, the stage runs every tick
+*
+* \return The stage, to be added to the manager by addOutputStage()
+*/
+template<typename Output, std::size_t Channels>
+std::function<void(Output &)> limitOutput(std::shared_ptr<OutputLimiting<Channels>> limiting, float (Output::*targets)[Channels],
+		float (Output::*values)[Channels], int period)
+{
+	return [limiting, targets, values, period](Output &output) {
+		limiting->process(output.*targets, output.*values, period);
+	};
+}
+
+#endif // STATE_MACHINE_OUTPUT_LIMITING_H
@@ -0,0 +1,190 @@
+/*
+* \brief Loading timed objects from shared libraries at runtime
+*
+* A plugin is a shared library that exports a function named state_machine_plugin with C linkage, returning a description
+* of the plugin with functions that create and destroy its objects. The description also states the version of this
+* interface, the sizes and layout version of the input and output structures, and the size of TimedObject and the macros
+* changing it that it was compiled with, so that a plugin built for different structures or a different version of
+* TimedObject is refused. Macro STATE_MACHINE_PLUGIN defines the function. File plugin_example.cpp is a sample plugin.
+*
+* The interface version must be increased whenever the layout or the virtual methods of TimedObject change, because
+* plugins derive from it. Version 2 added the replication hooks, STATE_MACHINE_MINIMAL and the frame clock.
+*
+* The input and output structures must not be local classes in the host, otherwise the compiler can assume that only
+* the host's classes derive from TimedObject and call the wrong methods of the plugin's objects.
+*
+* The host loads the library using TimedObjectPlugin::load() and creates objects with its create() method, then inserts
+* them into a running manager with addTimedObject(), which only swaps the manager's list of objects between ticks. All
+* symbol resolution and allocation happens in the thread that loads the plugin. The library is unloaded when the plugin
+* and all objects created by it are destroyed.
+*
+* Available only on systems with dlopen(), the host may need to be linked with -ldl.
+*/
+
+#ifndef STATE_MACHINE_PLUGIN_H
+#define STATE_MACHINE_PLUGIN_H
+
+#include "state_machine.hpp"
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <dlfcn.h>
+
+#define STATE_MACHINE_PLUGIN_ABI_VERSION 2
+
+#ifdef STATE_MACHINE_MINIMAL
+#define STATE_MACHINE_PLUGIN_BUILD_FLAGS 1
+#else
+#define STATE_MACHINE_PLUGIN_BUILD_FLAGS 0
+#endif
+
+extern "C" {
+	struct StateMachinePluginInfo {
+		std::uint32_t abiVersion; // Must stay first, so that plugins built for other versions can be recognised
+		std::uint32_t inputSize;
+		std::uint32_t outputSize;
+		std::uint32_t layoutVersion;
+		std::uint32_t objectSize; // Of TimedObject<Input, Output>
+		std::uint32_t buildFlags; // STATE_MACHINE_PLUGIN_BUILD_FLAGS
+		const char *name;
+		void *(*create)(const char *configuration); // Returns a TimedObject<Input, Output> *, null on failure
+		void (*destroy)(void *object);
+	};
+	typedef const StateMachinePluginInfo *(*StateMachinePluginEntry)();
+}
+
+template<typename Input, typename Output, typename Created>
+typename std::enable_if<std::is_constructible<Created, const char *>::value, TimedObject<Input, Output> *>::type
+		createPluginObject(const char *configuration)
+{
+	return new Created(configuration);
+}
+
+template<typename Input, typename Output, typename Created>
+typename std::enable_if<!std::is_constructible<Created, const char *>::value, TimedObject<Input, Output> *>::type
+		createPluginObject(const char *)
+{
+	return new Created();
+}
+
+/*!
+* \brief Defines the entry point of a plugin, use once in the plugin's source
+*
+* \param The input structure
+* \param The output structure
+* \param A number identifying the layout of the structures, the host must use the same one
+* \param The class of the created objects, derived from TimedObject, constructed from the configuration string if it has
+* such a constructor, default constructed otherwise
+*/
+#define STATE_MACHINE_PLUGIN(InputType, OutputType, LayoutVersion, ObjectType) \
+	extern "C" __attribute__((visibility("default"))) const StateMachinePluginInfo *state_machine_plugin() \
+	{ \
+		static const StateMachinePluginInfo info = { \
+			STATE_MACHINE_PLUGIN_ABI_VERSION, \
+			sizeof(InputType), \
+			sizeof(OutputType), \
+			LayoutVersion, \
+			sizeof(TimedObject<InputType, OutputType>), \
+			STATE_MACHINE_PLUGIN_BUILD_FLAGS, \
+			#ObjectType, \
+			[](const char *configuration) -> void * { \
+				try { \
+					return createPluginObject<InputType, OutputType, ObjectType>(configuration); \
+				} catch(...) { \
+					return nullptr; \
+				} \
+			}, \
+			[](void *object) { \
+				delete static_cast<TimedObject<InputType, OutputType> *>(object); \
+			} \
+		}; \
+		return &info; \
+	}
+
+template<typename Input, typename Output>
+class TimedObjectPlugin : public std::enable_shared_from_this<TimedObjectPlugin<Input, Output>> {
+	void *library_;
+	const StateMachinePluginInfo *info_;
+
+	TimedObjectPlugin(void *library, const StateMachinePluginInfo *info) :
+		library_(library),
+		info_(info)
+	{
+	}
+
+public:
+	/*!
+	* \brief Loads a plugin and checks that it was built for the same interface and structures
+	*
+	* \param The path to the shared library
+	* \param The number identifying the layout of the structures, as given to STATE_MACHINE_PLUGIN in the plugin
+	*
+	* \return The plugin
+	*
+	* \note Throws std::runtime_error if the library cannot be loaded or doesn't match
+	*/
+	static std::shared_ptr<TimedObjectPlugin> load(const std::string &path, std::uint32_t layoutVersion)
+	{
+		void *library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		if(!library)
+			throw std::runtime_error("Cannot load plugin " + path + ": " + dlerror());
+		std::string problem;
+		StateMachinePluginEntry entry = reinterpret_cast<StateMachinePluginEntry>(dlsym(library, "state_machine_plugin"));
+		const StateMachinePluginInfo *info = entry ? entry() : nullptr;
+		if(!info)
+			problem = "it has no state_machine_plugin function";
+		else if(info->abiVersion != STATE_MACHINE_PLUGIN_ABI_VERSION)
+			problem = "it was built for plugin interface version " + std::to_string(info->abiVersion);
+		else if(info->objectSize != sizeof(TimedObject<Input, Output>) || info->buildFlags != STATE_MACHINE_PLUGIN_BUILD_FLAGS)
+			problem = "it was built with a different TimedObject or with different configuration macros";
+		else if(info->inputSize != sizeof(Input) || info->outputSize != sizeof(Output) || info->layoutVersion != layoutVersion)
+			problem = "it was built for different input or output structures";
+		if(!problem.empty()) {
+			dlclose(library);
+			throw std::runtime_error("Cannot use plugin " + path + ": " + problem);
+		}
+		return std::shared_ptr<TimedObjectPlugin>(new TimedObjectPlugin(library, info));
+	}
+
+	/*!
+	* \brief Destructor, unloads the library
+	*
+	* \note Objects created by the plugin keep it loaded until they are destroyed
+	*/
+	~TimedObjectPlugin()
+	{
+		dlclose(library_);
+	}
+
+	/*!
+	* \brief Creates an object from the plugin
+	*
+	* \param A configuration string passed to the object's constructor, if it has one accepting it
+	*
+	* \return A shared pointer to the object, it keeps the plugin loaded
+	*
+	* \note Throws std::runtime_error if the plugin fails to create the object
+	*/
+	std::shared_ptr<TimedObject<Input, Output>> create(const char *configuration = "")
+	{
+		void *created = info_->create(configuration);
+		if(!created)
+			throw std::runtime_error(std::string("Plugin ") + info_->name + " failed to create an object");
+		std::shared_ptr<TimedObjectPlugin> self = this->shared_from_this();
+		return std::shared_ptr<TimedObject<Input, Output>>(static_cast<TimedObject<Input, Output> *>(created), [self](TimedObject<Input, Output> *destroyed) {
+			self->info_->destroy(destroyed);
+		});
+	}
+
+	/*!
+	* \brief Returns the name of the plugin's object class
+	*
+	* \return The name
+	*/
+	std::string name() const
+	{
+		return info_->name;
+	}
+};
+
+#endif // STATE_MACHINE_PLUGIN_H
@@ -0,0 +1,28 @@
+// A sample plugin, built as a shared library, for example by:
+// g++ -std=c++14 -shared -fPIC plugin_example.cpp -o plugin_example.so
+#include <cstdlib>
+#include "plugin.hpp"
+
+// The structures must be the same in the host, they are repeated in the plugin test of elementary_test.cpp
+struct PluginInput {
+	int value;
+};
+struct PluginOutput {
+	int scaled;
+};
+
+// Multiplies the input by the number given as configuration
+class Scaler : public TimedObject<PluginInput, PluginOutput> {
+	int factor_;
+public:
+	Scaler(const char *configuration) :
+		factor_(std::atoi(configuration))
+	{
+	}
+	virtual void tick(const PluginInput &in, PluginOutput &out)
+	{
+		out.scaled = in.value * factor_;
+	}
+};
+
+STATE_MACHINE_PLUGIN(PluginInput, PluginOutput, 1, Scaler)
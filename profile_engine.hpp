@@ -0,0 +1,289 @@
+/*
+* \brief Many setpoint profiles made of ramps, soaks and holds, evaluated together
+*
+* A profile is a starting value followed by segments: a ramp changes the setpoint linearly to a target over a time, a
+* soak keeps it for a time and a hold keeps it until the run is resumed. When a profile is added, its segments are
+* turned into a table of durations, starting values and slopes, shared by all runs of the profile, so evaluating a
+* segment is a multiplication and an addition.
+*
+* A run is one execution of a profile. The runs are stored in arrays of their current segments, times spent in them and
+* setpoints, which the ProfileEngine updates in one pass every tick. A run only moves to the next segment when the
+* current one ends, so finding the segment takes constant time. Runs are referred to by small handles that contain only
+* their index.
+*/
+
+#ifndef STATE_MACHINE_PROFILE_ENGINE_H
+#define STATE_MACHINE_PROFILE_ENGINE_H
+
+#include "timed_object.hpp"
+#include <limits>
+#include <vector>
+#include <stdexcept>
+
+struct ProfileSegment {
+	enum Kind {
+		RAMP,
+		SOAK,
+		HOLD
+	};
+	Kind kind;
+	float target;
+	float duration; // In milliseconds
+
+	/*!
+	* \brief A segment changing the setpoint linearly to the target
+	*
+	* \param The setpoint at the end of the segment
+	* \param The duration in milliseconds, if zero, the setpoint jumps to the target
+	*/
+	static ProfileSegment ramp(float target, float duration)
+	{
+		return ProfileSegment{ RAMP, target, duration };
+	}
+
+	/*!
+	* \brief A segment keeping the setpoint
+	*
+	* \param The duration in milliseconds
+	*/
+	static ProfileSegment soak(float duration)
+	{
+		return ProfileSegment{ SOAK, 0, duration };
+	}
+
+	/*!
+	* \brief A segment keeping the setpoint until the run is resumed
+	*/
+	static ProfileSegment hold()
+	{
+		return ProfileSegment{ HOLD, 0, std::numeric_limits<float>::infinity() };
+	}
+};
+
+template<typename Input, typename Output>
+class ProfileEngine : public TimedObject<Input, Output> {
+	// Segments of all profiles
+	std::vector<float> durations_;
+	std::vector<float> starts_;
+	std::vector<float> slopes_;
+	// Profiles
+	std::vector<std::uint32_t> firstSegments_;
+	std::vector<std::uint32_t> lastSegments_;
+	// Runs
+	std::vector<std::uint32_t> profiles_;
+	std::vector<std::uint32_t> segments_;
+	std::vector<float> times_; // Since the beginning of the current segment
+	std::vector<std::uint8_t> running_;
+	std::vector<float> setpoints_;
+	bool started_ = false;
+
+	void finish(std::size_t run)
+	{
+		running_[run] = 0;
+		segments_[run] = lastSegments_[profiles_[run]];
+		// Holds have no end, their setpoint is constant
+		times_[run] = (durations_[segments_[run]] == std::numeric_limits<float>::infinity()) ? 0 : durations_[segments_[run]];
+	}
+
+public:
+	// Handles of profiles and runs, they are only indexes
+	struct Profile {
+		std::uint32_t index;
+	};
+	struct Run {
+		std::uint32_t index;
+	};
+
+	/*!
+	* \brief Adds a profile
+	*
+	* \param The setpoint at the beginning
+	* \param The segments, at least one
+	*
+	* \return The handle of the profile
+	*
+	* \note The execution must be paused to add profiles to an engine that is in a manager
+	*/
+	Profile addProfile(float start, const std::vector<ProfileSegment> &segments)
+	{
+		if(segments.empty())
+			throw std::invalid_argument("A profile needs at least one segment");
+		for(const ProfileSegment &segment : segments)
+			if(!(segment.duration >= 0))
+				throw std::invalid_argument("Durations of segments can't be negative");
+		firstSegments_.push_back(std::uint32_t(durations_.size()));
+		float value = start;
+		for(const ProfileSegment &segment : segments) {
+			durations_.push_back(segment.duration);
+			if(segment.kind == ProfileSegment::RAMP && segment.duration > 0) {
+				starts_.push_back(value);
+				slopes_.push_back((segment.target - value) / segment.duration);
+			} else {
+				if(segment.kind == ProfileSegment::RAMP)
+					value = segment.target;
+				starts_.push_back(value);
+				slopes_.push_back(0);
+			}
+			if(segment.kind == ProfileSegment::RAMP)
+				value = segment.target;
+		}
+		lastSegments_.push_back(std::uint32_t(durations_.size() - 1));
+		return Profile{ std::uint32_t(firstSegments_.size() - 1) };
+	}
+
+	/*!
+	* \brief Adds a run of a profile, it's stopped at the profile's starting setpoint
+	*
+	* \param The profile
+	*
+	* \return The handle of the run
+	*
+	* \note The execution must be paused to add runs to an engine that is in a manager
+	*/
+	Run addRun(Profile profile)
+	{
+		profiles_.push_back(profile.index);
+		segments_.push_back(firstSegments_[profile.index]);
+		times_.push_back(0);
+		running_.push_back(0);
+		setpoints_.push_back(starts_[firstSegments_[profile.index]]);
+		return Run{ std::uint32_t(profiles_.size() - 1) };
+	}
+
+	/*!
+	* \brief Starts a run from the beginning of its profile, the setpoint follows it from the next update
+	*
+	* \param The run
+	*/
+	void start(Run run)
+	{
+		segments_[run.index] = firstSegments_[profiles_[run.index]];
+		times_[run.index] = 0;
+		running_[run.index] = 1;
+	}
+
+	/*!
+	* \brief Stops a run, its setpoint stays where it is
+	*
+	* \param The run
+	*/
+	void stop(Run run)
+	{
+		running_[run.index] = 0;
+	}
+
+	/*!
+	* \brief Continues a stopped run or moves a run that is in a hold segment to the next segment
+	*
+	* \param The run
+	*/
+	void resume(Run run)
+	{
+		std::uint32_t &segment = segments_[run.index];
+		if(running_[run.index] && durations_[segment] == std::numeric_limits<float>::infinity()) {
+			if(segment == lastSegments_[profiles_[run.index]])
+				finish(run.index);
+			else {
+				segment++;
+				times_[run.index] = 0;
+			}
+		} else if(!running_[run.index] && times_[run.index] < durations_[segment])
+			running_[run.index] = 1;
+	}
+
+	/*!
+	* \brief Returns the setpoint of a run after the last update
+	*
+	* \param The run
+	*
+	* \return The setpoint
+	*/
+	float setpoint(Run run) const
+	{
+		return setpoints_[run.index];
+	}
+
+	/*!
+	* \brief Checks if a run is running, it stops when it reaches the end of its profile
+	*
+	* \param The run
+	*
+	* \return If it is
+	*/
+	bool running(Run run) const
+	{
+		return running_[run.index];
+	}
+
+	/*!
+	* \brief Returns the segment a run is in
+	*
+	* \param The run
+	*
+	* \return The index of the segment in the profile, starting from 0
+	*/
+	std::size_t segment(Run run) const
+	{
+		return segments_[run.index] - firstSegments_[profiles_[run.index]];
+	}
+
+	/*!
+	* \brief Updates the setpoints of all runs
+	*
+	* \param The time since the last update in milliseconds
+	*/
+	void update(float step)
+	{
+		const std::size_t count = profiles_.size();
+		{
+			float *times = times_.data();
+			const std::uint8_t *running = running_.data();
+			for(std::size_t i = 0; i < count; i++)
+				times[i] += running[i] ? step : 0.0f;
+		}
+		// Runs move to the next segment rarely, the loop usually only compares
+		for(std::size_t i = 0; i < count; i++) {
+			while(running_[i] && times_[i] >= durations_[segments_[i]]) {
+				if(segments_[i] == lastSegments_[profiles_[i]]) {
+					finish(i);
+					break;
+				}
+				times_[i] -= durations_[segments_[i]];
+				segments_[i]++;
+			}
+		}
+		{
+			const std::uint32_t *segments = segments_.data();
+			const float *times = times_.data();
+			const float *starts = starts_.data();
+			const float *slopes = slopes_.data();
+			float *setpoints = setpoints_.data();
+			for(std::size_t i = 0; i < count; i++)
+				setpoints[i] = starts[segments[i]] + slopes[segments[i]] * times[i];
+		}
+	}
+
+	/*!
+	* \brief Updates all runs by the time since the engine's previous tick
+	*/
+	virtual void tick(const Input &, Output &)
+	{
+		if(started_)
+			update(float(this->lastPeriod()));
+		else
+			update(0);
+		started_ = true;
+	}
+
+	/*!
+	* \brief Returns the number of runs
+	*
+	* \return The number of runs of all profiles
+	*/
+	std::size_t size() const
+	{
+		return profiles_.size();
+	}
+};
+
+#endif // STATE_MACHINE_PROFILE_ENGINE_H
@@ -0,0 +1,507 @@
+/*
+* \brief Replication of a StateMachineManager's state to a hot standby in another process
+*
+* The primary sends the changes of the input, the output and the state of all its objects after every tick through a
+* local socket. The follower applies them to its own manager, which must be paused and contain the same objects in the
+* same order, and can take over at any moment by being promoted, which unpauses its manager.
+*
+* Every message contains the tick number and three sections: the input, the output and the objects. The objects' section
+* consists of each object's timing, its state if it's a StateMachine and whatever its saveState() method saves. Each section is sent as its size
+* and the runs of bytes that differ from the previous message, compared in blocks. If the follower doesn't read the
+* messages fast enough, the primary skips ticks until the socket accepts data again and then sends all changes since
+* the last sent message, so the primary never blocks. If the manager tracks the output's dirty pages, the output's
+* section consists of the pages written since the last sent message and the output isn't compared.
+*
+* The input and output structures must be trivially copyable. Available only on Linux.
+*/
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "state_machine.hpp"
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+template<typename Input, typename Output>
+class ReplicationPrimary {
+	static_assert(std::is_trivially_copyable<Input>::value && std::is_trivially_copyable<Output>::value,
+			"Replicated structures must be trivially copyable");
+	static constexpr std::size_t BLOCK = 64;
+
+	StateMachineManager<Input, Output> &manager_;
+	std::string path_;
+	int listener_ = -1;
+	int follower_ = -1;
+	std::vector<unsigned char> previous_[3];
+	std::vector<unsigned char> current_[3];
+	std::vector<unsigned char> message_;
+	std::vector<unsigned char> machineState_;
+	std::vector<unsigned char> state_;
+	std::vector<unsigned char> pendingPages_; // Output pages written since the last sent message, if they're tracked
+	bool fullOutput_ = true;
+	std::size_t sent_ = 0;
+	std::atomic<long long> ticks_;
+	std::atomic<long long> messages_;
+	std::atomic<long long> overhead_; // In nanoseconds
+
+	static void appendInteger(std::vector<unsigned char> &to, std::uint64_t value, int bytes)
+	{
+		std::size_t position = to.size();
+		to.resize(position + bytes);
+		for(int i = 0; i < bytes; i++)
+			to[position + i] = (unsigned char)(value >> (8 * i));
+	}
+
+	static void appendDelta(std::vector<unsigned char> &to, const std::vector<unsigned char> &previous, const std::vector<unsigned char> &current)
+	{
+		appendInteger(to, current.size(), 4);
+		std::size_t countPosition = to.size();
+		appendInteger(to, 0, 4);
+		std::uint32_t runs = 0;
+		bool full = (previous.size() != current.size());
+		std::size_t start = 0;
+		while(start < current.size()) {
+			std::size_t length = std::min(std::size_t(BLOCK), current.size() - start);
+			if(!full && !std::memcmp(previous.data() + start, current.data() + start, length)) {
+				start += length;
+				continue;
+			}
+			// Extend the run over the following changed blocks
+			std::size_t end = start + length;
+			while(end < current.size()) {
+				std::size_t next = std::min(std::size_t(BLOCK), current.size() - end);
+				if(!full && !std::memcmp(previous.data() + end, current.data() + end, next))
+					break;
+				end += next;
+			}
+			appendInteger(to, start, 4);
+			appendInteger(to, end - start, 4);
+			to.insert(to.end(), current.begin() + start, current.begin() + end);
+			runs++;
+			start = end;
+		}
+		for(int i = 0; i < 4; i++)
+			to[countPosition + i] = (unsigned char)(runs >> (8 * i));
+	}
+
+	// Like appendDelta(), but sends the output pages written since the last message without comparing anything
+	void appendPages(std::vector<unsigned char> &to, const Output &out, std::size_t pageSize)
+	{
+		const unsigned char *output = reinterpret_cast<const unsigned char *>(&out);
+		appendInteger(to, sizeof(Output), 4);
+		std::size_t countPosition = to.size();
+		appendInteger(to, 0, 4);
+		std::uint32_t runs = 0;
+		std::size_t page = 0;
+		while(page < pendingPages_.size()) {
+			if(!pendingPages_[page] && !fullOutput_) {
+				page++;
+				continue;
+			}
+			std::size_t end = page + 1;
+			while(end < pendingPages_.size() && (pendingPages_[end] || fullOutput_))
+				end++;
+			std::size_t start = page * pageSize;
+			std::size_t length = std::min(end * pageSize, sizeof(Output)) - start;
+			appendInteger(to, start, 4);
+			appendInteger(to, length, 4);
+			to.insert(to.end(), output + start, output + start + length);
+			runs++;
+			page = end;
+		}
+		for(int i = 0; i < 4; i++)
+			to[countPosition + i] = (unsigned char)(runs >> (8 * i));
+		std::fill(pendingPages_.begin(), pendingPages_.end(), 0);
+		fullOutput_ = false;
+	}
+
+	void saveObjects(std::vector<unsigned char> &to)
+	{
+		std::size_t previousSize = to.size();
+		to.clear();
+		to.reserve(previousSize);
+		std::vector<unsigned char> &machineState = machineState_;
+		std::vector<unsigned char> &state = state_;
+		for(auto &machine : manager_.machines_) {
+			TimedObject<Input, Output> &object = *machine.second;
+			machineState.clear();
+			object.saveStateMachine(machineState);
+			state.clear();
+			object.saveState(state);
+			const typename TimedObject<Input, Output>::FrameClock &clock = *object.clock_;
+			appendInteger(to, std::uint64_t(clock.time_), 8);
+			appendInteger(to, std::uint32_t(clock.time_ - clock.previous_), 4);
+			appendInteger(to, clock.ticks_, 8);
+			appendInteger(to, machineState.size(), 4);
+			to.insert(to.end(), machineState.begin(), machineState.end());
+			appendInteger(to, state.size(), 4);
+			to.insert(to.end(), state.begin(), state.end());
+		}
+	}
+
+	// Returns false if the follower disconnected
+	bool flush()
+	{
+		while(sent_ < message_.size()) {
+			ssize_t written = ::send(follower_, message_.data() + sent_, message_.size() - sent_, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(written < 0)
+				return (errno == EAGAIN || errno == EWOULDBLOCK);
+			sent_ += written;
+		}
+		message_.clear();
+		sent_ = 0;
+		return true;
+	}
+
+	void replicate(const Input &in, const Output &out)
+	{
+		auto start = std::chrono::steady_clock::now();
+		ticks_.fetch_add(1, std::memory_order_relaxed);
+		const DirtyPageRegion *pages = manager_.dirtyPages();
+		if(pages) {
+			pendingPages_.resize(pages->pages());
+			pages->forEachDirtyRun([this, pages](std::size_t offset, std::size_t length) {
+				std::size_t first = offset / pages->pageSize();
+				std::fill(pendingPages_.begin() + first, pendingPages_.begin() + first + (length + pages->pageSize() - 1) / pages->pageSize(), 1);
+			});
+		}
+		if(follower_ < 0) {
+			follower_ = ::accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			for(auto &previous : previous_)
+				previous.clear();
+			fullOutput_ = true;
+			message_.clear();
+			sent_ = 0;
+		}
+		if(follower_ >= 0) {
+			bool connected = flush();
+			// If the last message wasn't sent whole, skip this tick, the next message will contain its changes
+			if(connected && message_.empty()) {
+				const unsigned char *input = reinterpret_cast<const unsigned char *>(&in);
+				const unsigned char *output = reinterpret_cast<const unsigned char *>(&out);
+				current_[0].assign(input, input + sizeof(Input));
+				if(!pages)
+					current_[1].assign(output, output + sizeof(Output));
+				saveObjects(current_[2]);
+				appendInteger(message_, 0, 4);
+				appendInteger(message_, std::uint64_t(manager_.tickOrder_), 8);
+				for(int i = 0; i < 3; i++) {
+					if(i == 1 && pages) {
+						appendPages(message_, out, pages->pageSize());
+						continue;
+					}
+					appendDelta(message_, previous_[i], current_[i]);
+					previous_[i].swap(current_[i]);
+				}
+				std::uint32_t length = std::uint32_t(message_.size() - 4);
+				for(int i = 0; i < 4; i++)
+					message_[i] = (unsigned char)(length >> (8 * i));
+				connected = flush();
+				messages_.fetch_add(1, std::memory_order_relaxed);
+			}
+			if(!connected) {
+				::close(follower_);
+				follower_ = -1;
+			}
+		}
+		overhead_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(),
+				std::memory_order_relaxed);
+	}
+
+public:
+	/*!
+	* \brief The constructor, starts listening for a follower and sets the manager's tick trigger to replicate to it
+	*
+	* \param The manager to replicate
+	* \param Path of the Unix domain socket to listen on, an existing file of that name is removed
+	*
+	* \note The execution must be paused, other tick triggers are replaced. Throws std::runtime_error if the socket
+	* cannot be set up
+	*/
+	ReplicationPrimary(StateMachineManager<Input, Output> &manager, const std::string &path) :
+		manager_(manager),
+		path_(path),
+		ticks_(0),
+		messages_(0),
+		overhead_(0)
+	{
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if(path.size() >= sizeof(address.sun_path))
+			throw std::runtime_error("Replication socket path too long");
+		std::strcpy(address.sun_path, path.c_str());
+		::unlink(path.c_str());
+		listener_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(listener_ < 0 || ::bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || ::listen(listener_, 1) < 0) {
+			std::string problem = std::strerror(errno);
+			if(listener_ >= 0)
+				::close(listener_);
+			throw std::runtime_error("Cannot listen for replication followers: " + problem);
+		}
+		manager_.setTickTrigger([this](const Input &in, const Output &out) {
+			replicate(in, out);
+		});
+	}
+
+	/*!
+	* \brief Destructor, closes the connection and removes the socket
+	*
+	* \note The execution must be paused or the tick trigger replaced before destroying this
+	*/
+	~ReplicationPrimary()
+	{
+		if(follower_ >= 0)
+			::close(follower_);
+		::close(listener_);
+		::unlink(path_.c_str());
+	}
+
+	/*!
+	* \brief Returns the number of messages sent
+	*
+	* \return The number of messages
+	*/
+	long long messages() const
+	{
+		return messages_.load(std::memory_order_relaxed);
+	}
+
+	/*!
+	* \brief Returns the average time replication added to a tick
+	*
+	* \return The time in microseconds
+	*
+	* \note The value is exact only if the execution is paused
+	*/
+	double overhead() const
+	{
+		long long ticks = ticks_.load(std::memory_order_relaxed);
+		return ticks ? overhead_.load(std::memory_order_relaxed) / 1000.0 / ticks : 0;
+	}
+};
+
+template<typename Input, typename Output>
+class ReplicationFollower {
+	static_assert(std::is_trivially_copyable<Input>::value && std::is_trivially_copyable<Output>::value,
+			"Replicated structures must be trivially copyable");
+
+	StateMachineManager<Input, Output> &manager_;
+	int socket_ = -1;
+	int stop_[2] = { -1, -1 };
+	std::vector<unsigned char> images_[3];
+	std::atomic<long long> messages_;
+	std::atomic<bool> connected_;
+	std::thread thread_;
+
+	static std::uint64_t readInteger(const unsigned char *&from, int bytes)
+	{
+		std::uint64_t value = 0;
+		for(int i = 0; i < bytes; i++)
+			value |= std::uint64_t(*from++) << (8 * i);
+		return value;
+	}
+
+	// Returns false if the message is malformed
+	static bool applyDelta(const unsigned char *&from, const unsigned char *end, std::vector<unsigned char> &image)
+	{
+		if(end - from < 8)
+			return false;
+		std::size_t size = std::size_t(readInteger(from, 4));
+		std::uint32_t runs = std::uint32_t(readInteger(from, 4));
+		image.resize(size);
+		for(std::uint32_t i = 0; i < runs; i++) {
+			if(end - from < 8)
+				return false;
+			std::size_t offset = std::size_t(readInteger(from, 4));
+			std::size_t length = std::size_t(readInteger(from, 4));
+			if(offset + length > size || std::size_t(end - from) < length)
+				return false;
+			std::memcpy(image.data() + offset, from, length);
+			from += length;
+		}
+		return true;
+	}
+
+	bool loadObjects()
+	{
+		const unsigned char *from = images_[2].data();
+		const unsigned char *end = from + images_[2].size();
+		for(auto &machine : manager_.machines_) {
+			if(end - from < 24)
+				return false;
+			TimedObject<Input, Output> &object = *machine.second;
+			// Objects with the same period share the clock, so it's written several times with the same values
+			typename TimedObject<Input, Output>::FrameClock &clock = *object.clock_;
+			clock.time_ = (long long)(readInteger(from, 8));
+			clock.previous_ = clock.time_ - int(std::uint32_t(readInteger(from, 4)));
+			clock.ticks_ = readInteger(from, 8);
+			clock.fresh_ = nullptr; // The objects continue the primary's timing
+			std::size_t size = std::size_t(readInteger(from, 4));
+			if(std::size_t(end - from) < size + 4)
+				return false;
+			object.loadStateMachine(from, size);
+			from += size;
+			size = std::size_t(readInteger(from, 4));
+			if(std::size_t(end - from) < size)
+				return false;
+			object.loadState(from, size);
+			from += size;
+		}
+		return true;
+	}
+
+	bool apply(const unsigned char *from, const unsigned char *end)
+	{
+		if(end - from < 8)
+			return false;
+		std::uint64_t tickOrder = readInteger(from, 8);
+		for(auto &image : images_)
+			if(!applyDelta(from, end, image))
+				return false;
+		if(images_[0].size() != sizeof(Input) || images_[1].size() != sizeof(Output))
+			return false;
+		{
+			auto in = manager_.input();
+			std::memcpy(&*in, images_[0].data(), sizeof(Input));
+		}
+		{
+			std::lock_guard<std::mutex> outputLock(manager_.outputMutex_);
+			std::memcpy(&manager_.output_, images_[1].data(), sizeof(Output));
+		}
+		manager_.tickOrder_ = int(tickOrder);
+		messages_.fetch_add(1, std::memory_order_relaxed);
+		return loadObjects();
+	}
+
+	void run()
+	{
+		std::vector<unsigned char> received;
+		unsigned char buffer[65536];
+		pollfd polled[2] = { { socket_, POLLIN, 0 }, { stop_[0], POLLIN, 0 } };
+		while(true) {
+			if(::poll(polled, 2, -1) < 0) {
+				if(errno == EINTR)
+					continue; // The events weren't updated
+				break;
+			}
+			if(polled[1].revents)
+				break;
+			if(!polled[0].revents)
+				continue;
+			ssize_t got = ::recv(socket_, buffer, sizeof(buffer), 0);
+			if(got <= 0)
+				break;
+			received.insert(received.end(), buffer, buffer + got);
+			std::size_t position = 0;
+			bool valid = true;
+			while(received.size() - position >= 4) {
+				const unsigned char *header = received.data() + position;
+				std::size_t length = std::size_t(readInteger(header, 4));
+				if(received.size() - position - 4 < length)
+					break;
+				valid = apply(received.data() + position + 4, received.data() + position + 4 + length);
+				position += 4 + length;
+				if(!valid)
+					break;
+			}
+			if(!valid)
+				break;
+			received.erase(received.begin(), received.begin() + position);
+		}
+		connected_ = false;
+	}
+
+public:
+	/*!
+	* \brief The constructor, connects to the primary and starts applying its state to the manager
+	*
+	* \param The manager, it must be paused and contain the same objects in the same order as the primary's
+	* \param Path of the Unix domain socket the primary listens on
+	*
+	* \note Throws std::runtime_error if it cannot connect
+	*/
+	ReplicationFollower(StateMachineManager<Input, Output> &manager, const std::string &path) :
+		manager_(manager),
+		messages_(0),
+		connected_(true)
+	{
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if(path.size() >= sizeof(address.sun_path))
+			throw std::runtime_error("Replication socket path too long");
+		std::strcpy(address.sun_path, path.c_str());
+		socket_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(socket_ < 0 || ::connect(socket_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || ::pipe(stop_) < 0) {
+			std::string problem = std::strerror(errno);
+			if(socket_ >= 0)
+				::close(socket_);
+			throw std::runtime_error("Cannot connect to the replication primary: " + problem);
+		}
+		thread_ = std::thread([this]() {
+			run();
+		});
+	}
+
+	/*!
+	* \brief Destructor, stops following
+	*/
+	~ReplicationFollower()
+	{
+		stop();
+		::close(socket_);
+		::close(stop_[0]);
+		::close(stop_[1]);
+	}
+
+	/*!
+	* \brief Stops following the primary, the manager keeps the last received state
+	*/
+	void stop()
+	{
+		if(thread_.joinable()) {
+			// The thread uses the descriptors and the manager, so it must end before they are closed or used by others,
+			// a byte always fits in the empty pipe and only an interruption can make the write fail
+			char stopping = 0;
+			while(::write(stop_[1], &stopping, 1) < 0 && errno == EINTR);
+			thread_.join();
+		}
+	}
+
+	/*!
+	* \brief Stops following and unpauses the manager, continuing from the last received tick
+	*/
+	void promote()
+	{
+		stop();
+		manager_.unpause();
+	}
+
+	/*!
+	* \brief Returns whether the primary is still connected, if not, the follower should be promoted
+	*
+	* \return If connected
+	*/
+	bool connected() const
+	{
+		return connected_;
+	}
+
+	/*!
+	* \brief Returns the number of messages applied
+	*
+	* \return The number of messages
+	*/
+	long long messages() const
+	{
+		return messages_.load(std::memory_order_relaxed);
+	}
+};
+
+#endif // REPLICATION_H
@@ -19,230 +19,223 @@
 #define STATE_MACHINE_H
 
 #include "looping_thread/looping_thread.hpp"
+#include "timed_object.hpp"
+#include "channel_array.hpp"
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <future>
+#include <stdexcept>
+#include <cstring>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <set>
+#include <limits>
+#ifdef __linux__
+#include "dirty_pages.hpp"
+#include "huge_pages.hpp"
+#endif
 
 #include <iostream>
 
-template<typename Input, typename Output>
-class TimedObject {
-protected:
-	long long timeOfLastFreeze_;
-	int timeIncrease_;
-	virtual void setupTurn(long long time)
+#if defined(__GNUC__) && !defined(STATE_MACHINE_NO_PREFETCH)
+#define STATE_MACHINE_PREFETCH
+#endif
+
+template<typename T>
+class ProtectedReturn {
+	std::function<void()> onRelease_;
+	T *content_;
+	ProtectedReturn(T *content, std::function<void()> onRelease) :
+		content_(content), onRelease_(onRelease)
 	{
-		timeIncrease_ = int(time - timeOfLastFreeze_);
-		timeOfLastFreeze_ = time;
 	}
+	template<typename T2>
+	ProtectedReturn(const ProtectedReturn<T2> &) = delete;
+	template<typename T2>
+	ProtectedReturn<T> &operator=(const ProtectedReturn<T2> &) = delete;
 public:
 	/*!
-	* \brief Returns the time between the current step and the previous one
-	*
-	* \return The time in milliseconds
+	* \brief Destructor, stops deferring the ticks
 	*/
-	int lastPeriod()
+	~ProtectedReturn()
 	{
-		return timeIncrease_;
+		onRelease_();
 	}
 	
 	/*!
-	* \brief Returns the current time, kept at once value during the whole tick
-	*
-	* \return The time in milliseconds
+	* \brief Gives access to the structure
 	*/
-	long long frameTime()
+	T *operator->()
 	{
-		return timeOfLastFreeze_;
-	};
-	
-	class Timer {
-		long long since_;
-		TimedObject<Input, Output> *parent_;
-		Timer(long long since, TimedObject<Input, Output> *parent) : since_(since), parent_(parent)
-		{
-		}
-		template<typename In, typename Out> friend class TimedObject;
-	public:
+		return content_;
+	}
 	
-		/*!
-		* \brief Default constructor, default constructed or disabled timer always returns 0 as time
-		*/
-		Timer() : parent_(nullptr)
-		{
-		}
-		
-		/*!
-		* \brief Returns the time since this timer was created
-		*
-		* \return The time in milliseconds
-		*/
-		long long time()
-		{
-			if(!parent_) return 0;
-			return parent_->timeOfLastFreeze_ - since_;
-		}
-		
-		/*!
-		* \brief Returns uf the time is active, that is, wasn't default-constructed or disabled
-		*
-		* \return If it is enabled
-		*/
-		bool active()
-		{
-			return (parent_ != nullptr);
-		}
-		
-		/*!
-		* \brief Disables the timer so that it will not be active and always return time 0
-		*/
-		void deactivate()
-		{
-			parent_ = nullptr;
-		}
-	};
+	/*!
+	* \brief Gives access to the const structure
+	*/
+	const T *operator->() const
+	{
+		return content_;
+	}
 	
 	/*!
-	* \brief Returns a timer measuring time from the moment it was returned
+	* \brief Gives access to the structure
 	*
-	* \return The timer, use its getTime() method to get the time in milliseconds
+	* \note This is meant to be used to assign into it to replace the whole structure and destroy this object in the following line
 	*/
-	Timer makeTimer()
+	T &operator*()
 	{
-		return Timer(timeOfLastFreeze_, this);
+		return *content_;
 	}
 	
 	/*!
-	* \brief Overload this function with a function you want to be called periodically
+	* \brief Gives access to the structure
 	*
-	* \param The input structure, its type is the first template argument
-	* \param The output structure, its type is the second template argument
+	* \note This is meant to be used to assign the whole structure into a copy and destroy this object in the following line
 	*/
-	virtual void tick(const Input &in, Output &out) = 0;
+	const T &operator*() const
+	{
+		return *content_;
+	}
 	
 	template<typename In, typename Out> friend class StateMachineManager;
+	template<typename In, typename Out, int BasePeriod, typename... Entries> friend class StaticStateMachineManager;
 };
 
-template<typename Input, typename Output, typename State>
-class StateMachine : public TimedObject<Input, Output> {
-	long long stateTimer_ = 0;
-	enum class StateChangedType : std::uint8_t  {
-		THIS_TICK,
-		PREVIOUS_TICK,
-		BEFORE
+template<typename T>
+class InputSegment {
+	static constexpr std::uint8_t INDEX_MASK = 0x3;
+	static constexpr std::uint8_t FRESH = 0x4;
+	struct Slot {
+		T value;
+		std::uint64_t version;
 	};
-	StateChangedType stateChanged_ = StateChangedType::THIS_TICK;
-	virtual void setupTurn(long long time)
-	{
-		TimedObject<Input, Output>::setupTurn(time);
-		stateTimer_ += TimedObject<Input, Output>::timeIncrease_;
-		if(stateChanged_ == StateChangedType::THIS_TICK)
-			stateChanged_ = StateChangedType::PREVIOUS_TICK;
-		else if(stateChanged_ == StateChangedType::PREVIOUS_TICK)
-			stateChanged_ = StateChangedType::BEFORE;
-	}
-	State state_;
+	Slot slots_[3];
+	std::atomic<std::uint8_t> middle_;
+	std::uint8_t back_ = 0; // Owned by the producer
+	std::uint8_t front_ = 2; // Owned by the manager's thread
+	std::uint64_t written_ = 0;
 	
-protected:
-	/*!
-	* \brief Returns the current state of the automaton, the state's type is set as the third template argument
-	*
-	* \return The state
-	*
-	* \note Must be called in the final object's constructor to set its initial state
-	*/
-	State state()
+	InputSegment(const T &initial) :
+		slots_{ { initial, 0 }, { initial, 0 }, { initial, 0 } },
+		middle_(1)
 	{
-		return state_;
 	}
 	
-	/*!
-	* \brief Changes the state of the automaton
-	*
-	* \param The new state
-	*/
-	void state(State newState)
+	std::uint64_t collect(T &destination)
 	{
-		if(state_ == newState) return;
-		state_ = newState;
-		stateChanged_ = StateChangedType::THIS_TICK;
-		stateTimer_ = 0;
+		if(middle_.load(std::memory_order_relaxed) & FRESH)
+			front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX_MASK;
+		destination = slots_[front_].value;
+		return slots_[front_].version;
 	}
 	
+public:
 	/*!
-	* \brief Returns the time since the last change of state
+	* \brief Publishes a new value of the segment, it will be used from the next tick on, never blocks
 	*
-	* \return The time in milliseconds
+	* \param The new value
+	*
+	* \return The version of the published value, increased by one with every call
+	*
+	* \note Only one thread may publish into a segment
 	*/
-	long long timeInState()
+	std::uint64_t publish(const T &value)
 	{
-		return stateTimer_;
+		slots_[back_].value = value;
+		slots_[back_].version = ++written_;
+		back_ = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+		return written_;
 	}
 	
 	/*!
-	* \brief Returns true if the automaton is running its first tick in the current state
+	* \brief Returns the version of the value that was put into the input of the current tick
 	*
-	* \return If this is the first tick after state change
+	* \return The version, 0 if nothing was published yet
+	*
+	* \note Meant to be called from the objects' tick() methods
 	*/
-	bool afterStateChange()
+	std::uint64_t version() const
 	{
-		return (stateChanged_ == StateChangedType::PREVIOUS_TICK);
+		return slots_[front_].version;
 	}
+	
+	template<typename In, typename Out> friend class StateMachineManager;
 };
 
 template<typename T>
-class ProtectedReturn {
-	std::function<void()> onRelease_;
-	T *content_;
-	ProtectedReturn(T *content, std::function<void()> onRelease) :
-		content_(content), onRelease_(onRelease)
-	{
-	}
-	template<typename T2>
-	ProtectedReturn(const ProtectedReturn<T2> &) = delete;
-	template<typename T2>
-	ProtectedReturn<T> &operator=(const ProtectedReturn<T2> &) = delete;
-public:
-	/*!
-	* \brief Destructor, stops deferring the ticks
-	*/
-	~ProtectedReturn()
+class PublishedSnapshot {
+	std::atomic<std::uint64_t> sequence_;
+	T value_;
+	
+	PublishedSnapshot(const T &initial) :
+		sequence_(0),
+		value_(initial)
 	{
-		onRelease_();
+		// Readers may copy the value while it's being written and discard the copy afterwards
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable structures can be published as snapshots");
 	}
 	
-	/*!
-	* \brief Gives access to the structure
-	*/
-	T *operator->()
+	void publish(const T &value)
 	{
-		return content_;
+		std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+		sequence_.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		value_ = value;
+		sequence_.store(sequence + 2, std::memory_order_release);
 	}
 	
-	/*!
-	* \brief Gives access to the const structure
-	*/
-	const T *operator->() const
+	// Copies only the given parts, the rest is the same as in the previous value
+	template<typename ForEachRun>
+	void publishParts(const T &value, ForEachRun forEachRun)
 	{
-		return content_;
+		std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+		sequence_.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		unsigned char *to = reinterpret_cast<unsigned char *>(&value_);
+		const unsigned char *from = reinterpret_cast<const unsigned char *>(&value);
+		forEachRun([to, from](std::size_t offset, std::size_t length) {
+			std::memcpy(to + offset, from + offset, length);
+		});
+		sequence_.store(sequence + 2, std::memory_order_release);
 	}
 	
+public:
 	/*!
-	* \brief Gives access to the structure
+	* \brief Copies the last published value, the publisher never waits for this, but this may have to retry if the
+	* value is being published at the moment
 	*
-	* \note This is meant to be used to assign into it to replace the whole structure and destroy this object in the following line
+	* \param The structure to copy the value into
+	*
+	* \return The version of the value that was copied
 	*/
-	T &operator*()
+	std::uint64_t read(T &destination) const
 	{
-		return *content_;
+		while(true) {
+			std::uint64_t sequence = sequence_.load(std::memory_order_acquire);
+			if(sequence & 1) {
+				std::this_thread::yield();
+				continue;
+			}
+			destination = value_;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(sequence_.load(std::memory_order_relaxed) == sequence)
+				return sequence / 2;
+		}
 	}
 	
 	/*!
-	* \brief Gives access to the structure
+	* \brief Returns the version of the last published value, increased by one with every tick
 	*
-	* \note This is meant to be used to assign the whole structure into a copy and destroy this object in the following line
+	* \return The version, can be used to avoid copying a value that was already read
 	*/
-	const T &operator*() const
+	std::uint64_t version() const
 	{
-		return *content_;
+		return sequence_.load(std::memory_order_acquire) / 2;
 	}
 	
 	template<typename In, typename Out> friend class StateMachineManager;
@@ -250,7 +243,32 @@ public:
 
 template<typename Input, typename Output>
 class StateMachineManager {
-	std::vector<std::pair<int, std::shared_ptr<TimedObject<Input, Output>>>> machines_;
+	typedef std::vector<std::pair<int, std::shared_ptr<TimedObject<Input, Output>>>> Machines;
+	typedef typename TimedObject<Input, Output>::FrameClock FrameClock;
+	typedef std::vector<std::pair<int, std::shared_ptr<FrameClock>>> Clocks; // One for each divisor of periods, never removed
+	struct OnlineChange {
+		Machines machines;
+		Clocks clocks;
+		std::vector<unsigned int> order;
+		std::function<void()> apply;
+		std::promise<void> done;
+	};
+	// The copies the objects work with during a tick
+	struct Working {
+		Input input;
+		Output output;
+		Working(const Input &input, const Output &output) :
+			input(input),
+			output(output)
+		{
+		}
+	};
+	Machines machines_;
+	std::vector<unsigned int> order_; // Indexes into machines_ in the order of execution, empty if it's the order of insertion
+	std::vector<std::pair<TimedObject<Input, Output> *, TimedObject<Input, Output> *>> dependencies_;
+	bool groupedByType_ = false;
+	bool orderedByAddress_ = false;
+	bool orderChanged_ = false;
 	Input input_;
 	Output output_;
 	int tickOrder_ = 0;
@@ -259,34 +277,318 @@ class StateMachineManager {
 	std::mutex inputMutex_;
 	std::mutex outputMutex_;
 	std::mutex pauseMutex_;
+	std::mutex changeMutex_;
+	std::atomic<OnlineChange *> pendingChange_;
+	std::atomic<long long> runTime_; // Of the objects, in nanoseconds
+	std::atomic<long long> runs_;
 	std::function<void(Input &)> inputTrigger_;
 	std::function<void(const Output &)> outputTrigger_;
+	std::function<void(const Input &, const Output &)> tickTrigger_;
+	std::vector<std::function<void(Input &)>> segments_;
+	std::vector<std::function<void(Input &)>> stages_;
+	std::vector<std::function<void(Output &)>> outputStages_;
+	struct ChannelArrayPart {
+		std::size_t offset;
+		std::size_t size;
+		std::function<void(Output &)> clear;
+		std::function<void(const Output &, const std::function<void(std::size_t, std::size_t)> &)> forEachChange;
+	};
+	std::vector<ChannelArrayPart> channelArrays_; // Sorted by their offsets
+	std::shared_ptr<PublishedSnapshot<Output>> snapshot_;
+	std::shared_ptr<Working> working_;
+	std::vector<TimedObject<Input, Output> *> due_;
+	Clocks clocks_;
+	unsigned int prefetchDistance_ = 0;
+#ifdef __linux__
+	std::unique_ptr<DirtyPageImage<Output>> outputPages_;
+#endif
 	std::unique_ptr<LoopingThread> loop_;
 	void tick()
 	{
-		Input input;
-		Output output = output_; // It's const in the other thread
+		if(pendingChange_.load(std::memory_order_relaxed)) {
+			OnlineChange *change = pendingChange_.exchange(nullptr, std::memory_order_acq_rel);
+			bool applied = true;
+			if(change->apply) {
+				try {
+					change->apply();
+				} catch(...) {
+					// The change isn't installed, the requesting thread gets the exception
+					applied = false;
+					change->done.set_exception(std::current_exception());
+				}
+			}
+			if(applied) {
+				machines_.swap(change->machines); // The old contents are destroyed by the thread that requested the change
+				clocks_.swap(change->clocks);
+				order_.swap(change->order);
+				change->done.set_value();
+			}
+		}
+		Input &input = working_->input;
 		if(inputTrigger_)
 			inputTrigger_(input_);
 		{
 			std::unique_lock<std::mutex> lock(inputMutex_);
 			input = input_;
 		}
+		for(auto &segment : segments_)
+			segment(input);
+		for(auto &stage : stages_)
+			stage(input);
+#ifdef __linux__
+		if(outputPages_) {
+			outputPages_->track();
+			for(auto &part : channelArrays_)
+				part.clear(outputPages_->value());
+			runObjects(input, outputPages_->value());
+			for(auto &stage : outputStages_)
+				stage(outputPages_->value());
+			{
+				std::unique_lock<std::mutex> lock(outputMutex_);
+				outputPages_->copyDirty(output_);
+			}
+			if(snapshot_)
+				snapshot_->publishParts(outputPages_->value(), [this](auto copy) {
+					outputPages_->forEachDirtyRun(copy);
+				});
+			finishTick(input, outputPages_->value());
+			return;
+		}
+#endif
+		Output &output = working_->output;
+		if(channelArrays_.empty())
+			output = output_; // It's const in the other thread
+		for(auto &part : channelArrays_)
+			part.clear(output);
+		runObjects(input, output);
+		for(auto &stage : outputStages_)
+			stage(output);
+		if(channelArrays_.empty()) {
+			{
+				std::unique_lock<std::mutex> lock(outputMutex_);
+				output_ = output;
+			}
+			if(snapshot_)
+				snapshot_->publish(output);
+		} else {
+			{
+				std::unique_lock<std::mutex> lock(outputMutex_);
+				unsigned char *to = reinterpret_cast<unsigned char *>(&output_);
+				const unsigned char *from = reinterpret_cast<const unsigned char *>(&output);
+				forEachChangedPart(output, [to, from](std::size_t offset, std::size_t length) {
+					std::memcpy(to + offset, from + offset, length);
+				});
+			}
+			if(snapshot_)
+				snapshot_->publishParts(output, [this, &output](auto copy) {
+					forEachChangedPart(output, copy);
+				});
+		}
+		finishTick(input, output);
+	}
+	// Calls the function with the offsets and lengths of the parts of the output outside channel arrays and of the
+	// changed parts of channel arrays
+	template<typename Function>
+	void forEachChangedPart(const Output &output, Function function)
+	{
+		std::size_t position = 0;
+		for(const ChannelArrayPart &part : channelArrays_) {
+			if(part.offset > position)
+				function(position, part.offset - position);
+			part.forEachChange(output, [&function, &part](std::size_t offset, std::size_t length) {
+				function(part.offset + offset, length);
+			});
+			position = part.offset + part.size;
+		}
+		if(sizeof(Output) > position)
+			function(position, sizeof(Output) - position);
+	}
+	void runObjects(const Input &input, Output &output)
+	{
+		auto began = std::chrono::steady_clock::now();
 		long long start = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-		for(unsigned int i = 0; i < machines_.size(); i++)
-			if(tickOrder_ % machines_[i].first == 0) {
-				machines_[i].second->setupTurn(start);
-				machines_[i].second->tick(input, output);
+		for(auto &clock : clocks_)
+			if(tickOrder_ % clock.first == 0)
+				clock.second->advance(start);
+		due_.clear();
+		if(order_.empty()) {
+			for(auto &machine : machines_)
+				if(tickOrder_ % machine.first == 0)
+					due_.push_back(machine.second.get());
+		} else {
+			for(unsigned int index : order_)
+				if(tickOrder_ % machines_[index].first == 0)
+					due_.push_back(machines_[index].second.get());
+		}
+		const std::size_t count = due_.size();
+		for(std::size_t i = 0; i < count; i++) {
+#ifdef STATE_MACHINE_PREFETCH
+			if(prefetchDistance_) {
+				// The object is fetched first, its vtable when the object is expected to be in cache already
+				if(i + prefetchDistance_ < count)
+					__builtin_prefetch(due_[i + prefetchDistance_], 1);
+				if(prefetchDistance_ > 1 && i + prefetchDistance_ / 2 < count)
+					__builtin_prefetch(*reinterpret_cast<void *const *>(due_[i + prefetchDistance_ / 2]));
 			}
+#endif
+			due_[i]->tick(input, output);
+		}
 		tickOrder_++;
-		{
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			output_ = output;
+		runTime_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began).count(),
+				std::memory_order_relaxed);
+		runs_.fetch_add(1, std::memory_order_relaxed);
+	}
+	// Puts an object in place of another one in the objects and the dependencies, returns false if it wasn't in the objects
+	bool substitute(Machines &machines, const std::shared_ptr<TimedObject<Input, Output>> &from,
+			const std::shared_ptr<TimedObject<Input, Output>> &to)
+	{
+		for(auto &dependency : dependencies_) {
+			if(dependency.first == from.get())
+				dependency.first = to.get();
+			if(dependency.second == from.get())
+				dependency.second = to.get();
 		}
+		for(auto &machine : machines)
+			if(machine.second == from) {
+				machine.second = to;
+				return true;
+			}
+		return false;
+	}
+	// Finds the clock of the objects with the given divisor of the period or adds it, called by the thread editing a change
+	static FrameClock *clockOf(Clocks &clocks, int divisor)
+	{
+		for(auto &clock : clocks)
+			if(clock.first == divisor)
+				return clock.second.get();
+		clocks.push_back(std::make_pair(divisor, std::make_shared<FrameClock>()));
+		return clocks.back().second.get();
+	}
+	void finishTick(const Input &input, const Output &output)
+	{
+		if(tickTrigger_)
+			tickTrigger_(input, output);
 		if(outputTrigger_)
 			outputTrigger_(output_);
 	}
+	// Sorts the objects so that dependencies are respected and, if grouping by type, objects of the same type are together,
+	// otherwise they keep the order of insertion (or of addresses) where possible. Throws std::invalid_argument if
+	// dependencies form a cycle
+	std::vector<unsigned int> executionOrder(const Machines &machines) const
+	{
+		std::vector<unsigned int> order;
+		if(!groupedByType_ && !orderedByAddress_ && dependencies_.empty())
+			return order;
+		std::unordered_map<const TimedObject<Input, Output> *, unsigned int> indexes;
+		std::unordered_map<std::type_index, unsigned int> typeIndexes;
+		std::vector<unsigned int> types(machines.size(), 0);
+		for(unsigned int i = 0; i < machines.size(); i++) {
+			indexes[machines[i].second.get()] = i;
+			if(groupedByType_) {
+				const TimedObject<Input, Output> &object = *machines[i].second;
+				types[i] = typeIndexes.emplace(std::type_index(typeid(object)), (unsigned int)typeIndexes.size()).first->second;
+			}
+		}
+		std::vector<std::vector<unsigned int>> followers(machines.size());
+		std::vector<unsigned int> waitingFor(machines.size(), 0);
+		for(auto &dependency : dependencies_) {
+			auto first = indexes.find(dependency.first);
+			auto second = indexes.find(dependency.second);
+			if(first == indexes.end() || second == indexes.end())
+				continue;
+			followers[first->second].push_back(second->second);
+			waitingFor[second->second]++;
+		}
+		// Objects that can run are sorted by the position of the index or the address, with the index to break ties
+		typedef std::pair<std::uintptr_t, unsigned int> Ranked;
+		auto rank = [&machines, this](unsigned int index) {
+			return Ranked(orderedByAddress_ ? reinterpret_cast<std::uintptr_t>(machines[index].second.get()) : index, index);
+		};
+		std::set<Ranked> ready;
+		std::vector<std::set<Ranked>> readyOfType(std::max<std::size_t>(typeIndexes.size(), 1));
+		for(unsigned int i = 0; i < machines.size(); i++)
+			if(!waitingFor[i]) {
+				ready.insert(rank(i));
+				readyOfType[types[i]].insert(rank(i));
+			}
+		unsigned int type = 0;
+		while(!ready.empty()) {
+			// Stay with the same type as long as possible, then continue with the first ranked object
+			unsigned int next = readyOfType[type].empty() ? ready.begin()->second : readyOfType[type].begin()->second;
+			type = types[next];
+			ready.erase(rank(next));
+			readyOfType[type].erase(rank(next));
+			order.push_back(next);
+			for(unsigned int follower : followers[next])
+				if(!--waitingFor[follower]) {
+					ready.insert(rank(follower));
+					readyOfType[types[follower]].insert(rank(follower));
+				}
+		}
+		if(order.size() != machines.size())
+			throw std::invalid_argument("Dependencies between timed objects form a cycle");
+		return order;
+	}
+	void setOrder(bool grouped, bool byAddress)
+	{
+		applyOnlineChange([this, grouped, byAddress](Machines &, Clocks &) {
+			groupedByType_ = grouped;
+			orderedByAddress_ = byAddress;
+		}, nullptr);
+	}
+	// Returns the mean time of running the objects over the given number of ticks, in microseconds, ticks must be positive
+	double measureRunTime(int ticks)
+	{
+		long long startRuns = 0;
+		long long startTime = 0;
+		for(int measured = -1; measured < ticks; ) {
+			{
+				std::lock_guard<std::mutex> lock(pauseMutex_);
+				if(paused_)
+					throw std::logic_error("The execution must be running to measure it");
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(period_));
+			long long runs = runs_.load(std::memory_order_relaxed);
+			if(measured < 0) {
+				// The first tick may include applying the change
+				startRuns = runs;
+				startTime = runTime_.load(std::memory_order_relaxed);
+				measured = 0;
+			} else
+				measured = int(runs - startRuns);
+		}
+		return (runTime_.load(std::memory_order_relaxed) - startTime) / 1000.0 / (runs_.load(std::memory_order_relaxed) - startRuns);
+	}
+	// If running, edits a copy of the contents and swaps it in between ticks, the copy gets the old contents to be destroyed here
+	void applyOnlineChange(std::function<void(Machines &, Clocks &)> edit, std::function<void()> apply)
+	{
+		std::lock_guard<std::mutex> changeLock(changeMutex_);
+		// Holding it prevents pausing before the change is applied
+		std::lock_guard<std::mutex> pauseLock(pauseMutex_);
+		if(paused_) {
+			edit(machines_, clocks_);
+			if(apply)
+				apply();
+			orderChanged_ = true; // Computed when unpaused, so that adding many objects doesn't sort them many times
+			return;
+		}
+		OnlineChange change;
+		change.machines = machines_; // Only this method changes them while running
+		change.clocks = clocks_;
+		edit(change.machines, change.clocks);
+		change.order = executionOrder(change.machines);
+		change.apply = apply;
+		std::future<void> done = change.done.get_future();
+		pendingChange_.store(&change, std::memory_order_release);
+		done.get();
+	}
 public:
+	struct OrderReport {
+		double before; // Mean time of running the objects in a tick with the previous order, in microseconds
+		double after; // The same with the chosen order
+		bool groupedByType;
+		bool orderedByAddress;
+	};
 
 	/*!
 	* \brief The constructor, leaves the thread in a paused state
@@ -297,11 +599,15 @@ public:
 	*
 	* \note The execution starts paused, it will have to be unpaused after inserting the contents
 	*/
-	StateMachineManager(Input input, Output output, int basePeriod) :
+	StateMachineManager(const Input &input, const Output &output, int basePeriod) :
 	input_(input),
 	output_(output),
 	period_(basePeriod),
-	paused_(1)
+	paused_(1),
+	pendingChange_(nullptr),
+	runTime_(0),
+	runs_(0),
+	working_(std::make_shared<Working>(input, output))
 	{
 	}
 	
@@ -311,11 +617,22 @@ public:
 	* \param The period in milliseconds, must be divisible by the base period
 	* \param A shared pointer to the object
 	*
-	* \note The execution must be paused to call this safely
+	* \note Can be called from any thread. If running, the object is inserted between ticks and this returns afterwards.
+	* Throws std::invalid_argument if the period isn't a positive multiple of the base period, periods known at compile
+	* time can be checked by the compiler using StaticStateMachineManager
 	*/
 	void addTimedObject(int period, std::shared_ptr<TimedObject<Input, Output>> added)
 	{
-		machines_.push_back(std::make_pair(period / period_, added));
+		if(period <= 0 || period % period_)
+			throw std::invalid_argument("The period of a timed object must be a positive multiple of the base period");
+		int divisor = period / period_;
+		FrameClock *clock = nullptr;
+		applyOnlineChange([divisor, &added, &clock](Machines &machines, Clocks &clocks) {
+			machines.push_back(std::make_pair(divisor, added));
+			clock = clockOf(clocks, divisor);
+		}, [&added, &clock]() {
+			added->attach(clock);
+		});
 	}
 	
 	/*!
@@ -323,12 +640,249 @@ public:
 	*
 	* \param A shared pointer to the object
 	*
-	* \note The execution must be paused to call this safely
+	* \note Can be called from any thread. If running, the object is removed between ticks and this returns afterwards, if
+	* it's not referenced elsewhere, it's destroyed by the calling thread
 	*/
 	void removeTimedObject(std::shared_ptr<TimedObject<Input, Output>> removed)
 	{
-		std::remove(machines_.begin(), machines_.end(), [&removed](const std::pair<int, std::shared_ptr<TimedObject<Input, Output>>> &tried) {
-			return (removed == tried.second);
+		bool found = false;
+		applyOnlineChange([this, &removed, &found](Machines &machines, Clocks &) {
+			auto end = std::remove_if(machines.begin(), machines.end(), [&removed](const std::pair<int, std::shared_ptr<TimedObject<Input, Output>>> &tried) {
+				return (removed == tried.second);
+			});
+			found = (end != machines.end());
+			machines.erase(end, machines.end());
+			dependencies_.erase(std::remove_if(dependencies_.begin(), dependencies_.end(),
+					[&removed](const std::pair<TimedObject<Input, Output> *, TimedObject<Input, Output> *> &dependency) {
+				return (dependency.first == removed.get() || dependency.second == removed.get());
+			}), dependencies_.end());
+		}, [&removed, &found]() {
+			if(found)
+				removed->detach(); // If it never ran, its clock must forget it
+		});
+	}
+	
+	/*!
+	* \brief Declares that an object must be run after another one within every tick in which both are run. It's needed
+	* only if objects are grouped by type, otherwise they run in the order of insertion, unless a dependency requires
+	* otherwise
+	*
+	* \param A shared pointer to the object that runs first
+	* \param A shared pointer to the object that runs after it
+	*
+	* \note Can be called from any thread. If running, the order is changed between ticks and this returns afterwards.
+	* Throws std::invalid_argument if the dependencies would form a cycle. The dependency is forgotten when either
+	* object is removed
+	*/
+	void addDependency(std::shared_ptr<TimedObject<Input, Output>> first, std::shared_ptr<TimedObject<Input, Output>> second)
+	{
+		applyOnlineChange([this, &first, &second](Machines &machines, Clocks &) {
+			dependencies_.push_back(std::make_pair(first.get(), second.get()));
+			try {
+				executionOrder(machines);
+			} catch(...) {
+				dependencies_.pop_back();
+				throw;
+			}
+		}, nullptr);
+	}
+	
+	/*!
+	* \brief Makes the objects of the same class run one after another, so that the same code runs repeatedly, which uses
+	* the instruction cache and branch prediction better if many classes are interleaved. Declared dependencies are
+	* respected, otherwise objects of a class run in the order of insertion and classes in the order of their first
+	* inserted object
+	*
+	* \param True to group, false to return to the order of insertion
+	*
+	* \note Can be called from any thread. If running, the order is changed between ticks and this returns afterwards
+	*/
+	void groupByType(bool grouped = true)
+	{
+		setOrder(grouped, orderedByAddress_);
+	}
+	
+	/*!
+	* \brief Chooses between the orders of execution the manager can set up, by measuring the total time all objects
+	* take to run in a tick. The four combinations of grouping by type and sorting the objects by their addresses in
+	* memory (which makes access to them sequential) are measured one after another in several rounds, so that all of
+	* them are affected alike by other load of the machine, and the one with the lowest time measured in any round is
+	* kept. Dependencies are respected. Times of individual objects aren't measured, the objects are never reordered
+	* otherwise
+	*
+	* \param The number of ticks every order is measured for in a round, positive
+	* \param The number of rounds, positive
+	*
+	* \return The lowest mean times with the previous and the chosen order and the chosen settings
+	*
+	* \note Can be called from any thread except the execution's, blocks for about four times the number of rounds times
+	* the given number of ticks. Throws std::invalid_argument if a number isn't positive and std::logic_error if the
+	* execution is paused or gets paused meanwhile. The previous order is set again if it fails, orders set by other
+	* threads meanwhile are overwritten
+	*/
+	OrderReport optimizeOrder(int ticks = 100, int rounds = 3)
+	{
+		if(ticks <= 0 || rounds <= 0)
+			throw std::invalid_argument("Orders must be measured for at least one tick and round");
+		// Sets the previous order again unless the chosen one was set
+		struct Restore {
+			StateMachineManager &manager;
+			bool grouped;
+			bool byAddress;
+			bool chosen;
+			Restore(StateMachineManager &manager, bool grouped, bool byAddress) :
+				manager(manager),
+				grouped(grouped),
+				byAddress(byAddress),
+				chosen(false)
+			{
+			}
+			~Restore()
+			{
+				if(chosen)
+					return;
+				try {
+					manager.setOrder(grouped, byAddress);
+				} catch(...) {
+					// It was valid before and dependencies can't be made cyclic, so this isn't expected
+				}
+			}
+		};
+		int previous;
+		{
+			std::lock_guard<std::mutex> changeLock(changeMutex_);
+			previous = (groupedByType_ ? 1 : 0) | (orderedByAddress_ ? 2 : 0);
+		}
+		Restore restore(*this, previous & 1, previous & 2);
+		double times[4];
+		std::fill(times, times + 4, std::numeric_limits<double>::infinity());
+		for(int round = 0; round < rounds; round++)
+			for(int step = 0; step < 4; step++) {
+				int candidate = previous ^ step; // The previous one first, it's already set
+				if(step || round)
+					setOrder(candidate & 1, candidate & 2);
+				times[candidate] = std::min(times[candidate], measureRunTime(ticks));
+			}
+		int best = int(std::min_element(times, times + 4) - times);
+		setOrder(best & 1, best & 2);
+		restore.chosen = true;
+		OrderReport report;
+		report.before = times[previous];
+		report.after = times[best];
+		report.groupedByType = best & 1;
+		report.orderedByAddress = best & 2;
+		return report;
+	}
+	
+	/*!
+	* \brief Gives a producer its own part of the input that it can update without locking the whole input
+	*
+	* \param Pointer to the member of the input structure that the producer will own
+	*
+	* \return The segment, its publish() method sets the value used by the following ticks
+	*
+	* \note The execution must be paused to call this safely. The value of the member is taken from the segment at the
+	* beginning of each tick, values set to it through input() are overwritten
+	*/
+	template<typename T>
+	std::shared_ptr<InputSegment<T>> addInputSegment(T Input::*member)
+	{
+		std::shared_ptr<InputSegment<T>> segment(new InputSegment<T>(input_.*member));
+		segments_.push_back([segment, member](Input &input) {
+			segment->collect(input.*member);
+		});
+		return segment;
+	}
+	
+	/*!
+	* \brief Adds a stage that processes the input once per tick before the objects are run, so that they don't have to
+	* repeat the processing
+	*
+	* \param The function, taking a reference to the tick's copy of the input, changes made to it are seen by all objects
+	* in that tick, but not by the following ticks
+	*
+	* \note The execution must be paused to call this safely, the stages are run in the order they were added, after
+	* the input segments are applied, on the same thread as the loop
+	*/
+	void addInputStage(std::function<void(Input &)> stage)
+	{
+		stages_.push_back(stage);
+	}
+	
+	/*!
+	* \brief Adds a stage that processes the output once per tick after the objects are run, before it's published
+	*
+	* \param The function, taking a reference to the output written by the objects, the following ticks start with the
+	* processed output
+	*
+	* \note The execution must be paused to call this safely, the stages are run in the order they were added, on the
+	* same thread as the loop
+	*/
+	void addOutputStage(std::function<void(Output &)> stage)
+	{
+		outputStages_.push_back(stage);
+	}
+	
+	/*!
+	* \brief Registers a channel array in the output, so that only its changed channels are copied into the output and
+	* its snapshot after every tick. The array's record of changes is cleared at the beginning of every tick, so the
+	* published output tells which channels changed in the last tick
+	*
+	* \param Pointer to the member of the output structure
+	*
+	* \note The execution must be paused to call this safely. The output structure must be trivially copyable. Objects
+	* must change the channels only using ChannelArray::set(), the output isn't copied back from the published one
+	* between ticks
+	*/
+	template<typename T, std::size_t Channels>
+	void addChannelArray(ChannelArray<T, Channels> Output::*member)
+	{
+		static_assert(std::is_trivially_copyable<Output>::value, "The output must be trivially copyable to publish only its changes");
+		const std::size_t offset = reinterpret_cast<const unsigned char *>(&(output_.*member)) - reinterpret_cast<const unsigned char *>(&output_);
+		auto position = channelArrays_.begin();
+		while(position != channelArrays_.end() && position->offset < offset)
+			++position;
+		if(position != channelArrays_.end() && position->offset == offset)
+			return;
+		channelArrays_.insert(position, ChannelArrayPart{ offset, sizeof(ChannelArray<T, Channels>),
+			[member](Output &output) {
+				(output.*member).clearChanges();
+			},
+			[member](const Output &output, const std::function<void(std::size_t, std::size_t)> &function) {
+				(output.*member).forEachChangedBytes(function);
+			}
+		});
+	}
+	
+	/*!
+	* \brief Replaces a timed object by another one at the beginning of a tick, without pausing the execution
+	*
+	* \param A shared pointer to the replaced object
+	* \param A shared pointer to the new object, it will have the same period
+	* \param A function that transfers the state from the old object to the new one, called with references to both
+	* right before the replacement, from the execution's thread. Timers can be moved using the new object's adoptTimer()
+	*
+	* \note Can be called from any thread, returns after the replacement. The new object's timing (frame time, last
+	* period, time in state) is taken from the old object. Throws std::invalid_argument if the replaced object isn't present.
+	* If the transfer throws, the exception is rethrown here and the old object stays in the manager
+	*/
+	template<typename Old, typename New, typename Transfer>
+	void replaceTimedObject(std::shared_ptr<Old> replaced, std::shared_ptr<New> replacement, Transfer transfer)
+	{
+		std::shared_ptr<TimedObject<Input, Output>> from = replaced;
+		std::shared_ptr<TimedObject<Input, Output>> to = replacement;
+		applyOnlineChange([this, &from, &to](Machines &machines, Clocks &) {
+			if(!substitute(machines, from, to))
+				throw std::invalid_argument("Replaced timed object is not in the manager");
+		}, [this, &from, &to, &replaced, &replacement, &transfer]() {
+			try {
+				transfer(*replaced, *replacement);
+			} catch(...) {
+				// If running, the edited copy is dropped, but the dependencies and, if paused, the objects were edited in place
+				substitute(machines_, to, from);
+				throw;
+			}
+			replacement->inheritTiming(*replaced);
 		});
 	}
 	
@@ -339,7 +893,7 @@ public:
 	{
 		std::lock_guard<std::mutex> lock(pauseMutex_);
 		if(!paused_) {
-			loop_.release();
+			loop_.reset();
 			paused_ = 1;
 		}
 		else paused_++;
@@ -354,6 +908,22 @@ public:
 	{
 		std::lock_guard<std::mutex> lock(pauseMutex_);
 		if(paused_ == 1) {
+			if(orderChanged_) {
+				order_ = executionOrder(machines_);
+				orderChanged_ = false;
+			}
+			// The output might have been changed while paused, only changed parts are copied when running
+			bool partial = !channelArrays_.empty();
+#ifdef __linux__
+			if(outputPages_) {
+				outputPages_->assign(output_);
+				partial = true;
+			}
+#endif
+			if(!channelArrays_.empty())
+				working_->output = output_;
+			if(snapshot_ && partial)
+				snapshot_->publish(output_);
 			loop_ = std::make_unique<LoopingThread>(std::chrono::milliseconds(period_), [this]()
 			{
 				tick();
@@ -385,6 +955,82 @@ public:
 		return ProtectedReturn<Output>(&output_, [lock]() { /* Keep a copy of the mutex pointer */ });
 	}
 	
+	/*!
+	* \brief Returns a snapshot of the output that is published after every tick, it can be read from other threads without
+	* ever blocking the execution
+	*
+	* \return The snapshot, the same one on every call
+	*
+	* \note The execution must be paused when this is called for the first time, the output must be trivially copyable
+	*/
+	std::shared_ptr<const PublishedSnapshot<Output>> outputSnapshot()
+	{
+		if(!snapshot_)
+			snapshot_ = std::shared_ptr<PublishedSnapshot<Output>>(new PublishedSnapshot<Output>(output_));
+		return snapshot_;
+	}
+	
+#ifdef __linux__
+	/*!
+	* \brief Keeps the output written by the objects in page-aligned memory and tracks which pages were written during
+	* each tick, so that only those are copied into the output, its snapshot and replicas. Meant for output structures
+	* of megabytes that change only partially every tick
+	*
+	* \note The execution must be paused to call this safely. The output structure must be trivially copyable. Available
+	* only on Linux, the first write into every page during a tick costs a page fault
+	*/
+	void trackDirtyPages()
+	{
+		if(!outputPages_)
+			outputPages_ = std::make_unique<DirtyPageImage<Output>>(output_);
+	}
+	
+	/*!
+	* \brief Places the copies of the input and output that the objects work with during ticks in memory backed by huge
+	* pages, which reduces TLB misses if the structures are large and accessed randomly. The objects themselves can be
+	* placed in huge pages by creating them using a HugePageArena
+	*
+	* \return The kind of pages that were obtained, explicit huge pages are used if reserved, transparent ones otherwise
+	*
+	* \note The execution must be paused to call this safely. Available only on Linux. Throws std::bad_alloc if the memory
+	* cannot be allocated
+	*/
+	HugePageKind useHugePages()
+	{
+		std::shared_ptr<HugePageMemory> memory = std::make_shared<HugePageMemory>(sizeof(Working));
+		Working *working = new(memory->data()) Working(working_->input, working_->output);
+		working_ = std::shared_ptr<Working>(working, [memory](Working *destroyed) {
+			destroyed->~Working();
+		});
+		return memory->kind();
+	}
+	
+	/*!
+	* \brief Returns the output's page tracking, whose forEachDirtyRun() method reports the parts of the output written
+	* in the last tick, meant to be used in the tick trigger to record or replicate only the changes
+	*
+	* \return The tracking, null if trackDirtyPages() wasn't called
+	*/
+	const DirtyPageRegion *dirtyPages() const
+	{
+		return outputPages_.get();
+	}
+	
+#endif
+	/*!
+	* \brief Sets how many objects ahead of the running one are prefetched into cache, along with their virtual tables,
+	* which hides the cache misses of calling many objects scattered in memory
+	*
+	* \param The number of objects, 0 disables prefetching
+	*
+	* \note The execution must be paused to call this safely. Has no effect with compilers other than GCC and Clang or if
+	* STATE_MACHINE_NO_PREFETCH is defined
+	*/
+	void setPrefetchDistance(unsigned int distance)
+	{
+		prefetchDistance_ = distance;
+	}
+	
 	/*!
 	* \brief Sets input trigger, a function that is called before every execution. Its intended use is to have it load the
 	* parametres asynchronously from someplace
@@ -410,5 +1056,21 @@ public:
 	{
 		outputTrigger_ = trigger;
 	}
+	
+	/*!
+	* \brief Sets tick trigger, a function that is called after every execution with the input and output it used, before
+	* the output trigger. Its intended use is recording or replicating the whole state
+	*
+	* \param The function, taking const references to the input and the output as parameters
+	*
+	* \note The execution must be paused to call this safely, the trigger itself is run on the same thread as the loop
+	*/
+	void setTickTrigger(std::function<void(const Input &, const Output &)> trigger)
+	{
+		tickTrigger_ = trigger;
+	}
+	
+	template<typename In, typename Out> friend class ReplicationPrimary;
+	template<typename In, typename Out> friend class ReplicationFollower;
 };
 #endif // STATE_MACHINE_H
@@ -0,0 +1,313 @@
+/*
+* \brief A manager whose objects, periods and schedule are fixed at compile time
+*
+* The base period and the period of every object are template arguments, so that periods that aren't multiples of the
+* base period are refused by the compiler rather than truncated, as is a schedule whose objects can't finish within the
+* base period according to their declared budgets. The objects are members of the manager, so calling them needs no
+* virtual dispatch. The whole schedule over the hyperperiod (the least common multiple of all periods) is generated as
+* one function per tick, containing direct calls of the objects that are due in that tick, and ticks only step through
+* them.
+*
+* The number of ticks in the hyperperiod is limited by STATE_MACHINE_STATIC_MAX_SLOTS (4096 by default), because each of
+* them is a separate function.
+*/
+
+#ifndef STATE_MACHINE_STATIC_SCHEDULE_H
+#define STATE_MACHINE_STATIC_SCHEDULE_H
+
+#include "state_machine.hpp"
+#include <tuple>
+#include <utility>
+
+#ifndef STATE_MACHINE_STATIC_MAX_SLOTS
+#define STATE_MACHINE_STATIC_MAX_SLOTS 4096
+#endif
+
+/*!
+* \brief Describes an object of a StaticStateMachineManager
+*
+* \param The period in milliseconds, must be a multiple of the manager's base period
+* \param The class of the object, derived from TimedObject or StateMachine, default constructible
+* \param The longest time its tick() may take, in microseconds, 0 if unknown
+*/
+template<int Period, typename Object, int Budget = 0>
+struct Scheduled {
+	static constexpr int period = Period;
+	static constexpr int budget = Budget;
+	typedef Object Type;
+};
+
+template<typename Input, typename Output, int BasePeriod, typename... Entries>
+class StaticStateMachineManager {
+	typedef void (StaticStateMachineManager::*Slot)(const Input &, Output &, long long);
+	typedef std::tuple<typename Entries::Type...> Objects;
+
+	static constexpr long long greatestCommonDivisor(long long first, long long second)
+	{
+		return second ? greatestCommonDivisor(second, first % second) : first;
+	}
+	static constexpr bool periodsValid()
+	{
+		if(BasePeriod <= 0)
+			return false;
+		const int periods[] = { BasePeriod, Entries::period... };
+		for(int period : periods)
+			if(period <= 0 || period % BasePeriod)
+				return false;
+		return true;
+	}
+	static constexpr bool budgetsValid()
+	{
+		const int budgets[] = { 0, Entries::budget... };
+		for(int budget : budgets)
+			if(budget < 0)
+				return false;
+		return true;
+	}
+	static constexpr bool objectsValid()
+	{
+		const bool derived[] = { true, std::is_base_of<TimedObject<Input, Output>, typename Entries::Type>::value... };
+		for(bool valid : derived)
+			if(!valid)
+				return false;
+		return true;
+	}
+	// Never zero, so that invalid periods are reported only by the static assertions
+	static constexpr int divisor(int period)
+	{
+		return periodsValid() ? period / BasePeriod : 1;
+	}
+	static constexpr long long computeHyperperiod()
+	{
+		if(!periodsValid())
+			return BasePeriod;
+		const int periods[] = { BasePeriod, Entries::period... };
+		long long result = BasePeriod;
+		for(int period : periods)
+			result = result / greatestCommonDivisor(result, period) * period;
+		return result;
+	}
+	// The longest sum of budgets of objects that are due in the same tick
+	static constexpr long long computeLongestSlot()
+	{
+		if(!periodsValid())
+			return 0;
+		const int periods[] = { BasePeriod, Entries::period... };
+		const int budgets[] = { 0, Entries::budget... };
+		long long longest = 0;
+		for(long long slot = 0; slot < computeHyperperiod() / BasePeriod; slot++) {
+			long long load = 0;
+			for(std::size_t i = 1; i < sizeof(periods) / sizeof(periods[0]); i++)
+				if(slot % divisor(periods[i]) == 0)
+					load += budgets[i];
+			longest = (load > longest) ? load : longest;
+		}
+		return longest;
+	}
+
+public:
+	static constexpr long long hyperperiod = computeHyperperiod(); // In milliseconds
+	static constexpr int slots = int(hyperperiod / (BasePeriod > 0 ? BasePeriod : 1)); // Ticks in the hyperperiod
+	static constexpr long long longestSlot = computeLongestSlot(); // Sum of budgets in the busiest tick, in microseconds
+
+private:
+	static_assert(periodsValid(), "All periods must be positive multiples of the base period");
+	static_assert(budgetsValid(), "Budgets can't be negative");
+	static_assert(objectsValid(), "Scheduled objects must be derived from TimedObject with the same input and output");
+	static_assert(slots <= STATE_MACHINE_STATIC_MAX_SLOTS, "The hyperperiod has too many ticks, increase STATE_MACHINE_STATIC_MAX_SLOTS if needed");
+	static_assert(longestSlot <= BasePeriod * 1000LL, "The objects due in the same tick can't finish within the base period");
+
+	struct Working {
+		Input input;
+		Output output;
+	};
+
+	Objects objects_;
+	typename TimedObject<Input, Output>::FrameClock clocks_[sizeof...(Entries) + 1]; // One for each object
+	Input input_;
+	Output output_;
+	std::unique_ptr<Working> working_;
+	int slot_ = 0;
+	int paused_ = 1;
+	std::mutex inputMutex_;
+	std::mutex outputMutex_;
+	std::mutex pauseMutex_;
+	std::function<void(Input &)> inputTrigger_;
+	std::function<void(const Output &)> outputTrigger_;
+	std::unique_ptr<LoopingThread> loop_;
+
+	template<std::size_t Index>
+	void run(std::true_type, const Input &in, Output &out, long long time)
+	{
+		typedef typename std::tuple_element<Index, Objects>::type Type;
+		clocks_[Index].advance(time);
+		std::get<Index>(objects_).Type::tick(in, out); // Qualified, so that it's a direct call rather than through the vtable
+	}
+	template<std::size_t Index>
+	void run(std::false_type, const Input &, Output &, long long)
+	{
+	}
+	template<std::size_t Slot, std::size_t... Indexes>
+	void runSlot(std::index_sequence<Indexes...>, const Input &in, Output &out, long long time)
+	{
+		int unused[] = { 0, (run<Indexes>(std::integral_constant<bool,
+				Slot % divisor(std::tuple_element<Indexes, std::tuple<Entries...>>::type::period) == 0>(), in, out, time), 0)... };
+		(void)unused;
+	}
+	template<std::size_t Slot>
+	void runSlot(const Input &in, Output &out, long long time)
+	{
+		runSlot<Slot>(std::index_sequence_for<Entries...>(), in, out, time);
+	}
+	template<std::size_t... Indexes>
+	void attach(std::index_sequence<Indexes...>)
+	{
+		int unused[] = { 0, (static_cast<TimedObject<Input, Output> &>(std::get<Indexes>(objects_)).attach(&clocks_[Indexes]), 0)... };
+		(void)unused;
+	}
+	template<std::size_t... Slots>
+	static const Slot *schedule(std::index_sequence<Slots...>)
+	{
+		static const Slot table[] = { &StaticStateMachineManager::runSlot<Slots>... };
+		return table;
+	}
+
+	void tick()
+	{
+		static const Slot *table = schedule(std::make_index_sequence<slots>());
+		if(inputTrigger_)
+			inputTrigger_(input_);
+		{
+			std::unique_lock<std::mutex> lock(inputMutex_);
+			working_->input = input_;
+		}
+		working_->output = output_;
+		long long time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		(this->*table[slot_])(working_->input, working_->output, time);
+		slot_ = (slot_ + 1 == slots) ? 0 : slot_ + 1;
+		{
+			std::unique_lock<std::mutex> lock(outputMutex_);
+			output_ = working_->output;
+		}
+		if(outputTrigger_)
+			outputTrigger_(output_);
+	}
+
+public:
+	/*!
+	* \brief The constructor, default constructs all objects and leaves the thread in a paused state
+	*
+	* \param The initial input structure
+	* \param The initial output structure
+	*
+	* \note The execution starts paused, it will have to be unpaused after setting up the objects
+	*/
+	StaticStateMachineManager(const Input &input, const Output &output) :
+		input_(input),
+		output_(output),
+		working_(new Working{ input, output })
+	{
+		attach(std::index_sequence_for<Entries...>());
+	}
+
+	/*!
+	* \brief Gives access to an object
+	*
+	* \param The object's position among the template arguments (template argument)
+	*
+	* \return The object
+	*
+	* \note The execution must be paused to access it safely
+	*/
+	template<std::size_t Index>
+	typename std::tuple_element<Index, Objects>::type &object()
+	{
+		return std::get<Index>(objects_);
+	}
+
+	/*!
+	* \brief Pauses execution, must be resumed with unpause(), if paused twice, it will have to be unpaused twice, making pausing reentrant
+	*/
+	void pause()
+	{
+		std::lock_guard<std::mutex> lock(pauseMutex_);
+		if(!paused_) {
+			loop_.reset();
+			paused_ = 1;
+		}
+		else paused_++;
+	}
+
+	/*!
+	* \brief Resumes execution paused by pause(), if paused twice, it will have to be unpaused twice, making pausing reentrant
+	*
+	* \note Must be called after the constructor when all is set up
+	*/
+	void unpause()
+	{
+		std::lock_guard<std::mutex> lock(pauseMutex_);
+		if(paused_ == 1) {
+			loop_ = std::make_unique<LoopingThread>(std::chrono::milliseconds(BasePeriod), [this]()
+			{
+				tick();
+			});
+			paused_ = 0;
+		}
+		else paused_--;
+	}
+
+	/*!
+	* \brief Returns the input structure and holds it until the returned smart pointer is destroyed
+	*
+	* \return A smart pointer to the input structure, must be destroyed asap to avoid disturbing the execution
+	*/
+	ProtectedReturn<Input> input()
+	{
+		std::shared_ptr<std::unique_lock<std::mutex>> lock = std::make_unique<std::unique_lock<std::mutex>>(inputMutex_);
+		return ProtectedReturn<Input>(&input_, [lock]() { /* Keep a copy of the mutex pointer */ });
+	}
+
+	/*!
+	* \brief Returns the output structure and holds it in that state until the returned smart pointer is destroyed
+	*
+	* \return A smart pointer to the output structure, must be destroyed asap to avoid disturbing the execution
+	*/
+	const ProtectedReturn<Output> output()
+	{
+		std::shared_ptr<std::unique_lock<std::mutex>> lock = std::make_unique<std::unique_lock<std::mutex>>(outputMutex_);
+		return ProtectedReturn<Output>(&output_, [lock]() { /* Keep a copy of the mutex pointer */ });
+	}
+
+	/*!
+	* \brief Sets input trigger, a function that is called before every execution
+	*
+	* \param The function, taking a reference to the input as parameter
+	*
+	* \note The execution must be paused to call this safely, the trigger itself is run on the same thread as the loop
+	*/
+	void setInputTrigger(std::function<void(Input &)> trigger)
+	{
+		inputTrigger_ = trigger;
+	}
+
+	/*!
+	* \brief Sets output trigger, a function that is called after every execution
+	*
+	* \param The function, taking a const reference to the output as parameter
+	*
+	* \note The execution must be paused to call this safely, the trigger itself is run on the same thread as the loop
+	*/
+	void setOutputTrigger(std::function<void(const Output &)> trigger)
+	{
+		outputTrigger_ = trigger;
+	}
+};
+
+template<typename Input, typename Output, int BasePeriod, typename... Entries>
+constexpr long long StaticStateMachineManager<Input, Output, BasePeriod, Entries...>::hyperperiod;
+template<typename Input, typename Output, int BasePeriod, typename... Entries>
+constexpr int StaticStateMachineManager<Input, Output, BasePeriod, Entries...>::slots;
+template<typename Input, typename Output, int BasePeriod, typename... Entries>
+constexpr long long StaticStateMachineManager<Input, Output, BasePeriod, Entries...>::longestSlot;
+
+#endif // STATE_MACHINE_STATIC_SCHEDULE_H
@@ -0,0 +1,337 @@
+/*
+* \brief The base classes of the objects run by the managers
+*
+* Class TimedObject is the base of all objects, it reads the time of every tick from a FrameClock shared by all objects
+* with the same period and creates timers. Class StateMachine adds a state, whose type is its third template argument,
+* and the time spent in it. Objects store only the times when things began, the times since then are computed when asked
+* for, so the manager doesn't have to update every object before its tick.
+*
+* This part doesn't depend on the standard library's containers, threads or streams, so that it can be used with
+* FixedStateMachineManager on small targets. If STATE_MACHINE_MINIMAL is defined, the hooks for saving the objects' state
+* used by replication are left out, which removes the only use of std::vector.
+*/
+
+#ifndef STATE_MACHINE_TIMED_OBJECT_H
+#define STATE_MACHINE_TIMED_OBJECT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#ifndef STATE_MACHINE_MINIMAL
+#include <vector>
+#endif
+
+template<typename Input, typename Output>
+class TimedObject {
+public:
+	/*!
+	* \brief The times of the ticks of a group of objects with the same period, kept by the manager and advanced once per
+	* tick in which they're due, so that the objects don't have to store the time themselves
+	*/
+	class FrameClock {
+		long long time_ = 0; // Of the current tick
+		long long previous_ = 0; // Of the previous tick
+		unsigned long long ticks_ = 0;
+		TimedObject *fresh_ = nullptr; // Objects that haven't run yet, linked through their nextFresh_
+
+		template<typename In, typename Out> friend class TimedObject;
+		template<typename In, typename Out> friend class ReplicationPrimary;
+		template<typename In, typename Out> friend class ReplicationFollower;
+	public:
+		/*!
+		* \brief Starts a tick, the objects that haven't run before begin their timing in it
+		*
+		* \param The time in milliseconds
+		*/
+		void advance(long long time)
+		{
+			previous_ = ticks_ ? time_ : time;
+			time_ = time;
+			ticks_++;
+			while(fresh_) {
+				TimedObject *started = fresh_;
+				fresh_ = started->nextFresh_;
+				started->startTiming();
+			}
+		}
+	};
+
+private:
+	FrameClock *clock_ = nullptr;
+	TimedObject *nextFresh_ = nullptr;
+
+protected:
+	// Called in the object's first tick, before tick()
+	virtual void startTiming()
+	{
+	}
+	virtual bool stateTiming(long long &, std::uint32_t &) const
+	{
+		return false;
+	}
+	virtual void setStateTiming(long long, std::uint32_t)
+	{
+	}
+#ifndef STATE_MACHINE_MINIMAL
+	virtual void saveStateMachine(std::vector<unsigned char> &) const
+	{
+	}
+	virtual void loadStateMachine(const unsigned char *, std::size_t)
+	{
+	}
+#endif
+	// Returns the clock's number of ticks, or 0 if the object isn't in a manager, truncated because only recent ticks are
+	// compared with it
+	std::uint32_t clockTicks() const
+	{
+		return clock_ ? std::uint32_t(clock_->ticks_) : 0;
+	}
+	void attach(FrameClock *clock)
+	{
+		clock_ = clock;
+		nextFresh_ = clock->fresh_;
+		clock->fresh_ = this;
+	}
+	// Returns true if the object hadn't run yet
+	bool detach()
+	{
+		if(!clock_)
+			return false;
+		for(TimedObject **link = &clock_->fresh_; *link; link = &(*link)->nextFresh_)
+			if(*link == this) {
+				*link = nextFresh_;
+				return true;
+			}
+		return false;
+	}
+	void inheritTiming(TimedObject &from)
+	{
+		clock_ = from.clock_;
+		long long stateEntered;
+		std::uint32_t stateChanged;
+		if(from.stateTiming(stateEntered, stateChanged))
+			setStateTiming(stateEntered, stateChanged);
+		if(from.detach())
+			attach(clock_);
+	}
+public:
+	virtual ~TimedObject() = default;
+	
+	/*!
+	* \brief Returns the time between the current step and the previous one
+	*
+	* \return The time in milliseconds
+	*/
+	int lastPeriod()
+	{
+		return clock_ ? int(clock_->time_ - clock_->previous_) : 0;
+	}
+	
+	/*!
+	* \brief Returns the current time, kept at once value during the whole tick
+	*
+	* \return The time in milliseconds
+	*/
+	long long frameTime()
+	{
+		return clock_ ? clock_->time_ : 0;
+	}
+	
+	class Timer {
+		long long since_;
+		TimedObject<Input, Output> *parent_;
+		Timer(long long since, TimedObject<Input, Output> *parent) : since_(since), parent_(parent)
+		{
+		}
+		template<typename In, typename Out> friend class TimedObject;
+	public:
+	
+		/*!
+		* \brief Default constructor, default constructed or disabled timer always returns 0 as time
+		*/
+		Timer() : parent_(nullptr)
+		{
+		}
+		
+		/*!
+		* \brief Returns the time since this timer was created
+		*
+		* \return The time in milliseconds
+		*/
+		long long time()
+		{
+			if(!parent_) return 0;
+			return parent_->frameTime() - since_;
+		}
+		
+		/*!
+		* \brief Returns uf the time is active, that is, wasn't default-constructed or disabled
+		*
+		* \return If it is enabled
+		*/
+		bool active()
+		{
+			return (parent_ != nullptr);
+		}
+		
+		/*!
+		* \brief Disables the timer so that it will not be active and always return time 0
+		*/
+		void deactivate()
+		{
+			parent_ = nullptr;
+		}
+	};
+	
+	/*!
+	* \brief Returns a timer measuring time from the moment it was returned
+	*
+	* \return The timer, use its getTime() method to get the time in milliseconds
+	*/
+	Timer makeTimer()
+	{
+		return Timer(frameTime(), this);
+	}
+	
+	/*!
+	* \brief Returns a timer measuring the same time as a timer of another object, meant for transferring timers when
+	* replacing the object by another one
+	*
+	* \param The other object's timer
+	*
+	* \return The timer, inactive if the other one was inactive
+	*/
+	Timer adoptTimer(const Timer &other)
+	{
+		if(!other.parent_) return Timer();
+		return Timer(other.since_, this);
+	}
+	
+	/*!
+	* \brief Overload this function with a function you want to be called periodically
+	*
+	* \param The input structure, its type is the first template argument
+	* \param The output structure, its type is the second template argument
+	*/
+	virtual void tick(const Input &in, Output &out) = 0;
+	
+#ifndef STATE_MACHINE_MINIMAL
+	/*!
+	* \brief Overload this function to have the object's state replicated to a standby process
+	*
+	* \param The buffer to append the state to
+	*/
+	virtual void saveState(std::vector<unsigned char> &) const
+	{
+	}
+	
+	/*!
+	* \brief Overload this function to load the state saved by saveState() in another process
+	*
+	* \param The saved state
+	* \param Its size in bytes
+	*/
+	virtual void loadState(const unsigned char *, std::size_t)
+	{
+	}
+#endif
+	
+	template<typename In, typename Out> friend class StateMachineManager;
+	template<typename In, typename Out, int BasePeriod, typename... Entries> friend class StaticStateMachineManager;
+	template<typename In, typename Out, std::size_t Capacity, std::size_t Storage> friend class FixedStateMachineManager;
+	template<typename In, typename Out> friend class ReplicationPrimary;
+	template<typename In, typename Out> friend class ReplicationFollower;
+};
+
+template<typename Input, typename Output, typename State>
+class StateMachine : public TimedObject<Input, Output> {
+	long long stateEntered_ = 0; // Frame time of the tick when the state changed
+	std::uint32_t stateChanged_ = 0; // The clock's number of ticks then
+	virtual void startTiming()
+	{
+		// A state set before the first tick was entered in it
+		stateEntered_ = this->frameTime();
+		stateChanged_ = this->clockTicks() - 1;
+	}
+	virtual bool stateTiming(long long &stateEntered, std::uint32_t &stateChanged) const
+	{
+		stateEntered = stateEntered_;
+		stateChanged = stateChanged_;
+		return true;
+	}
+	virtual void setStateTiming(long long stateEntered, std::uint32_t stateChanged)
+	{
+		stateEntered_ = stateEntered;
+		stateChanged_ = stateChanged;
+	}
+#ifndef STATE_MACHINE_MINIMAL
+	virtual void saveStateMachine(std::vector<unsigned char> &to) const
+	{
+		static_assert(std::is_trivially_copyable<State>::value, "The state must be trivially copyable");
+		const unsigned char *entered = reinterpret_cast<const unsigned char *>(&stateEntered_);
+		const unsigned char *changed = reinterpret_cast<const unsigned char *>(&stateChanged_);
+		const unsigned char *state = reinterpret_cast<const unsigned char *>(&state_);
+		to.insert(to.end(), entered, entered + sizeof(stateEntered_));
+		to.insert(to.end(), changed, changed + sizeof(stateChanged_));
+		to.insert(to.end(), state, state + sizeof(State));
+	}
+	virtual void loadStateMachine(const unsigned char *from, std::size_t size)
+	{
+		if(size != sizeof(stateEntered_) + sizeof(stateChanged_) + sizeof(State))
+			return;
+		std::memcpy(&stateEntered_, from, sizeof(stateEntered_));
+		std::memcpy(&stateChanged_, from + sizeof(stateEntered_), sizeof(stateChanged_));
+		std::memcpy(&state_, from + sizeof(stateEntered_) + sizeof(stateChanged_), sizeof(State));
+	}
+#endif
+	State state_ = State(); // Compared by state(State), also when it sets the initial state
+	
+protected:
+	/*!
+	* \brief Returns the current state of the automaton, the state's type is set as the third template argument
+	*
+	* \return The state
+	*
+	* \note Must be called in the final object's constructor to set its initial state
+	*/
+	State state()
+	{
+		return state_;
+	}
+	
+	/*!
+	* \brief Changes the state of the automaton
+	*
+	* \param The new state
+	*/
+	void state(State newState)
+	{
+		if(state_ == newState) return;
+		state_ = newState;
+		stateEntered_ = this->frameTime();
+		stateChanged_ = this->clockTicks();
+	}
+	
+	/*!
+	* \brief Returns the time since the last change of state
+	*
+	* \return The time in milliseconds
+	*/
+	long long timeInState()
+	{
+		return this->frameTime() - stateEntered_;
+	}
+	
+	/*!
+	* \brief Returns true if the automaton is running its first tick in the current state
+	*
+	* \return If this is the first tick after state change
+	*/
+	bool afterStateChange()
+	{
+		return (this->clockTicks() == std::uint32_t(stateChanged_ + 1));
+	}
+};
+
+#endif // STATE_MACHINE_TIMED_OBJECT_H
@@ -0,0 +1,258 @@
+/*
+* \brief Many IEC 61131-3 timers (TON, TOF, TP) updated together
+*
+* Instead of every timer being a Timer with its own logic in some object's tick(), a TimerBank stores the inputs, presets,
+* elapsed times and outputs of all its timers in separate arrays, one set for each kind of timer, and updates each kind
+* in a single loop without branches, which the compiler can vectorise. Timers are referred to by small handles that
+* contain only their index.
+*
+* The bank is a TimedObject, so it updates its timers when the manager ticks it, using the time since its last tick.
+* Other objects set the timers' inputs and read their outputs, those run before the bank see the outputs of the previous
+* tick. It can also be updated directly using update().
+*/
+
+#ifndef STATE_MACHINE_TIMER_BANK_H
+#define STATE_MACHINE_TIMER_BANK_H
+
+#include "timed_object.hpp"
+#include <algorithm>
+#include <vector>
+
+template<typename Input, typename Output>
+class TimerBank : public TimedObject<Input, Output> {
+	struct Group {
+		std::vector<std::int32_t> preset;
+		std::vector<std::int32_t> elapsed;
+		std::vector<std::uint8_t> in;
+		std::vector<std::uint8_t> q;
+		std::vector<std::uint8_t> previous; // Input in the previous update, times start from 0 in the update seeing an edge
+
+		std::uint32_t add(std::int32_t time)
+		{
+			preset.push_back(time);
+			elapsed.push_back(0);
+			in.push_back(0);
+			q.push_back(0);
+			previous.push_back(0);
+			return std::uint32_t(preset.size() - 1);
+		}
+	};
+	Group onDelays_;
+	Group offDelays_;
+	Group pulses_;
+	bool started_ = false;
+
+public:
+	// Handles of the timers, they are only indexes
+	struct OnDelay {
+		std::uint32_t index;
+	};
+	struct OffDelay {
+		std::uint32_t index;
+	};
+	struct Pulse {
+		std::uint32_t index;
+	};
+
+private:
+	Group &group(OnDelay)
+	{
+		return onDelays_;
+	}
+	Group &group(OffDelay)
+	{
+		return offDelays_;
+	}
+	Group &group(Pulse)
+	{
+		return pulses_;
+	}
+	const Group &group(OnDelay) const
+	{
+		return onDelays_;
+	}
+	const Group &group(OffDelay) const
+	{
+		return offDelays_;
+	}
+	const Group &group(Pulse) const
+	{
+		return pulses_;
+	}
+
+public:
+	/*!
+	* \brief Adds an on-delay timer (TON), its output is set when its input was set for the preset time
+	*
+	* \param The preset time in milliseconds
+	*
+	* \return The handle of the timer
+	*
+	* \note The execution must be paused to add timers to a bank that is in a manager
+	*/
+	OnDelay addOnDelay(std::int32_t preset)
+	{
+		return OnDelay{ onDelays_.add(preset) };
+	}
+
+	/*!
+	* \brief Adds an off-delay timer (TOF), its output is set with its input and reset when its input was reset for the
+	* preset time
+	*
+	* \param The preset time in milliseconds
+	*
+	* \return The handle of the timer
+	*
+	* \note The execution must be paused to add timers to a bank that is in a manager
+	*/
+	OffDelay addOffDelay(std::int32_t preset)
+	{
+		return OffDelay{ offDelays_.add(preset) };
+	}
+
+	/*!
+	* \brief Adds a pulse timer (TP), a rising edge of its input sets its output for the preset time
+	*
+	* \param The preset time in milliseconds
+	*
+	* \return The handle of the timer
+	*
+	* \note The execution must be paused to add timers to a bank that is in a manager
+	*/
+	Pulse addPulse(std::int32_t preset)
+	{
+		return Pulse{ pulses_.add(preset) };
+	}
+
+	/*!
+	* \brief Sets the input of a timer, it takes effect in the next update
+	*
+	* \param The handle of the timer
+	* \param The input's value
+	*/
+	template<typename Handle>
+	void set(Handle timer, bool value)
+	{
+		group(timer).in[timer.index] = value;
+	}
+
+	/*!
+	* \brief Returns the output of a timer (Q) after the last update
+	*
+	* \param The handle of the timer
+	*
+	* \return The output
+	*/
+	template<typename Handle>
+	bool output(Handle timer) const
+	{
+		return group(timer).q[timer.index];
+	}
+
+	/*!
+	* \brief Returns the elapsed time of a timer (ET) after the last update
+	*
+	* \param The handle of the timer
+	*
+	* \return The time in milliseconds, it never exceeds the preset time
+	*/
+	template<typename Handle>
+	std::int32_t elapsed(Handle timer) const
+	{
+		return group(timer).elapsed[timer.index];
+	}
+
+	/*!
+	* \brief Changes the preset time of a timer (PT)
+	*
+	* \param The handle of the timer
+	* \param The preset time in milliseconds
+	*/
+	template<typename Handle>
+	void setPreset(Handle timer, std::int32_t preset)
+	{
+		group(timer).preset[timer.index] = preset;
+	}
+
+	/*!
+	* \brief Updates all timers
+	*
+	* \param The time since the last update in milliseconds
+	*/
+	void update(std::int32_t step)
+	{
+		{
+			const std::size_t count = onDelays_.preset.size();
+			const std::int32_t *preset = onDelays_.preset.data();
+			std::int32_t *elapsed = onDelays_.elapsed.data();
+			const std::uint8_t *in = onDelays_.in.data();
+			std::uint8_t *q = onDelays_.q.data();
+			std::uint8_t *previous = onDelays_.previous.data();
+			for(std::size_t i = 0; i < count; i++) {
+				// Times only after the update that saw the input set
+				std::int32_t time = (in[i] & previous[i]) ? std::min(elapsed[i] + step, preset[i]) : 0;
+				elapsed[i] = time;
+				q[i] = in[i] & (time >= preset[i]);
+				previous[i] = in[i];
+			}
+		}
+		{
+			const std::size_t count = offDelays_.preset.size();
+			const std::int32_t *preset = offDelays_.preset.data();
+			std::int32_t *elapsed = offDelays_.elapsed.data();
+			const std::uint8_t *in = offDelays_.in.data();
+			std::uint8_t *q = offDelays_.q.data();
+			std::uint8_t *previous = offDelays_.previous.data();
+			for(std::size_t i = 0; i < count; i++) {
+				// Times while the input is reset and the output still set, from 0 in the update that saw it reset
+				std::uint8_t running = q[i] & !in[i];
+				std::int32_t time = (in[i] | previous[i]) ? 0 : (running ? std::min(elapsed[i] + step, preset[i]) : elapsed[i]);
+				elapsed[i] = time;
+				q[i] = in[i] | (running & (time < preset[i]));
+				previous[i] = in[i];
+			}
+		}
+		{
+			const std::size_t count = pulses_.preset.size();
+			const std::int32_t *preset = pulses_.preset.data();
+			std::int32_t *elapsed = pulses_.elapsed.data();
+			const std::uint8_t *in = pulses_.in.data();
+			std::uint8_t *q = pulses_.q.data();
+			std::uint8_t *previous = pulses_.previous.data();
+			for(std::size_t i = 0; i < count; i++) {
+				// A rising edge starts a pulse unless one is running
+				std::uint8_t start = in[i] & !previous[i] & !q[i];
+				std::uint8_t pulsing = q[i] | start;
+				std::int32_t time = start ? 0 : (q[i] ? std::min(elapsed[i] + step, preset[i]) : elapsed[i]);
+				q[i] = pulsing & (time < preset[i]);
+				// The elapsed time is held at the preset time until the input is reset
+				elapsed[i] = (pulsing | in[i]) ? time : 0;
+				previous[i] = in[i];
+			}
+		}
+	}
+
+	/*!
+	* \brief Updates all timers by the time since the bank's previous tick
+	*/
+	virtual void tick(const Input &, Output &)
+	{
+		if(started_)
+			update(this->lastPeriod());
+		else
+			update(0);
+		started_ = true;
+	}
+
+	/*!
+	* \brief Returns the number of timers
+	*
+	* \return The number of timers of all kinds
+	*/
+	std::size_t size() const
+	{
+		return onDelays_.preset.size() + offDelays_.preset.size() + pulses_.preset.size();
+	}
+};
+
+#endif // STATE_MACHINE_TIMER_BANK_H
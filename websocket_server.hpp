@@ -0,0 +1,514 @@
+/*
+* \brief A WebSocket server streaming changes of the output of a StateMachineManager to dashboards
+*
+* Streamed members of the output structure are declared as named fields. Clients are sent a text message describing the
+* fields after connecting, then binary messages with the fields that changed since the previous message sent to them.
+* The server runs in a single thread driven by epoll, it reads the manager's output snapshot at a configurable rate, so
+* it never blocks the execution. A client that doesn't receive its messages fast enough gets no new ones until it
+* catches up, then it receives all the changes accumulated in the meantime in one message.
+*
+* A binary message starts with the 64-bit version of the output snapshot, followed by the changed fields, each one as
+* its 16-bit index followed by its contents. All numbers are little endian, as are the fields' contents.
+*
+* Available only on Linux.
+*/
+
+#ifndef WEBSOCKET_SERVER_H
+#define WEBSOCKET_SERVER_H
+
+#include "io_mapping.hpp"
+#include <thread>
+#include <stdexcept>
+#include <string>
+#include <cctype>
+#include <cerrno>
+#include <unordered_map>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+template<typename Input, typename Output>
+class WebSocketServer {
+	struct Field {
+		std::string name;
+		std::size_t offset;
+		std::size_t size;
+		std::size_t position; // In the baselines
+	};
+	struct Client {
+		std::string request;
+		bool open = false;
+		std::vector<std::uint8_t> received;
+		std::vector<std::uint8_t> toSend;
+		std::size_t sent = 0;
+		std::vector<unsigned char> baseline;
+		bool synchronised = false;
+	};
+
+	std::shared_ptr<const PublishedSnapshot<Output>> snapshot_;
+	std::vector<Field> fields_;
+	std::size_t baselineSize_ = 0;
+	std::unique_ptr<Output> output_;
+	std::uint64_t outputVersion_ = 0;
+	std::unordered_map<int, Client> clients_;
+	std::chrono::milliseconds period_;
+	int listener_ = -1;
+	int epoll_ = -1;
+	int wakeup_ = -1;
+	int port_ = 0;
+	std::atomic<int> clientCount_;
+	std::atomic<long long> messages_;
+	std::thread thread_;
+
+	static std::string sha1(const std::string &message)
+	{
+		std::uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+		std::string padded = message;
+		padded.push_back(char(0x80));
+		while(padded.size() % 64 != 56)
+			padded.push_back(0);
+		std::uint64_t bits = std::uint64_t(message.size()) * 8;
+		for(int i = 7; i >= 0; i--)
+			padded.push_back(char(bits >> (i * 8)));
+		auto rotate = [](std::uint32_t value, int by) {
+			return (value << by) | (value >> (32 - by));
+		};
+		for(std::size_t chunk = 0; chunk < padded.size(); chunk += 64) {
+			std::uint32_t words[80];
+			for(int i = 0; i < 16; i++)
+				words[i] = (std::uint32_t(std::uint8_t(padded[chunk + i * 4])) << 24) | (std::uint32_t(std::uint8_t(padded[chunk + i * 4 + 1])) << 16)
+						| (std::uint32_t(std::uint8_t(padded[chunk + i * 4 + 2])) << 8) | std::uint32_t(std::uint8_t(padded[chunk + i * 4 + 3]));
+			for(int i = 16; i < 80; i++)
+				words[i] = rotate(words[i - 3] ^ words[i - 8] ^ words[i - 14] ^ words[i - 16], 1);
+			std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+			for(int i = 0; i < 80; i++) {
+				std::uint32_t f, k;
+				if(i < 20) {
+					f = (b & c) | (~b & d);
+					k = 0x5A827999;
+				} else if(i < 40) {
+					f = b ^ c ^ d;
+					k = 0x6ED9EBA1;
+				} else if(i < 60) {
+					f = (b & c) | (b & d) | (c & d);
+					k = 0x8F1BBCDC;
+				} else {
+					f = b ^ c ^ d;
+					k = 0xCA62C1D6;
+				}
+				std::uint32_t temporary = rotate(a, 5) + f + e + k + words[i];
+				e = d;
+				d = c;
+				c = rotate(b, 30);
+				b = a;
+				a = temporary;
+			}
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+		}
+		std::string digest;
+		for(std::uint32_t word : state)
+			for(int i = 3; i >= 0; i--)
+				digest.push_back(char(word >> (i * 8)));
+		return digest;
+	}
+
+	static std::string base64(const std::string &data)
+	{
+		static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		std::string encoded;
+		for(std::size_t i = 0; i < data.size(); i += 3) {
+			std::uint32_t group = std::uint32_t(std::uint8_t(data[i])) << 16;
+			if(i + 1 < data.size()) group |= std::uint32_t(std::uint8_t(data[i + 1])) << 8;
+			if(i + 2 < data.size()) group |= std::uint8_t(data[i + 2]);
+			encoded.push_back(alphabet[(group >> 18) & 0x3f]);
+			encoded.push_back(alphabet[(group >> 12) & 0x3f]);
+			encoded.push_back(i + 1 < data.size() ? alphabet[(group >> 6) & 0x3f] : '=');
+			encoded.push_back(i + 2 < data.size() ? alphabet[group & 0x3f] : '=');
+		}
+		return encoded;
+	}
+
+	static void throwSystemError(const char *what)
+	{
+		throw std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+	}
+
+	static void appendFrame(std::vector<std::uint8_t> &to, std::uint8_t opcode, const std::uint8_t *payload, std::size_t size)
+	{
+		to.push_back(std::uint8_t(0x80 | opcode));
+		if(size < 126) {
+			to.push_back(std::uint8_t(size));
+		} else if(size < 0x10000) {
+			to.push_back(126);
+			to.push_back(std::uint8_t(size >> 8));
+			to.push_back(std::uint8_t(size));
+		} else {
+			to.push_back(127);
+			for(int i = 7; i >= 0; i--)
+				to.push_back(std::uint8_t(std::uint64_t(size) >> (i * 8)));
+		}
+		to.insert(to.end(), payload, payload + size);
+	}
+
+	std::string describeFields() const
+	{
+		std::string description = "{\"fields\":[";
+		for(std::size_t i = 0; i < fields_.size(); i++) {
+			if(i) description += ",";
+			description += "{\"name\":\"" + fields_[i].name + "\",\"size\":" + std::to_string(fields_[i].size) + "}";
+		}
+		return description + "]}";
+	}
+
+	// Appends a message with the fields that differ from the client's baseline and updates the baseline
+	void appendDelta(Client &client)
+	{
+		const unsigned char *source = reinterpret_cast<const unsigned char *>(output_.get());
+		std::vector<std::uint8_t> payload;
+		for(int i = 0; i < 8; i++)
+			payload.push_back(std::uint8_t(outputVersion_ >> (i * 8)));
+		for(std::size_t i = 0; i < fields_.size(); i++) {
+			const Field &field = fields_[i];
+			unsigned char *sent = client.baseline.data() + field.position;
+			if(client.synchronised && !std::memcmp(sent, source + field.offset, field.size))
+				continue;
+			std::memcpy(sent, source + field.offset, field.size);
+			payload.push_back(std::uint8_t(i));
+			payload.push_back(std::uint8_t(i >> 8));
+			payload.insert(payload.end(), source + field.offset, source + field.offset + field.size);
+		}
+		client.synchronised = true;
+		if(payload.size() == 8)
+			return;
+		appendFrame(client.toSend, 0x2, payload.data(), payload.size());
+		messages_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Returns false if the connection should be closed
+	bool flush(int socket, Client &client)
+	{
+		while(client.sent < client.toSend.size()) {
+			ssize_t written = ::send(socket, client.toSend.data() + client.sent, client.toSend.size() - client.sent, MSG_NOSIGNAL);
+			if(written < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				return false;
+			}
+			client.sent += written;
+		}
+		if(client.sent == client.toSend.size()) {
+			client.toSend.clear();
+			client.sent = 0;
+		}
+		epoll_event event = {};
+		event.events = EPOLLIN | (client.toSend.empty() ? 0u : std::uint32_t(EPOLLOUT));
+		event.data.fd = socket;
+		epoll_ctl(epoll_, EPOLL_CTL_MOD, socket, &event);
+		return true;
+	}
+
+	// Returns false if the connection should be closed
+	bool handshake(Client &client)
+	{
+		std::size_t end = client.request.find("\r\n\r\n");
+		if(end == std::string::npos)
+			return client.request.size() < 8192;
+		std::string lowered = client.request.substr(0, end);
+		for(char &letter : lowered)
+			letter = char(std::tolower(letter));
+		const std::string header = "\r\nsec-websocket-key:";
+		std::size_t found = lowered.find(header);
+		if(found == std::string::npos)
+			return false;
+		std::size_t start = client.request.find_first_not_of(' ', found + header.size());
+		std::size_t stop = client.request.find("\r\n", start);
+		std::string key = client.request.substr(start, stop - start);
+		while(!key.empty() && key.back() == ' ')
+			key.pop_back();
+		std::string accept = base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+		std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
+				+ accept + "\r\n\r\n";
+		client.toSend.insert(client.toSend.end(), response.begin(), response.end());
+		std::string description = describeFields();
+		appendFrame(client.toSend, 0x1, reinterpret_cast<const std::uint8_t *>(description.data()), description.size());
+		client.received.assign(client.request.begin() + end + 4, client.request.end());
+		client.request.clear();
+		client.open = true;
+		client.baseline.resize(baselineSize_);
+		clientCount_.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Handles control frames from the client, returns false if the connection should be closed
+	bool processReceived(Client &client)
+	{
+		std::vector<std::uint8_t> &received = client.received;
+		std::size_t position = 0;
+		while(received.size() - position >= 6) {
+			const std::uint8_t *frame = received.data() + position;
+			std::uint8_t opcode = frame[0] & 0x0f;
+			std::uint64_t length = frame[1] & 0x7f;
+			std::size_t header = 2;
+			if(length == 126) {
+				if(received.size() - position < 8) break;
+				length = (std::uint64_t(frame[2]) << 8) | frame[3];
+				header = 4;
+			} else if(length == 127) {
+				return false; // Dashboards have no reason to send anything this long
+			}
+			if(!(frame[1] & 0x80))
+				return false; // Client frames must be masked
+			if(received.size() - position < header + 4 + length)
+				break;
+			const std::uint8_t *mask = frame + header;
+			std::vector<std::uint8_t> payload(frame + header + 4, frame + header + 4 + length);
+			for(std::size_t i = 0; i < payload.size(); i++)
+				payload[i] ^= mask[i % 4];
+			position += header + 4 + length;
+			if(opcode == 0x8)
+				return false;
+			if(opcode == 0x9)
+				appendFrame(client.toSend, 0xA, payload.data(), payload.size());
+		}
+		received.erase(received.begin(), received.begin() + position);
+		return true;
+	}
+
+	void close(int socket)
+	{
+		auto found = clients_.find(socket);
+		if(found != clients_.end() && found->second.open)
+			clientCount_.fetch_sub(1, std::memory_order_relaxed);
+		epoll_ctl(epoll_, EPOLL_CTL_DEL, socket, nullptr);
+		::close(socket);
+		clients_.erase(socket);
+	}
+
+	void accept()
+	{
+		while(true) {
+			int socket = ::accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(socket < 0)
+				return;
+			int enabled = 1;
+			setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+			epoll_event event = {};
+			event.events = EPOLLIN;
+			event.data.fd = socket;
+			epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &event);
+			clients_[socket];
+		}
+	}
+
+	void serve(int socket, std::uint32_t events)
+	{
+		auto found = clients_.find(socket);
+		if(found == clients_.end())
+			return;
+		Client &client = found->second;
+		if(events & (EPOLLERR | EPOLLHUP)) {
+			close(socket);
+			return;
+		}
+		if(events & EPOLLIN) {
+			char buffer[4096];
+			while(true) {
+				ssize_t got = ::recv(socket, buffer, sizeof(buffer), 0);
+				if(got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+					close(socket);
+					return;
+				}
+				if(got < 0)
+					break;
+				if(client.open)
+					client.received.insert(client.received.end(), buffer, buffer + got);
+				else
+					client.request.append(buffer, got);
+			}
+			if(!client.open && !handshake(client)) {
+				close(socket);
+				return;
+			}
+			// Frames received together with the end of the handshake are processed right after it
+			if(client.open && !processReceived(client)) {
+				close(socket);
+				return;
+			}
+		}
+		if(!flush(socket, client))
+			close(socket);
+	}
+
+	void broadcast()
+	{
+		if(snapshot_->version() != outputVersion_)
+			outputVersion_ = snapshot_->read(*output_);
+		std::vector<int> failed;
+		for(auto &entry : clients_) {
+			Client &client = entry.second;
+			// Clients that didn't receive the previous message yet get the changes later, all at once
+			if(!client.open || !client.toSend.empty())
+				continue;
+			appendDelta(client);
+			if(!flush(entry.first, client))
+				failed.push_back(entry.first);
+		}
+		for(int socket : failed)
+			close(socket);
+	}
+
+	void run()
+	{
+		epoll_event events[64];
+		auto next = std::chrono::steady_clock::now() + period_;
+		while(true) {
+			int timeout = int(std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count());
+			int count = epoll_wait(epoll_, events, 64, std::max(timeout, 0));
+			for(int i = 0; i < count; i++) {
+				int socket = events[i].data.fd;
+				if(socket == wakeup_)
+					return;
+				if(socket == listener_)
+					accept();
+				else
+					serve(socket, events[i].events);
+			}
+			if(std::chrono::steady_clock::now() >= next) {
+				broadcast();
+				next += period_;
+			}
+		}
+	}
+
+public:
+	/*!
+	* \brief The constructor, does not start serving yet
+	*
+	* \param The manager whose output is streamed
+	* \param The period of sending changes to clients
+	*
+	* \note The execution must be paused, fields must be added and start() must be called while it's paused
+	*/
+	WebSocketServer(StateMachineManager<Input, Output> &manager, std::chrono::milliseconds period) :
+		snapshot_(manager.outputSnapshot()),
+		output_(std::make_unique<Output>(*manager.output())),
+		period_(period),
+		clientCount_(0),
+		messages_(0)
+	{
+	}
+
+	/*!
+	* \brief Destructor, stops the server and closes all connections
+	*/
+	~WebSocketServer()
+	{
+		if(thread_.joinable()) {
+			// The thread uses the members, so it must end before they are destroyed, a single write can't overflow
+			// the eventfd's counter and only an interruption can make it fail
+			std::uint64_t one = 1;
+			while(::write(wakeup_, &one, sizeof(one)) < 0 && errno == EINTR);
+			thread_.join();
+		}
+		for(auto &client : clients_)
+			::close(client.first);
+		for(int socket : { listener_, epoll_, wakeup_ })
+			if(socket >= 0)
+				::close(socket);
+	}
+
+	/*!
+	* \brief Adds a member of the output structure to the streamed fields
+	*
+	* \param The name under which the field is described to clients
+	* \param Pointer to the member, it must be trivially copyable
+	*/
+	template<typename T>
+	void addField(const std::string &name, T Output::*member)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable fields can be streamed");
+		fields_.push_back(Field{ name, memberOffset(member), sizeof(T), baselineSize_ });
+		baselineSize_ += sizeof(T);
+	}
+
+	/*!
+	* \brief Starts listening and serving in a new thread
+	*
+	* \param The TCP port, 0 picks any free port
+	* \param Whether to listen only on the loopback interface
+	*
+	* \note Throws std::runtime_error if the socket cannot be set up
+	*/
+	void start(int port, bool localOnly = false)
+	{
+		listener_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(listener_ < 0)
+			throwSystemError("Cannot create a WebSocket socket");
+		int enabled = 1;
+		setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(std::uint16_t(port));
+		address.sin_addr.s_addr = htonl(localOnly ? INADDR_LOOPBACK : INADDR_ANY);
+		if(::bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+			throwSystemError("Cannot bind the WebSocket socket");
+		if(::listen(listener_, SOMAXCONN) < 0)
+			throwSystemError("Cannot listen on the WebSocket socket");
+		socklen_t length = sizeof(address);
+		getsockname(listener_, reinterpret_cast<sockaddr *>(&address), &length);
+		port_ = ntohs(address.sin_port);
+
+		epoll_ = epoll_create1(EPOLL_CLOEXEC);
+		wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(epoll_ < 0 || wakeup_ < 0)
+			throwSystemError("Cannot set up the WebSocket server's event loop");
+		for(int socket : { listener_, wakeup_ }) {
+			epoll_event event = {};
+			event.events = EPOLLIN;
+			event.data.fd = socket;
+			epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &event);
+		}
+		thread_ = std::thread([this]() {
+			run();
+		});
+	}
+
+	/*!
+	* \brief Returns the port the server listens on, useful if started with port 0
+	*
+	* \return The port
+	*/
+	int port() const
+	{
+		return port_;
+	}
+
+	/*!
+	* \brief Returns the number of clients that finished the handshake and are connected
+	*
+	* \return The number of clients
+	*/
+	int clients() const
+	{
+		return clientCount_.load(std::memory_order_relaxed);
+	}
+
+	/*!
+	* \brief Returns the number of binary messages with changes sent to all clients together
+	*
+	* \return The number of messages
+	*/
+	long long messages() const
+	{
+		return messages_.load(std::memory_order_relaxed);
+	}
+};
+
+#endif // WEBSOCKET_SERVER_H